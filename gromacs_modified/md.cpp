@@ -159,43 +159,960 @@ using gmx::SimulationSignaller;
 
 // FIXME: Modified Gromacs - code block 1/2
 
-#include <fstream>
+#include "config.h"
+
+#include <array>
+#include <chrono>
+#include <climits>
+
+#include <sys/stat.h>
+
+#include "gromacs/mdlib/gmx_omp_nthreads.h"
+
+#include "traj_writer/average.hpp"
+#include "traj_writer/binning.hpp"
+#include "traj_writer/selection.hpp"
+#include "traj_writer/shm_writer.hpp"
+#include "traj_writer/writer.hpp"
+
+#if GMX_LIB_MPI
+#include "traj_writer/mpiio_writer.hpp"
+#endif
 
 const std::string out_file_name = "traj";     // Output file name without file extension
 const std::string out_file_name_ext = "out";  // Output file extension (e.g., "dat")
 
-const int N_out_frames_per_file = 1000;  // Number of frames to write into each out-file
+const std::string out_average_file_name = "traj_avg";  // Output file name of the averaged frames without file extension
+
+const int N_out_frames_per_file = 1000;  // Number of frames to write into each out-file (default of GMX_OUT_FILE_FRAMES)
+
+const int N_out_queue_depth = 4;  // Number of frames that can wait for the background writer
+
+std::unique_ptr<traj_writer::writer> out_writer;  // Created on the first output step
+
+int64_t out_restart_step = -1;  // Step of the checkpoint mdrun restarted from (-cpi), -1 for a new simulation
+
+std::unique_ptr<traj_writer::atom_selection<real>> out_atoms;  // Atoms to write, resolved on the first output step
+
+std::unique_ptr<traj_writer::block_average<real>> out_average;  // Running sums of the averaged frames (GMX_OUT_AVERAGE)
+std::unique_ptr<traj_writer::writer> out_average_writer;        // Writer of the averaged frames (main rank)
+
+std::unique_ptr<traj_binning::grid_binning> out_binning;     // Sums of the in-situ binning (GMX_OUT_BINNING)
+std::unique_ptr<traj_binning::grid_output>  out_grid_output;  // Writer of the output_<N>.NNNNNN.dat files (main rank)
+
+// With domain decomposition, write a single out-file with collective MPI-IO instead of per-rank shards
+const bool out_mpiio = (std::getenv("GMX_OUT_MPIIO") != nullptr);
+
+#if GMX_LIB_MPI
+std::unique_ptr<traj_writer::mpiio_writer> out_mpiio_writer;  // Created on the first output step
+#endif
+
+// Publish the frames into a shared-memory ring for consumers on the same node instead of writing out-files
+const char* out_shm_name = std::getenv("GMX_OUT_SHM");
+
+std::unique_ptr<traj_writer::shm_writer> out_shm_writer;  // Created on the first output step
+
+/*
+ * Cost of the custom output on this rank, printed at the end of md.log
+ */
+struct out_statistics
+{
+    double  seconds     = 0.0;  // Time in the custom output on the MD thread, including averaging and binning
+    double  max_seconds = 0.0;  // Longest step of the custom output
+
+    /*
+     * Adds a step of the custom output that started at `start`
+     */
+    void add(std::chrono::steady_clock::time_point start)
+    {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        seconds += elapsed;
+        max_seconds = std::max(max_seconds, elapsed);
+    }
+};
+
+out_statistics out_stats;
+
+/*
+ * Returns the fields to write, set by the environment variable GMX_OUT_FIELDS
+ * as a comma-separated list of "mass", "x", "v", "f", "vv" (default: "mass,x,v");
+ * "vv" (v⊗v) is only written into the averaged frames, "none" writes no frames (e.g. with GMX_OUT_BINNING)
+ */
+uint32_t out_fields()
+{
+    const char* list = std::getenv("GMX_OUT_FIELDS");
+
+    uint32_t fields = traj_format::field_mass | traj_format::field_x | traj_format::field_v;
+
+    if(list && !traj_writer::parse_fields(list, fields))
+    {
+        gmx_fatal(FARGS, "GMX_OUT_FIELDS should be none or a comma-separated list of mass, x, v, f, vv; got '%s'", list);
+    }
+
+    return fields;
+}
+
+/*
+ * Returns the encoding of the out-files, set by the environment variables
+ * GMX_OUT_LAYOUT: "aos" (default) or "soa" (structure of arrays),
+ * GMX_OUT_PRECISION: precision of quantized coordinates in nm (e.g. 0.001; default: full precision),
+ * GMX_OUT_COMPRESS: "lz" to compress the frames losslessly (default: "none"),
+ * GMX_OUT_HALF: "fp16" or "bf16" to store velocities and forces as 16-bit values (default: "none"), and
+ * GMX_OUT_DELTA: number of frames per keyframe, storing the frames in between as compressed
+ * XOR deltas to the previous frame (default: 0, every frame in full).
+ * The frames are packed by the OpenMP threads of mdrun; the out-files do not depend on their number.
+ */
+traj_writer::format_options out_format_options()
+{
+    traj_writer::format_options options;
+
+    options.threads = gmx_omp_nthreads_get(ModuleMultiThread::Default);
+
+    const char* precision = std::getenv("GMX_OUT_PRECISION");
+
+    if(precision)
+    {
+        char* end = nullptr;
+        options.precision = std::strtod(precision, &end);
+
+        if(end == precision || *end != '\0' || !(options.precision > 0.0))
+        {
+            gmx_fatal(FARGS, "GMX_OUT_PRECISION should be a positive number (nm); got '%s'", precision);
+        }
+    }
+
+    const char* layout = std::getenv("GMX_OUT_LAYOUT");
+
+    if(layout && std::string(layout) == "soa")
+    {
+        options.layout = traj_format::layout_soa;
+    }
+    else if(layout && std::string(layout) != "aos")
+    {
+        gmx_fatal(FARGS, "GMX_OUT_LAYOUT should be aos or soa; got '%s'", layout);
+    }
+
+    const char* compress = std::getenv("GMX_OUT_COMPRESS");
+
+    if(compress && std::string(compress) == "lz")
+    {
+        options.compress = true;
+    }
+    else if(compress && std::string(compress) != "none")
+    {
+        gmx_fatal(FARGS, "GMX_OUT_COMPRESS should be none or lz; got '%s'", compress);
+    }
+
+    const char* half = std::getenv("GMX_OUT_HALF");
+
+    if(half && std::string(half) == "fp16")
+    {
+        options.half = traj_format::field_half_fp16;
+    }
+    else if(half && std::string(half) == "bf16")
+    {
+        options.half = traj_format::field_half_bf16;
+    }
+    else if(half && std::string(half) != "none")
+    {
+        gmx_fatal(FARGS, "GMX_OUT_HALF should be none, fp16 or bf16; got '%s'", half);
+    }
+
+    const char* delta = std::getenv("GMX_OUT_DELTA");
+
+    if(delta)
+    {
+        char* end = nullptr;
+        const long interval = std::strtol(delta, &end, 10);
+
+        if(end == delta || *end != '\0' || interval < 0 || interval > INT_MAX)
+        {
+            gmx_fatal(FARGS, "GMX_OUT_DELTA should be a number of frames per keyframe; got '%s'", delta);
+        }
+
+        options.keyframe_interval = static_cast<int>(interval);
+    }
+
+    return options;
+}
+
+/*
+ * Returns how the out-files are written, set by the environment variable GMX_OUT_IO:
+ * "buffered" (default), or "direct" (preallocated files written with O_DIRECT, bypassing the page cache)
+ * and/or "uring" (writes submitted through io_uring, several in flight), e.g. "direct,uring".
+ * Both fall back to buffered writes where the system does not support them.
+ */
+traj_writer::io_options out_io_options()
+{
+    traj_writer::io_options options;
+
+    const char* io = std::getenv("GMX_OUT_IO");
+
+    if(io && !traj_writer::parse_io(io, options))
+    {
+        gmx_fatal(FARGS, "GMX_OUT_IO should be buffered or a comma-separated list of direct, uring; got '%s'", io);
+    }
+
+    return options;
+}
+
+/*
+ * Returns the size in the environment variable `name` with the value `bytes`, in bytes, with an optional
+ * K, M, G or T suffix (e.g. "20G")
+ */
+uint64_t out_parse_bytes(const char* name, const char* bytes)
+{
+    char* end = nullptr;
+    const long long value = std::strtoll(bytes, &end, 10);
+
+    int shift = 0;
+
+    switch(end != bytes ? *end : '?')
+    {
+        case '\0': break;
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+        case 'T': shift = 40; end++; break;
+        default: end = nullptr; break;
+    }
+
+    if(!end || *end != '\0' || value <= 0 || value > (LLONG_MAX >> shift))
+    {
+        gmx_fatal(FARGS, "%s should be a positive size in bytes with an optional K, M, G or T suffix; got '%s'", name, bytes);
+    }
+
+    return static_cast<uint64_t>(value) << shift;
+}
+
+/*
+ * Returns the limits on the out-files not yet processed by the consumer, set by the environment
+ * variables GMX_OUT_MAX_FILES (number of files), GMX_OUT_MAX_BYTES (size, with an optional K, M, G or T
+ * suffix, e.g. "20G") and GMX_OUT_REDUCED_STRIDE (write only every n-th frame while more than half of
+ * the budget is used, instead of waiting for the consumer). The consumer writes the number of out-files
+ * it has processed into `traj.ack` (see `water_pure/driver.sh`). Default: no limits.
+ */
+traj_writer::budget_options out_budget_options()
+{
+    traj_writer::budget_options budget;
+
+    if(const char* files = std::getenv("GMX_OUT_MAX_FILES"))
+    {
+        char* end = nullptr;
+        const long value = std::strtol(files, &end, 10);
+
+        if(end == files || *end != '\0' || value <= 0 || value > INT_MAX)
+        {
+            gmx_fatal(FARGS, "GMX_OUT_MAX_FILES should be a positive number of files; got '%s'", files);
+        }
+
+        budget.max_files = static_cast<int>(value);
+    }
+
+    if(const char* bytes = std::getenv("GMX_OUT_MAX_BYTES"))
+    {
+        budget.max_bytes = out_parse_bytes("GMX_OUT_MAX_BYTES", bytes);
+    }
+
+    if(const char* stride = std::getenv("GMX_OUT_REDUCED_STRIDE"))
+    {
+        char* end = nullptr;
+        const long value = std::strtol(stride, &end, 10);
+
+        if(end == stride || *end != '\0' || value < 2 || value > INT_MAX)
+        {
+            gmx_fatal(FARGS, "GMX_OUT_REDUCED_STRIDE should be a number of frames of at least 2; got '%s'", stride);
+        }
+
+        if(budget.max_files == 0 && budget.max_bytes == 0)
+        {
+            gmx_fatal(FARGS, "GMX_OUT_REDUCED_STRIDE needs GMX_OUT_MAX_FILES or GMX_OUT_MAX_BYTES");
+        }
+
+        budget.reduced_stride = static_cast<int>(value);
+    }
+
+    return budget;
+}
+
+/*
+ * Returns the limits on the size and duration of each out-file, set by the environment variables
+ * GMX_OUT_FILE_BYTES (size of the frames as the consumer holds them in memory, with an optional K, M,
+ * G or T suffix, e.g. "2G") and GMX_OUT_FILE_SECONDS (wall time). Default: no limits.
+ */
+traj_writer::rotation_options out_rotation_options()
+{
+    traj_writer::rotation_options rotation;
+
+    if(const char* bytes = std::getenv("GMX_OUT_FILE_BYTES"))
+    {
+        rotation.max_bytes = out_parse_bytes("GMX_OUT_FILE_BYTES", bytes);
+    }
+
+    if(const char* seconds = std::getenv("GMX_OUT_FILE_SECONDS"))
+    {
+        char* end = nullptr;
+        rotation.max_seconds = std::strtod(seconds, &end);
+
+        if(end == seconds || *end != '\0' || !(rotation.max_seconds > 0.0))
+        {
+            gmx_fatal(FARGS, "GMX_OUT_FILE_SECONDS should be a positive wall time in seconds; got '%s'", seconds);
+        }
+    }
+
+    return rotation;
+}
+
+/*
+ * Returns the maximum number of frames in each out-file, set by the environment variable
+ * GMX_OUT_FILE_FRAMES. Default: `N_out_frames_per_file`, or no limit if GMX_OUT_FILE_BYTES or
+ * GMX_OUT_FILE_SECONDS limits the out-files instead (0).
+ */
+int out_frames_per_file()
+{
+    if(const char* frames = std::getenv("GMX_OUT_FILE_FRAMES"))
+    {
+        char* end = nullptr;
+        const long value = std::strtol(frames, &end, 10);
+
+        if(end == frames || *end != '\0' || value <= 0 || value > INT_MAX)
+        {
+            gmx_fatal(FARGS, "GMX_OUT_FILE_FRAMES should be a positive number of frames; got '%s'", frames);
+        }
+
+        return static_cast<int>(value);
+    }
+
+    const traj_writer::rotation_options rotation = out_rotation_options();
+
+    return (rotation.max_bytes > 0 || rotation.max_seconds > 0.0) ? 0 : N_out_frames_per_file;
+}
+
+/*
+ * Returns the directories the out-files are spread over, set by the environment variable GMX_OUT_DIRS
+ * (colon-separated list, e.g. "/nvme0/run:/nvme1/run"): round-robin or, if GMX_OUT_DIRS_FREE_SPACE is
+ * set, into the directory with the most free space. Default: the working directory.
+ */
+traj_writer::stripe_options out_stripe_options()
+{
+    traj_writer::stripe_options stripe;
+
+    if(const char* dirs = std::getenv("GMX_OUT_DIRS"))
+    {
+        const std::string list = dirs;
+
+        for(size_t begin = 0; begin <= list.size();)
+        {
+            const size_t end = std::min(list.find(':', begin), list.size());
+
+            std::string dir = list.substr(begin, end - begin);
+
+            while(dir.size() > 1 && dir.back() == '/')
+            {
+                dir.pop_back();
+            }
+
+            struct stat st;
+
+            if(dir.empty() || ::stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            {
+                gmx_fatal(FARGS, "GMX_OUT_DIRS should be a colon-separated list of existing directories; got '%s'", dirs);
+            }
+
+            stripe.directories.push_back(dir);
+
+            begin = end + 1;
+        }
+    }
+
+    stripe.free_space = (std::getenv("GMX_OUT_DIRS_FREE_SPACE") != nullptr);
+
+    return stripe;
+}
+
+/*
+ * With shards, makes all PP ranks follow shard 0 so the shards of an out-file hold the same frames:
+ * starts new out-files with this frame once the current out-file of shard 0 spans GMX_OUT_FILE_SECONDS
+ * of wall time, and reduces the output stride while more than half of the budget of shard 0 is used
+ * (GMX_OUT_REDUCED_STRIDE). Must be called by all PP ranks before the frame is written.
+ */
+void out_sync_shards(const t_commrec* cr)
+{
+    static const double seconds = out_rotation_options().max_seconds;       // Parsed once
+    static const bool   reduced = out_budget_options().reduced_stride > 0;  // Parsed once
+
+    // The writers are created on the first output step on all ranks
+    if((seconds <= 0.0 && !reduced) || !out_writer)
+    {
+        return;
+    }
+
+    int decisions[2] = { 0, 0 };  // Rotate, reduce the stride
+
+    if(cr->dd->rank == 0)
+    {
+        decisions[0] = (seconds > 0.0 && out_writer->file_seconds() >= seconds) ? 1 : 0;
+        decisions[1] = out_writer->throttling() ? 1 : 0;
+    }
+
+    gmx_bcast(sizeof(decisions), decisions, cr->mpi_comm_mygroup);
+
+    if(decisions[0])
+    {
+        out_writer->rotate();
+    }
+
+    if(reduced)
+    {
+        out_writer->throttle(decisions[1] != 0);
+    }
+}
+
+/*
+ * Returns the number of slots of the shared-memory ring, set by the environment variable
+ * GMX_OUT_SHM_SLOTS (default: 8)
+ */
+int out_shm_slots()
+{
+    const char* slots = std::getenv("GMX_OUT_SHM_SLOTS");
+
+    if(!slots)
+    {
+        return 8;
+    }
+
+    char* end = nullptr;
+    const long nslots = std::strtol(slots, &end, 10);
+
+    if(end == slots || *end != '\0' || nslots < 2 || nslots > 4096)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_SHM_SLOTS should be a number of slots from 2 to 4096; got '%s'", slots);
+    }
+
+    return static_cast<int>(nslots);
+}
+
+/*
+ * Returns the name of the file with the state of the out-files at the last checkpoints,
+ * "traj.restart" or, with shards, "traj.rank0007.restart"
+ */
+std::string out_restart_file(int shard)
+{
+    return out_file_name + (shard >= 0 ? ".rank" + traj_writer::zero_pad(shard, 4) : "") + ".restart";
+}
+
+/*
+ * Keeps the out-files in step with the checkpoints of mdrun. On the first step, remembers the step of a
+ * restart from a checkpoint, so the out-files are continued from it, or removes the state and the manifest
+ * (traj.manifest) left by an earlier simulation; a restart with outputs that cannot be continued
+ * (GMX_OUT_MPIIO, GMX_OUT_AVERAGE, GMX_OUT_BINNING) is refused. On checkpoint steps, flushes the frames of all earlier steps
+ * to the disk and stores the state of the out-files in traj.restart. Returns 0 on error and -1 on success.
+ */
+int out_checkpoint(int64_t step, int shard, bool first_step, bool restarted, bool checkpoint)
+{
+    if(first_step)
+    {
+        out_restart_step = restarted ? step : -1;
+
+        // These outputs are not continued: they would start again at .000000 and overwrite the files of the stopped run
+        const char* restarting = out_mpiio                        ? "GMX_OUT_MPIIO"
+                                 : std::getenv("GMX_OUT_AVERAGE") ? "GMX_OUT_AVERAGE"
+                                 : std::getenv("GMX_OUT_BINNING") ? "GMX_OUT_BINNING"
+                                                                  : nullptr;
+
+        if(restarted && restarting)
+        {
+            gmx_fatal(FARGS, "%s cannot be continued after a restart from a checkpoint; its files would be overwritten. "
+                      "Unset %s to continue the run without it, or start a new simulation", restarting, restarting);
+        }
+
+        if(!restarted)
+        {
+            std::remove(out_restart_file(shard).c_str());
+        }
+
+        // The manifest of an earlier simulation, shared by all shards
+        if(!restarted && shard <= 0)
+        {
+            std::remove(traj_manifest::manifest_name(out_file_name).c_str());
+        }
+    }
+
+    if(checkpoint && out_writer && !out_writer->checkpoint(out_restart_file(shard), step))
+    {
+        return 0;  // Error writing the frames or the state
+    }
+
+    return -1;
+}
+
+/*
+ * Returns the fields to write at this step: x every `nstxout`, v every `nstvout` and f every
+ * `nstfout` steps. If `nstvout` or `nstfout` is 0 (not set), `nstxout` is used instead.
+ * Returns 0 if nothing should be written.
+ */
+uint32_t out_step_fields(const t_inputrec &ir, int64_t step)
+{
+    static const uint32_t fields = out_fields();  // Parsed once
+
+    const int nstv = ir.nstvout > 0 ? ir.nstvout : ir.nstxout;
+    const int nstf = ir.nstfout > 0 ? ir.nstfout : ir.nstxout;
+
+    uint32_t step_fields = 0;
+
+    if((fields & traj_format::field_x) && do_per_step(step, ir.nstxout))
+    {
+        step_fields |= traj_format::field_x;
+    }
+    if((fields & traj_format::field_v) && do_per_step(step, nstv))
+    {
+        step_fields |= traj_format::field_v;
+    }
+    if((fields & traj_format::field_f) && do_per_step(step, nstf))
+    {
+        step_fields |= traj_format::field_f;
+    }
+
+    // Masses are static and written once per out-file
+    return step_fields ? (step_fields | (fields & traj_format::field_mass)) : 0;
+}
+
+/*
+ * Returns the number of steps averaged into each averaged frame, set by the environment
+ * variable GMX_OUT_AVERAGE (default: 0, no averaged frames)
+ */
+int out_average_steps()
+{
+    const char* steps = std::getenv("GMX_OUT_AVERAGE");
+
+    if(!steps)
+    {
+        return 0;
+    }
+
+    char* end = nullptr;
+    const long value = std::strtol(steps, &end, 10);
+
+    if(end == steps || *end != '\0' || value <= 0 || value > INT_MAX)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_AVERAGE should be a positive number of steps; got '%s'", steps);
+    }
+
+    return static_cast<int>(value);
+}
+
+/*
+ * Returns the grids of the in-situ binning, set by the environment variable GMX_OUT_BINNING to the
+ * box size in nm as the second argument of `read_traj.exe` ("7", "10" or "15"; default: no binning)
+ */
+std::array<int, traj_binning::N_grids> out_binning_grids()
+{
+    const char* boxsize = std::getenv("GMX_OUT_BINNING");
+
+    std::array<int, traj_binning::N_grids> grids{};
+
+    if(boxsize && !traj_binning::grids_for_box(boxsize, grids))
+    {
+        gmx_fatal(FARGS, "GMX_OUT_BINNING should be the box size 7, 10 or 15; got '%s'", boxsize);
+    }
+
+    return grids;
+}
+
+/*
+ * Returns the static per-atom data written once into each out-file (masses if `fields` has
+ * `field_mass`), in global atom order
+ */
+traj_writer::static_data out_static_data(const gmx_mtop_t &mtop, uint32_t fields)
+{
+    traj_writer::static_data atoms;
+
+    if(!(fields & traj_format::field_mass))
+    {
+        return atoms;
+    }
+
+    atoms.mass.reserve(mtop.natoms);
+
+    for (const AtomProxy atomP : AtomRange(mtop))
+    {
+        const t_atom& local = atomP.atom();
+
+        atoms.mass.push_back(local.m);  // Atom mass
+        // atoms.charge.push_back(local.q);  // Atom charge
+        // atoms.type.push_back(local.type);  // Atom type
+    }
+
+    return atoms;
+}
+
+/*
+ * Returns the global indices of the atoms to write, set by the environment variables
+ * GMX_OUT_NDX: index file (.ndx) and GMX_OUT_GROUP: name of its group (default: the first group), or
+ * GMX_OUT_SELECTION: comma-separated residue names and @atom names, "!" excludes (e.g. "!SOL,!NA,!CL").
+ * Returns an empty list to write all atoms.
+ */
+std::vector<int> out_selected_atoms(const gmx_mtop_t &mtop)
+{
+    std::vector<int> atoms;
+
+    const char* ndx = std::getenv("GMX_OUT_NDX");
+    const char* selection = std::getenv("GMX_OUT_SELECTION");
+
+    if(ndx && selection)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_NDX and GMX_OUT_SELECTION cannot be combined");
+    }
+
+    if(ndx)
+    {
+        const char* group = std::getenv("GMX_OUT_GROUP");
+
+        if(!traj_writer::read_ndx_group(ndx, group ? group : "", atoms))
+        {
+            gmx_fatal(FARGS, "Cannot read group '%s' from the GMX_OUT_NDX file '%s'", group ? group : "(first)", ndx);
+        }
+
+        for (int atom : atoms)
+        {
+            if(atom < 0 || atom >= mtop.natoms)
+            {
+                gmx_fatal(FARGS, "The GMX_OUT_NDX group contains atom %d, but the system has %d atoms", atom + 1, mtop.natoms);
+            }
+        }
+    }
+    else if(selection)
+    {
+        traj_writer::name_selection names;
+
+        if(!names.parse(selection))
+        {
+            gmx_fatal(FARGS, "GMX_OUT_SELECTION should be a comma-separated list of residue names and @atom names; got '%s'", selection);
+        }
+
+        for (const AtomProxy atomP : AtomRange(mtop))
+        {
+            if(names.matches(atomP.residueName(), atomP.atomName()))
+            {
+                atoms.push_back(atomP.globalAtomNumber());
+            }
+        }
+    }
+
+    if((ndx || selection) && atoms.empty())
+    {
+        gmx_fatal(FARGS, "The atom selection of GMX_OUT_NDX or GMX_OUT_SELECTION is empty");
+    }
+
+    return atoms;
+}
+
+/*
+ * Returns the atoms to write and their static data, resolving the selection on the first call
+ */
+traj_writer::static_data out_selected_static_data(const gmx_mtop_t &mtop, uint32_t fields)
+{
+    if(!out_atoms)
+    {
+        out_atoms = std::make_unique<traj_writer::atom_selection<real>>(out_selected_atoms(mtop), mtop.natoms);
+    }
+
+    traj_writer::static_data atoms = out_static_data(mtop, fields);
+
+    return out_atoms->all() ? atoms : out_atoms->selected_static(atoms);
+}
+
+/*
+ * Writes all queued frames, stops the writer thread and renames the last output file
+ */
+int out_file_close()
+{
+    if(out_writer && !out_writer->close())
+    {
+        return 0;  // Error writing or renaming the file
+    }
+
+    if(out_writer && out_writer->dropped() > 0)
+    {
+        printf("\n==== %llu frames skipped with GMX_OUT_REDUCED_STRIDE while the consumer fell behind ====\n\n",
+               static_cast<unsigned long long>(out_writer->dropped()));
+    }
+
+    if(out_average_writer && !out_average_writer->close())
+    {
+        return 0;  // Error writing or renaming the file of the averaged frames
+    }
+
+    if(out_grid_output && !out_grid_output->close())
+    {
+        return 0;  // Error writing or renaming the files of the binned frames
+    }
 
-int N_out_frame_counter = 0;  // Counts `write_out_frame` function calls
+    if(out_shm_writer && !out_shm_writer->close())
+    {
+        return 0;  // Error removing the shared-memory ring
+    }
 
-std::ofstream out_file;  // Output file stream
+#if GMX_LIB_MPI
+    if(out_mpiio_writer && !out_mpiio_writer->close())
+    {
+        return 0;  // Error writing or renaming the shared file
+    }
+#endif
 
-std::string out_file_name_to_close;  // Previous output file name (used to add extension)
+    return -1;
+}
 
 /*
- * Writes variable `var` to the file stream
+ * Prints the cost of the custom output into md.log after `out_file_close`: frames and bytes written,
+ * throughput over the run, time per frame on the MD thread and the time it waited for the writer
+ * threads or the consumers of the shared-memory ring. With domain decomposition, all PP ranks take
+ * part: bytes and waiting times are summed, times per frame are the maximum over the ranks.
  */
-template <typename T> inline void write_data_to_out(T var)
+void out_print_statistics(FILE* fplog, const t_commrec* cr, double run_seconds)
 {
-    out_file.write(reinterpret_cast<char*>(&var), sizeof(var));
+    const bool shards = haveDDAtomOrdering(*cr);
+
+    // Bytes, seconds and waiting time of this rank
+    std::vector<double> sums(3, 0.0);
+
+    sums[1] = out_stats.seconds;
+
+    // Frames queued, published or written by this rank (every shard holds the same frames)
+    int64_t frames = 0;
+
+    for(const auto* w : { out_writer.get(), out_average_writer.get() })
+    {
+        if(w)
+        {
+            frames += w->frames();
+            sums[0] += w->bytes();
+            sums[2] += w->blocked();
+        }
+    }
+
+    if(out_shm_writer)
+    {
+        frames += out_shm_writer->frames();
+        sums[0] += out_shm_writer->bytes();
+        sums[2] += out_shm_writer->blocked();
+    }
+
+#if GMX_LIB_MPI
+    if(out_mpiio_writer)
+    {
+        frames += out_mpiio_writer->frames();
+        sums[0] += out_mpiio_writer->bytes();
+    }
+#endif
+
+    // Longest step on each rank
+    std::vector<double> maxima(shards ? cr->dd->nnodes : 1, 0.0);
+
+    maxima[shards ? cr->dd->rank : 0] = out_stats.max_seconds;
+
+    if(shards)
+    {
+        gmx_sumd(sums.size(), sums.data(), cr);
+        gmx_sumd(maxima.size(), maxima.data(), cr);
+    }
+
+    if(!MAIN(cr) || !fplog || (frames == 0 && sums[0] == 0.0 && !out_grid_output))
+    {
+        return;
+    }
+
+    const double ranks = maxima.size();
+    const double mb    = sums[0] / 1.0e6;
+
+    fprintf(fplog, "\n   Custom trajectory output (Modified Gromacs%s):\n\n", shards ? ", summed over the PP ranks" : "");
+    fprintf(fplog, "   Frames written             %12lld\n", static_cast<long long>(frames));
+    fprintf(fplog, "   Data written (MB)          %12.1f\n", mb);
+    fprintf(fplog, "   Throughput (MB/s)          %12.1f\n", run_seconds > 0 ? mb / run_seconds : 0.0);
+    fprintf(fplog, "   Time on MD thread (s)      %12.3f   (%.1f%% of the run)\n", sums[1] / ranks,
+            run_seconds > 0 ? 100.0 * sums[1] / ranks / run_seconds : 0.0);
+    fprintf(fplog, "   Mean time per frame (ms)   %12.3f\n", frames > 0 ? 1.0e3 * sums[1] / ranks / frames : 0.0);
+    fprintf(fplog, "   Max time per step (ms)     %12.3f\n", 1.0e3 * *std::max_element(maxima.begin(), maxima.end()));
+    fprintf(fplog, "   Blocked on full queue (s)  %12.3f\n\n", sums[2] / ranks);
 }
 
 /*
- * Correctly closes the output file stream and renames the output file adding the extension
+ * Adds the coordinates and velocities of this step to the running sums and, every `GMX_OUT_AVERAGE`
+ * steps, queues their average over the last `GMX_OUT_AVERAGE` steps for writing into the out-files
+ * of the averaged frames; blocks that started before the run (e.g. the first step) are not written.
+ *
+ * The averaged fields are x and v, and v⊗v if GMX_OUT_FIELDS has "vv"; only the atoms selected by
+ * `out_selected_atoms` are averaged. Must be called on every step. With domain decomposition,
+ * `global_index` are the global indices of the home atoms and `reduce` is true: all PP ranks must
+ * call this function, the sums of all ranks are added up and the main rank writes the frames.
  */
-int out_file_close()
+int average_out_frame(const t_commrec* cr,
+                      int64_t step,
+                      real t,
+                      const rvec* box,
+                      int natoms,
+                      int nhome,
+                      const rvec* x,
+                      const rvec* v,
+                      const gmx_mtop_t &mtop,
+                      const int* global_index,
+                      bool reduce)
+{
+    static const int steps = out_average_steps();  // Parsed once
+
+    if(steps == 0)
+    {
+        return -1;
+    }
+
+    const uint32_t fields = out_fields();
+
+    if(!out_average)
+    {
+        if(!(fields & (traj_format::field_x | traj_format::field_v | traj_format::field_vv)))
+        {
+            gmx_fatal(FARGS, "GMX_OUT_AVERAGE requires x, v or vv in GMX_OUT_FIELDS");
+        }
+
+        traj_writer::static_data atoms = out_selected_static_data(mtop, fields);
+
+        const int nout = out_atoms->all() ? natoms : static_cast<int>(out_atoms->atoms().size());
+
+        out_average = std::make_unique<traj_writer::block_average<real>>(nout, fields);
+
+        if(MAIN(cr))
+        {
+            printf("\n==== MODIFIED GROMACS -- Writes averages over %d time steps into %s.*.%s! ====\n\n",
+                   steps, out_average_file_name.c_str(), out_file_name_ext.c_str());
+
+            out_average_writer = std::make_unique<traj_writer::writer>(
+                    out_average_file_name, out_file_name_ext, out_frames_per_file(), N_out_queue_depth, std::move(atoms), -1,
+                    out_format_options(), out_io_options(), traj_writer::budget_options(), out_rotation_options());
+        }
+    }
+
+    traj_writer::frame_view<real> frame;
+
+    frame.step = step;
+    frame.time = t;
+    frame.box = box;
+    frame.natoms = nhome;
+    frame.natoms_global = natoms;
+    frame.x = (fields & traj_format::field_x) ? x : nullptr;
+    frame.v = (fields & (traj_format::field_v | traj_format::field_vv)) ? v : nullptr;
+    frame.index = global_index;
+
+    // Only the selected atoms, with their positions in the selection
+    if(!out_atoms->all())
+    {
+        frame = out_atoms->gather(frame);
+    }
+
+    // The first step of a block sets the reference positions of the minimum image
+    if(out_average->samples() == 0)
+    {
+        out_average->set_reference(frame);
+
+        std::vector<double>& reference = out_average->reference();
+
+        if(reduce && !reference.empty())
+        {
+            gmx_sumd(reference.size(), reference.data(), cr);
+        }
+    }
+
+    out_average->add(frame);
+
+    if(do_per_step(step, steps))
+    {
+        if(out_average->samples() == steps)
+        {
+            std::vector<double>& sums = out_average->sums();
+
+            if(reduce)
+            {
+                gmx_sumd(sums.size(), sums.data(), cr);
+            }
+
+            if(out_average_writer && !out_average_writer->push(out_average->average(frame)))
+            {
+                return 0;  // Error writing an earlier frame
+            }
+        }
+
+        out_average->reset();
+    }
+
+    return -1;
+}
+
+/*
+ * Bins the mass, momentum and velocity tensor of the atoms onto the grids of GMX_OUT_BINNING every
+ * `nstxout` steps and appends the records to the files output_<N>.NNNNNN.dat, as `read_traj.exe`
+ * does with the out-files, so the frames need not be written at all (GMX_OUT_FIELDS=none).
+ *
+ * `x`, `v` and `mass` are the `nhome` atoms of this rank; all atoms are binned, regardless of
+ * the atom selection. The sums use the OpenMP threads of mdrun. With domain decomposition `reduce`
+ * is true: all PP ranks must call this function, the sums of all ranks are added up and the main
+ * rank writes the records.
+ */
+int bin_out_frame(const t_commrec* cr,
+                  const t_inputrec &ir,
+                  int64_t step,
+                  real t,
+                  const rvec* box,
+                  int nhome,
+                  const rvec* x,
+                  const rvec* v,
+                  const real* mass,
+                  bool reduce)
 {
-    if(out_file && out_file.is_open())
+    static const std::array<int, traj_binning::N_grids> grids = out_binning_grids();  // Parsed once
+
+    if(grids[0] == 0 || !do_per_step(step, ir.nstxout))
     {
-        out_file.close();
+        return -1;
+    }
+
+    if(!out_binning)
+    {
+        out_binning = std::make_unique<traj_binning::grid_binning>(grids);
+
+        if(MAIN(cr))
+        {
+            printf("\n==== MODIFIED GROMACS -- Writes grids of %d, %d and %d cells per box edge into output_<N>.*.dat! ====\n\n",
+                   grids[0], grids[1], grids[2]);
+
+            out_grid_output = std::make_unique<traj_binning::grid_output>(grids, N_out_frames_per_file);
+        }
+    }
+
+    out_binning->reset();
+
+    // Cubic box, as in `read_traj.exe`
+    const real L = box[XX][XX];
+
+    if(!out_binning->add(nhome, &x[0][XX], &x[0][YY], &x[0][ZZ], &v[0][XX], &v[0][YY], &v[0][ZZ], DIM, mass, L,
+                         gmx_omp_nthreads_get(ModuleMultiThread::Default)))
+    {
+        gmx_fatal(FARGS, "Cannot assign an atom to a cell of the GMX_OUT_BINNING grids");
+    }
+
+    if(reduce)
+    {
+        std::vector<double>& sums = out_binning->sums();
+
+        gmx_sumd(sums.size(), sums.data(), cr);
+    }
 
-        // Full file name with extension
-        std::string new_file_name = out_file_name_to_close + "." + out_file_name_ext;
+    if(out_grid_output)
+    {
+        out_binning->finish(t, step, L);
 
-        // Add file extension
-        if(std::rename(out_file_name_to_close.c_str(), new_file_name.c_str()) != 0)
+        if(!out_grid_output->write(*out_binning))
         {
-            return 0;  // Error renaming file
+            return 0;  // Error writing the records
         }
     }
 
@@ -203,114 +1120,342 @@ int out_file_close()
 }
 
 /*
- * Writes entire frame (full trajectory at the given time step) to the file stream
+ * Queues entire frame (full trajectory at the given time step) for writing to the out-file.
+ * The frame is copied, so the MD loop can continue while the frame is written in the background.
+ *
+ * `natoms` is the total number of atoms and `nhome` the number of atoms in `x`, `v`, `f`;
+ * only the `fields` returned by `out_step_fields` are written.
+ * The masses are taken from `mtop` and written only once per out-file.
+ * Only the atoms selected by `out_selected_atoms` are written, together with their global indices.
+ * With domain decomposition, `global_index` are the global indices of the home atoms and `shard`
+ * the rank; each rank then writes its own shard files. Otherwise `global_index` is nullptr and
+ * `shard` is -1.
  */
 int write_out_frame(int64_t step,
                     real t,
                     const rvec* box,
                     int natoms,
+                    int nhome,
                     const rvec* x,
                     const rvec* v,
                     const rvec* f,
-                    const std::vector<real> &mass,
+                    uint32_t fields,
+                    const gmx_mtop_t &mtop,
+                    const int* global_index,
+                    int shard,
                     bool last_step)
 {
     // Initial output
-    if(!step)
+    if(!out_writer && shard <= 0)
     {
-        printf("\n==== MODIFIED GROMACS -- Writes full trajectories every `nstxout` time steps! ====\n\n");
+        printf("\n==== MODIFIED GROMACS -- Writes full trajectories every `nstxout`/`nstvout`/`nstfout` time steps! ====\n\n");
     }
 
-    // Should we create a new file or not
-    bool new_file = !static_cast<bool>(N_out_frame_counter % N_out_frames_per_file);
-
-    if(new_file)
+    if(!out_writer)
     {
-        // Close and rename the output file if needed
-        if(!out_file_close())
+        traj_writer::static_data atoms = out_selected_static_data(mtop, fields);
+
+        if(!out_atoms->all() && shard <= 0)
         {
-            return 0;  // Error renaming the file
+            printf("==== Writing %zu of %d atoms (GMX_OUT_NDX / GMX_OUT_SELECTION) ====\n\n", out_atoms->atoms().size(), natoms);
         }
 
-        // New file name suffix
-        int file_suffix = N_out_frame_counter / N_out_frames_per_file;
-
-        // Convert the number to a string
-        std::string num_str = std::to_string(file_suffix);
+        traj_writer::budget_options budget = out_budget_options();
 
-        // Add leading zeros if necessary
-        std::string num_str_zeros = std::string(6 - num_str.length(), '0') + num_str;
+        if((budget.max_files > 0 || budget.max_bytes > 0) && shard <= 0)
+        {
+            printf("==== At most %d files / %llu bytes not yet acknowledged in %s.ack; %s ====\n\n",
+                   budget.max_files, static_cast<unsigned long long>(budget.max_bytes), out_file_name.c_str(),
+                   budget.reduced_stride > 0 ? "every n-th frame (GMX_OUT_REDUCED_STRIDE) above half of it" : "waiting for the consumer");
+        }
 
-        // Full file name (without extension)
-        std::string fname = out_file_name + "." + num_str_zeros;
+        const int frames_per_file = out_frames_per_file();
 
-        // Save the file name for renaming purposes later
-        out_file_name_to_close = fname;
+        traj_writer::rotation_options rotation = out_rotation_options();
 
-        // Open binary file for writing
-        out_file.open(fname, std::ios::binary);
+        if((frames_per_file != N_out_frames_per_file || rotation.max_bytes > 0 || rotation.max_seconds > 0.0) && shard <= 0)
+        {
+            printf("==== A new out-file every %d frames (0: no limit), %llu bytes of frames (0: no limit) or %g s (0: no limit), whichever comes first ====\n\n",
+                   frames_per_file, static_cast<unsigned long long>(rotation.max_bytes), rotation.max_seconds);
+        }
 
-        // Check if the file is opened successfully
-        if(out_file && out_file.is_open())
+        // With shards, shard 0 decides when the wall time is up for all ranks (out_sync_shards)
+        if(shard >= 0)
         {
-            // All good
+            rotation.max_seconds = 0.0;
         }
-        else
+
+        traj_writer::stripe_options stripe = out_stripe_options();
+
+        if(!stripe.directories.empty() && shard <= 0)
         {
-            return 0;  // Error opening file
+            printf("==== Out-files spread over %zu directories (GMX_OUT_DIRS) %s; see %s.manifest for their paths ====\n\n",
+                   stripe.directories.size(), stripe.free_space ? "by free space" : "round-robin", out_file_name.c_str());
         }
-    }
 
-    // Write data
-    if(out_file.is_open())
-    {
-        // MD box size
-        float Lx = box[0][0];
-        float Ly = box[1][1];
-        float Lz = box[2][2];
-        
-        int step_int = static_cast<int>(step);  // Time step - narrowing for writing
-        
-        // Header
-        write_data_to_out(step_int);  // Current time step (int)
-        write_data_to_out(natoms);    // Number of atoms (int)
-        write_data_to_out(t);         // Current time (float)
-        write_data_to_out(Lx);        // Box size Lx (float)
-        write_data_to_out(Ly);        // Box size Ly (float)
-        write_data_to_out(Lz);        // Box size Lz (float)
+        out_writer = std::make_unique<traj_writer::writer>(
+                out_file_name, out_file_name_ext, frames_per_file, N_out_queue_depth, std::move(atoms), shard,
+                out_format_options(), out_io_options(), std::move(budget), rotation, std::move(stripe));
 
-        // Frame
-        for(int n = 0; n < natoms; n++)
+        // Continue the out-files written before the checkpoint instead of overwriting them
+        if(out_restart_step >= 0)
         {
-            write_data_to_out(mass[n]);  // Atom mass (float)
+            int64_t resumed_step = -1;
+
+            if(!out_writer->resume(out_restart_file(shard), out_restart_step, resumed_step))
+            {
+                return 0;  // Error opening the out-file of the checkpoint
+            }
 
-            for(int d = 0; d < 3; d++)
+            if(shard <= 0 && resumed_step >= 0)
+            {
+                printf("==== Continuing the out-files from the checkpoint at step %lld ====\n\n", static_cast<long long>(resumed_step));
+            }
+            else if(shard <= 0)
             {
-                write_data_to_out(x[n][d]);  // Coordinates (float)
-                write_data_to_out(v[n][d]);  // Velocities (float)
-                // write_data_to_out(f[n][d]);  // Forces (float)
+                printf("==== No state of the out-files for the checkpoint at step %lld (%s); starting again at %s.000000 ====\n\n",
+                       static_cast<long long>(out_restart_step), out_restart_file(shard).c_str(), out_file_name.c_str());
             }
         }
     }
-    else
+
+    traj_writer::frame_view<real> frame;
+
+    frame.step = step;
+    frame.time = t;
+    frame.box = box;
+    frame.natoms = nhome;
+    frame.natoms_global = natoms;
+    frame.x = (fields & traj_format::field_x) ? x : nullptr;
+    frame.v = (fields & traj_format::field_v) ? v : nullptr;
+    frame.f = (fields & traj_format::field_f) ? f : nullptr;
+    frame.index = global_index;
+
+    // Only the selected atoms, with their positions in the selection
+    if(!out_atoms->all())
     {
-        return 0;
+        frame = out_atoms->gather(frame);
     }
 
-    N_out_frame_counter++;
+    if(!out_writer->push(frame))
+    {
+        return 0;  // Error writing an earlier frame
+    }
 
-    // Close and rename the output file if needed
+    // Flush the queue, close and rename the output file if needed
     if(last_step)
     {
-        if(!out_file_close())
+        return out_file_close();
+    }
+
+    return -1;
+}
+
+/*
+ * Publishes a frame into the shared-memory ring GMX_OUT_SHM instead of the out-files; consumers
+ * on the same node (e.g. `traj_reader::shm_reader`) read it without any file.
+ * If a consumer falls GMX_OUT_SHM_SLOTS frames behind, mdrun waits for it or, with GMX_OUT_SHM_DROP,
+ * skips the frame. Only a single PP rank (no domain decomposition) publishes frames.
+ * Returns 0 on error and -1 on success.
+ */
+int write_out_frame_shm(int64_t step,
+                        real t,
+                        const rvec* box,
+                        int natoms,
+                        const rvec* x,
+                        const rvec* v,
+                        const rvec* f,
+                        uint32_t fields,
+                        const gmx_mtop_t &mtop,
+                        int shard,
+                        bool last_step)
+{
+    if(!out_shm_writer && shard >= 0)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_SHM requires a single PP rank (no domain decomposition)");
+    }
+
+    if(!out_shm_writer && out_format_options().compress)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_COMPRESS cannot be combined with GMX_OUT_SHM");
+    }
+
+    if(!out_shm_writer && out_format_options().keyframe_interval > 1)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_DELTA cannot be combined with GMX_OUT_SHM");
+    }
+
+    if(!out_shm_writer)
+    {
+        const int  nslots = out_shm_slots();
+        const bool drop   = (std::getenv("GMX_OUT_SHM_DROP") != nullptr);
+
+        printf("\n==== MODIFIED GROMACS -- Publishes full trajectories every `nstxout`/`nstvout`/`nstfout` time steps into the shared memory /%s (%d slots%s)! ====\n\n",
+               out_shm_name, nslots, drop ? ", frames dropped for slow consumers" : "");
+
+        traj_writer::static_data atoms = out_selected_static_data(mtop, fields);
+
+        if(!out_atoms->all())
         {
-            return 0;  // Error renaming the file
+            printf("==== Writing %zu of %d atoms (GMX_OUT_NDX / GMX_OUT_SELECTION) ====\n\n", out_atoms->atoms().size(), natoms);
         }
+
+        // Slots fit frames of all fields that may be written
+        const uint32_t max_fields = out_fields() & (traj_format::field_x | traj_format::field_v | traj_format::field_f);
+
+        out_shm_writer = std::make_unique<traj_writer::shm_writer>(
+                out_shm_name, nslots, max_fields, std::move(atoms), out_format_options(), drop);
+    }
+
+    traj_writer::frame_view<real> frame;
+
+    frame.step = step;
+    frame.time = t;
+    frame.box = box;
+    frame.natoms = natoms;
+    frame.natoms_global = natoms;
+    frame.x = (fields & traj_format::field_x) ? x : nullptr;
+    frame.v = (fields & traj_format::field_v) ? v : nullptr;
+    frame.f = (fields & traj_format::field_f) ? f : nullptr;
+
+    // Only the selected atoms, with their positions in the selection
+    if(!out_atoms->all())
+    {
+        frame = out_atoms->gather(frame);
+    }
+
+    if(!out_shm_writer->write(frame))
+    {
+        return 0;  // Error creating the ring
+    }
+
+    // Mark the end of the frames for the consumers
+    if(last_step)
+    {
+        return out_file_close();
     }
 
     return -1;
 }
 
+/*
+ * Writes the home atoms of this rank into a single out-file shared by all PP ranks, using
+ * collective MPI-IO; the file layout is the same as for a single-rank run.
+ * Must be called by all PP ranks on the same steps.
+ */
+int write_out_frame_mpiio(const t_commrec* cr,
+                          int64_t step,
+                          real t,
+                          const rvec* box,
+                          int natoms,
+                          int nhome,
+                          const rvec* x,
+                          const rvec* v,
+                          const rvec* f,
+                          uint32_t fields,
+                          const gmx_mtop_t &mtop,
+                          const int* global_index,
+                          bool last_step)
+{
+#if GMX_LIB_MPI
+    // Initial output
+    if(!out_mpiio_writer && MAIN(cr))
+    {
+        printf("\n==== MODIFIED GROMACS -- Writes full trajectories every `nstxout`/`nstvout`/`nstfout` time steps (MPI-IO)! ====\n\n");
+    }
+
+    if(!out_mpiio_writer && std::getenv("GMX_OUT_PRECISION"))
+    {
+        gmx_fatal(FARGS, "GMX_OUT_PRECISION cannot be combined with GMX_OUT_MPIIO");
+    }
+
+    if(!out_mpiio_writer && out_format_options().compress)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_COMPRESS cannot be combined with GMX_OUT_MPIIO");
+    }
+
+    if(!out_mpiio_writer && out_format_options().half)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_HALF cannot be combined with GMX_OUT_MPIIO");
+    }
+
+    if(!out_mpiio_writer && out_format_options().keyframe_interval > 1)
+    {
+        gmx_fatal(FARGS, "GMX_OUT_DELTA cannot be combined with GMX_OUT_MPIIO");
+    }
+
+    if(!out_mpiio_writer && (out_rotation_options().max_bytes > 0 || out_rotation_options().max_seconds > 0.0))
+    {
+        gmx_fatal(FARGS, "GMX_OUT_FILE_BYTES and GMX_OUT_FILE_SECONDS cannot be combined with GMX_OUT_MPIIO; use GMX_OUT_FILE_FRAMES");
+    }
+
+    if(!out_mpiio_writer && std::getenv("GMX_OUT_DIRS"))
+    {
+        gmx_fatal(FARGS, "GMX_OUT_DIRS cannot be combined with GMX_OUT_MPIIO");
+    }
+
+    if(!out_mpiio_writer)
+    {
+        traj_writer::static_data atoms = out_selected_static_data(mtop, fields);
+
+        if(!out_atoms->all() && MAIN(cr))
+        {
+            printf("==== Writing %zu of %d atoms (GMX_OUT_NDX / GMX_OUT_SELECTION) ====\n\n", out_atoms->atoms().size(), natoms);
+        }
+
+        out_mpiio_writer = std::make_unique<traj_writer::mpiio_writer>(
+                cr->mpi_comm_mygroup, out_file_name, out_file_name_ext, out_frames_per_file(), std::move(atoms),
+                out_format_options());
+    }
+
+    traj_writer::frame_view<real> frame;
+
+    frame.step = step;
+    frame.time = t;
+    frame.box = box;
+    frame.natoms = nhome;
+    frame.natoms_global = natoms;
+    frame.x = (fields & traj_format::field_x) ? x : nullptr;
+    frame.v = (fields & traj_format::field_v) ? v : nullptr;
+    frame.f = (fields & traj_format::field_f) ? f : nullptr;
+    frame.index = global_index;
+
+    // Only the selected atoms, with their positions in the selection
+    if(!out_atoms->all())
+    {
+        frame = out_atoms->gather(frame);
+    }
+
+    if(!out_mpiio_writer->write(frame))
+    {
+        return 0;  // Error writing the frame
+    }
+
+    // Close and rename the output file if needed
+    if(last_step)
+    {
+        return out_file_close();
+    }
+
+    return -1;
+#else
+    GMX_UNUSED_VALUE(cr);
+    GMX_UNUSED_VALUE(step);
+    GMX_UNUSED_VALUE(t);
+    GMX_UNUSED_VALUE(box);
+    GMX_UNUSED_VALUE(natoms);
+    GMX_UNUSED_VALUE(nhome);
+    GMX_UNUSED_VALUE(x);
+    GMX_UNUSED_VALUE(v);
+    GMX_UNUSED_VALUE(f);
+    GMX_UNUSED_VALUE(fields);
+    GMX_UNUSED_VALUE(mtop);
+    GMX_UNUSED_VALUE(global_index);
+    GMX_UNUSED_VALUE(last_step);
+
+    gmx_fatal(FARGS, "GMX_OUT_MPIIO requires GROMACS built with an MPI library");
+#endif
+}
 
 void gmx::LegacySimulator::do_md()
 {
@@ -1767,24 +2912,133 @@ void gmx::LegacySimulator::do_md()
                     // FIXME: Modified Gromacs - code block 2/2
 
                     /*
-                     * Custom output to a binary file
+                     * Custom output to a binary file.
+                     * With domain decomposition every PP rank writes its home atoms into its own shard,
+                     * or into a single shared file with collective MPI-IO if GMX_OUT_MPIIO is set.
+                     * The fields (GMX_OUT_FIELDS) follow `nstxout`, `nstvout` and `nstfout`;
+                     * the atoms can be restricted to a selection (GMX_OUT_NDX, GMX_OUT_SELECTION).
+                     * Averages over GMX_OUT_AVERAGE steps are written into separate out-files.
+                     * With GMX_OUT_BINNING the frames are binned onto grids in situ (output_<N>.*.dat).
+                     * With GMX_OUT_SHM the frames are published into a shared-memory ring instead of files.
+                     * Its cost is counted as "Write traj." in the cycle accounting and summarized in md.log.
                      */
-                    if (MAIN(cr) && do_per_step(step, ir->nstxout))
+                    wallcycle_stop(wcycle, WallCycleCounter::Update);
+                    wallcycle_start(wcycle, WallCycleCounter::Traj);
+
+                    const auto     outStart  = std::chrono::steady_clock::now();
+                    const bool     outShards = haveDDAtomOrdering(*cr);
+                    const uint32_t outFields = out_step_fields(*ir, step);
+
+                    // Flush the out-files with each checkpoint and continue them after a restart (traj.restart)
+                    if ((MAIN(cr) || outShards)
+                        && !out_checkpoint(step,
+                                           outShards ? cr->dd->rank : -1,
+                                           bFirstStep,
+                                           startingBehavior != StartingBehavior::NewSimulation,
+                                           checkpointHandler->isCheckpointingStep()))
                     {
+                        gmx_file("Cannot flush the out-files for the checkpoint; maybe you are out of disk space?");
+                    }
+
+                    if (MAIN(cr) || outShards)
+                    {
+                        if (!average_out_frame(cr,
+                                               step,
+                                               t,
+                                               const_cast<rvec*>(state->box),
+                                               top_global.natoms,
+                                               md->homenr,
+                                               const_cast<rvec*>(state->x.rvec_array()),
+                                               const_cast<rvec*>(state->v.rvec_array()),
+                                               top_global,
+                                               outShards ? cr->dd->globalAtomIndices.data() : nullptr,
+                                               outShards))
+                        {
+                            gmx_file("Cannot write trajectory frame to the out-file; maybe you are out of disk space?");
+                        }
+
+                        if (!bin_out_frame(cr,
+                                           *ir,
+                                           step,
+                                           t,
+                                           const_cast<rvec*>(state->box),
+                                           md->homenr,
+                                           const_cast<rvec*>(state->x.rvec_array()),
+                                           const_cast<rvec*>(state->v.rvec_array()),
+                                           md->massT.data(),
+                                           outShards))
+                        {
+                            gmx_file("Cannot write the binned frame to the output files; maybe you are out of disk space?");
+                        }
+                    }
+
+                    if (outShards && out_mpiio && outFields)
+                    {
+                        if (!write_out_frame_mpiio(cr,
+                                                   step,
+                                                   t,
+                                                   const_cast<rvec*>(state->box),
+                                                   top_global.natoms,
+                                                   md->homenr,
+                                                   const_cast<rvec*>(state->x.rvec_array()),
+                                                   const_cast<rvec*>(state->v.rvec_array()),
+                                                   as_rvec_array(forceCombined.unpaddedConstArrayRef().data()),
+                                                   outFields,
+                                                   top_global,
+                                                   cr->dd->globalAtomIndices.data(),
+                                                   bLastStep && step_rel == ir->nsteps))
+                        {
+                            gmx_file("Cannot write trajectory frame to the out-file; maybe you are out of disk space?");
+                        }
+                    }
+                    else if ((MAIN(cr) || outShards) && out_shm_name && outFields)
+                    {
+                        if (!write_out_frame_shm(step,
+                                                 t,
+                                                 const_cast<rvec*>(state->box),
+                                                 top_global.natoms,
+                                                 const_cast<rvec*>(state->x.rvec_array()),
+                                                 const_cast<rvec*>(state->v.rvec_array()),
+                                                 as_rvec_array(forceCombined.unpaddedConstArrayRef().data()),
+                                                 outFields,
+                                                 top_global,
+                                                 outShards ? cr->dd->rank : -1,
+                                                 bLastStep && step_rel == ir->nsteps))
+                        {
+                            gmx_file("Cannot publish trajectory frame to the shared-memory ring; maybe /dev/shm is full?");
+                        }
+                    }
+                    else if ((MAIN(cr) || outShards) && outFields)
+                    {
+                        // All shards start new out-files and reduce the stride with the same frames
+                        if (outShards)
+                        {
+                            out_sync_shards(cr);
+                        }
+
                         if (!write_out_frame(step,
                                              t,
                                              const_cast<rvec*>(state->box),
                                              top_global.natoms,
+                                             md->homenr,
                                              const_cast<rvec*>(state->x.rvec_array()),
                                              const_cast<rvec*>(state->v.rvec_array()),
                                              as_rvec_array(forceCombined.unpaddedConstArrayRef().data()),
-                                             md->massT,
+                                             outFields,
+                                             top_global,
+                                             outShards ? cr->dd->globalAtomIndices.data() : nullptr,
+                                             outShards ? cr->dd->rank : -1,
                                              bLastStep && step_rel == ir->nsteps))
                         {
                             gmx_file("Cannot write trajectory frame to the out-file; maybe you are out of disk space?");
                         }
                     }
 
+                    out_stats.add(outStart);
+
+                    wallcycle_stop(wcycle, WallCycleCounter::Traj);
+                    wallcycle_start(wcycle, WallCycleCounter::Update);
+
 
                     upd.update_coords(*ir,
                                       step,
@@ -2282,6 +3536,17 @@ void gmx::LegacySimulator::do_md()
     }
     /* End of main MD loop */
 
+    // FIXME: Modified Gromacs - flush the custom output if the last step was not an output step
+    wallcycle_start(wcycle, WallCycleCounter::Traj);
+    const auto outStart = std::chrono::steady_clock::now();
+    if (!out_file_close())
+    {
+        gmx_file("Cannot write trajectory frame to the out-file; maybe you are out of disk space?");
+    }
+    out_stats.add(outStart);
+    wallcycle_stop(wcycle, WallCycleCounter::Traj);
+    out_print_statistics(fplog, cr, walltime_accounting_get_time_since_start(walltime_accounting));
+
     /* Closing TNG files can include compressing data. Therefore it is good to do that
      * before stopping the time measurements. */
     mdoutf_tng_close(outf);
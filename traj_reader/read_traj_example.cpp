@@ -16,6 +16,9 @@ int main()
     {
         int i = trj.size() - 1; // Frame index
 
+        // Coordinates and velocities as arrays of vectors (files written with GMX_OUT_LAYOUT=soa are converted)
+        traj_reader::to_aos(trj[i]);
+
         // Print the frame header (Frame number, current time step, number of atoms, current time, box size)
         std::cout << "Frame " << i << ":"
                   << " step=" << trj[i].step
@@ -1,8 +1,33 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "traj_writer/codec.hpp"
+#include "traj_writer/format.hpp"
+#include "traj_writer/half.hpp"
+#include "traj_writer/manifest.hpp"
+#include "traj_writer/shm_ring.hpp"
+
+// Version 1 files do not record which fields were written: define MD_FORCES if they contain forces
 #define NO_MD_FORCES
 
 namespace traj_reader
@@ -21,25 +46,220 @@ struct float_vec
     float_type x, y, z;
 };
 
+/*
+ * Symmetric 3x3 tensor (e.g. v⊗v)
+ */
+struct float_sym
+{
+    float_type xx, yy, zz, xy, xz, yz;
+};
+
+/*
+ * Components of a 3D vector field in structure-of-arrays layout
+ */
+struct float_soa
+{
+    std::vector<float_type> x, y, z;
+
+    size_t size() const
+    {
+        return x.size();
+    }
+
+    bool empty() const
+    {
+        return x.empty();
+    }
+
+    void resize(size_t n)
+    {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+
+    void clear()
+    {
+        x = {};
+        y = {};
+        z = {};
+    }
+};
+
+/*
+ * Read-only array shared between frames (e.g. masses, which do not change during the run)
+ */
+template <typename T>
+class shared_array
+{
+public:
+    shared_array() = default;
+
+    explicit shared_array(std::vector<T> values)
+        : ptr(std::make_shared<const std::vector<T>>(std::move(values)))
+    {
+    }
+
+    const T &operator[](size_t i) const
+    {
+        return (*ptr)[i];
+    }
+
+    const T *data() const
+    {
+        return ptr ? ptr->data() : nullptr;
+    }
+
+    size_t size() const
+    {
+        return ptr ? ptr->size() : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /*
+     * Returns true if both arrays share the same storage
+     */
+    bool same(const shared_array &other) const
+    {
+        return ptr == other.ptr;
+    }
+
+    /*
+     * Returns a copy of the values
+     */
+    std::vector<T> to_vector() const
+    {
+        return ptr ? *ptr : std::vector<T>();
+    }
+
+private:
+    std::shared_ptr<const std::vector<T>> ptr;
+};
+
 /*
  * Contains data related to a single frame
  */
 struct frame
 {
-    int natoms{0}; // Number of atoms
-    int step{0};   // Current time step
+    int natoms{0};   // Number of atoms
+    int64_t step{0}; // Current time step
 
     float_type time{0.0}; // Current time
 
     float_vec box; // Box size
 
-    std::vector<float_type> mass; // Mass
+    float_vec box_vectors[3]{}; // Full triclinic box (version 2 files only)
+
+    uint32_t fields{0}; // Fields present in the frame (traj_format::field bitmask)
+
+    traj_format::layout layout{traj_format::layout_aos}; // Whether r, v, f or r_soa, v_soa, f_soa are filled
+
+    shared_array<float_type> mass;   // Mass (shared by all frames of a file)
+    shared_array<float_type> charge; // Charge (shared by all frames of a file, empty if not written)
+    shared_array<int> type;          // Atom type (shared by all frames of a file, empty if not written)
 
     std::vector<float_vec> r; // Coordinate
     std::vector<float_vec> v; // Velocity
-#ifdef MD_FORCES
-    std::vector<float_vec> f; // Force
-#endif
+    std::vector<float_vec> f; // Force (empty if not written)
+
+    float_soa r_soa; // Coordinate (SoA layout)
+    float_soa v_soa; // Velocity (SoA layout)
+    float_soa f_soa; // Force (SoA layout, empty if not written)
+
+    std::vector<float_sym> vv; // Average of v⊗v (averaged frames, both layouts; empty if not written)
+
+    std::vector<int> id; // Atom index in the file (shard files only)
+
+    shared_array<int> global_id; // Global atom index of each atom of the file (atom selections only, shared)
+};
+
+/*
+ * Returns the global atom index (in the simulated system) of atom `n` of the frame,
+ * mapping shard indices (`id`) and atom selections (`global_id`)
+ */
+inline int global_index(const frame &f, int n)
+{
+    const int i = f.id.empty() ? n : f.id[n];
+
+    return f.global_id.empty() ? i : f.global_id[i];
+}
+
+/*
+ * Converts the frame to the array-of-structures layout (r, v, f), releasing the SoA arrays
+ */
+void to_aos(frame &f)
+{
+    if (f.layout == traj_format::layout_aos)
+    {
+        return;
+    }
+
+    std::pair<float_soa *, std::vector<float_vec> *> fields[] = {{&f.r_soa, &f.r}, {&f.v_soa, &f.v}, {&f.f_soa, &f.f}};
+
+    for (auto &field : fields)
+    {
+        const float_soa &src = *field.first;
+        std::vector<float_vec> &dst = *field.second;
+
+        dst.resize(src.size());
+
+        for (size_t n = 0; n < src.size(); n++)
+        {
+            dst[n] = {src.x[n], src.y[n], src.z[n]};
+        }
+
+        field.first->clear();
+    }
+
+    f.layout = traj_format::layout_aos;
+}
+
+/*
+ * Converts the frame to the structure-of-arrays layout (r_soa, v_soa, f_soa), releasing the AoS arrays
+ */
+void to_soa(frame &f)
+{
+    if (f.layout == traj_format::layout_soa)
+    {
+        return;
+    }
+
+    std::pair<std::vector<float_vec> *, float_soa *> fields[] = {{&f.r, &f.r_soa}, {&f.v, &f.v_soa}, {&f.f, &f.f_soa}};
+
+    for (auto &field : fields)
+    {
+        const std::vector<float_vec> &src = *field.first;
+        float_soa &dst = *field.second;
+
+        dst.resize(src.size());
+
+        for (size_t n = 0; n < src.size(); n++)
+        {
+            dst.x[n] = src[n].x;
+            dst.y[n] = src[n].y;
+            dst.z[n] = src[n].z;
+        }
+
+        *field.first = {};
+    }
+
+    f.layout = traj_format::layout_soa;
+}
+
+/*
+ * Static per-atom data of a file, in the atom order of the file.
+ * In shard frames, use `id[n]` to look up the static data of atom `n`.
+ */
+struct static_section
+{
+    shared_array<float_type> mass;
+    shared_array<float_type> charge;
+    shared_array<int> type;
+    shared_array<int> id; // Global atom indices (atom selections only)
 };
 
 /*
@@ -48,94 +268,1545 @@ struct frame
 typedef std::vector<frame> traj;
 
 /*
- * Reads trajectory from the output file.
- * Returns the number of atoms or 0 in case of error.
+ * Reads the file header of a version 2 file.
+ * Returns false and rewinds the stream if the file has no header (version 1).
  */
-int read(const std::string &fname, traj &trj)
+bool read_file_header(std::istream &in_file, traj_format::file_header &header)
 {
-    // Open the binary file for reading
-    std::ifstream in_file(fname, std::ios::binary);
+    in_file.read(reinterpret_cast<char *>(&header), sizeof(header));
 
-    // Check if the file opened successfully
-    if (!in_file && in_file.is_open())
+    if (in_file && std::memcmp(header.magic, traj_format::file_magic, sizeof(header.magic)) == 0)
     {
-        std::cerr << "Error opening file for reading: " << fname << std::endl;
-        return 0;
+        return true;
     }
 
-    // Create an empty frame
-    frame f;
+    in_file.clear();
+    in_file.seekg(0);
 
-    // Number of atoms
-    int natoms{0};
+    return false;
+}
 
-    // Read file
-    while (!in_file.eof())
+/*
+ * Converts a floating-point value of the given width (4 or 8 bytes) to float_type
+ */
+inline float_type read_float(const char *p, uint32_t float_width)
+{
+    if (float_width == sizeof(double))
     {
-        // Read header
-        in_file.read(reinterpret_cast<char *>(&f.step), sizeof(f.step));
-        in_file.read(reinterpret_cast<char *>(&f.natoms), sizeof(f.natoms));
-        in_file.read(reinterpret_cast<char *>(&f.time), sizeof(f.time));
-        in_file.read(reinterpret_cast<char *>(&f.box.x), sizeof(f.box.x));
-        in_file.read(reinterpret_cast<char *>(&f.box.y), sizeof(f.box.y));
-        in_file.read(reinterpret_cast<char *>(&f.box.z), sizeof(f.box.z));
+        double val;
+        std::memcpy(&val, p, sizeof(val));
+        return static_cast<float_type>(val);
+    }
 
-        if (f.natoms <= 0)
+    float val;
+    std::memcpy(&val, p, sizeof(val));
+    return static_cast<float_type>(val);
+}
+
+/*
+ * Converts `n` consecutive floating-point values of the given width to float_type.
+ * Returns the position after the values.
+ */
+inline const char *read_floats(const char *p, float_type *dst, size_t n, uint32_t float_width)
+{
+    if (n == 0)
+    {
+        return p;
+    }
+
+    if (float_width == sizeof(float_type))
+    {
+        std::memcpy(dst, p, n * sizeof(float_type));
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
         {
-            std::cerr << "Error in trajectory file " << fname << ": Natoms = " << f.natoms << std::endl;
-            return 0;
+            dst[i] = read_float(p + i * float_width, float_width);
         }
+    }
 
-        // Allocate memory for the frame if needed
-        if (f.mass.size() == 0)
+    return p + n * float_width;
+}
+
+/*
+ * Reads the static section of a version 2 file, which follows the file header.
+ * Returns false in case of error.
+ */
+bool read_static(std::istream &in_file, const traj_format::file_header &header, static_section &statics)
+{
+    using namespace traj_format;
+
+    const int natoms = header.natoms;
+
+    std::vector<char> raw(header.float_width * static_cast<size_t>(natoms));
+
+    if (header.static_fields & field_mass)
+    {
+        in_file.read(raw.data(), raw.size());
+
+        std::vector<float_type> mass(natoms);
+
+        for (int n = 0; n < natoms; n++)
         {
-            natoms = f.natoms; // Number of atoms should not change
-            f.mass.resize(natoms);
-            f.r.resize(natoms);
-            f.v.resize(natoms);
-#ifdef MD_FORCES
-            f.f.resize(natoms);
-#endif
+            mass[n] = read_float(raw.data() + n * header.float_width, header.float_width);
         }
 
-        if (natoms != f.natoms)
+        statics.mass = shared_array<float_type>(std::move(mass));
+    }
+
+    if (header.static_fields & field_charge)
+    {
+        in_file.read(raw.data(), raw.size());
+
+        std::vector<float_type> charge(natoms);
+
+        for (int n = 0; n < natoms; n++)
         {
-            std::cerr << "Error in trajectory file " << fname << ": Inconsistent number of atoms." << std::endl;
-            return 0;
+            charge[n] = read_float(raw.data() + n * header.float_width, header.float_width);
         }
 
-        // Read frame
-        for (int n = 0; n < natoms; n++)
+        statics.charge = shared_array<float_type>(std::move(charge));
+    }
+
+    if (header.static_fields & field_type)
+    {
+        std::vector<int> type(natoms);
+
+        in_file.read(reinterpret_cast<char *>(type.data()), natoms * sizeof(int32_t));
+
+        statics.type = shared_array<int>(std::move(type));
+    }
+
+    if (header.static_fields & field_index)
+    {
+        std::vector<int> id(natoms);
+
+        in_file.read(reinterpret_cast<char *>(id.data()), natoms * sizeof(int32_t));
+
+        statics.id = shared_array<int>(std::move(id));
+    }
+
+    return static_cast<bool>(in_file);
+}
+
+/*
+ * Reads per-atom values in the array-of-structures layout into the frame.
+ * Returns the position after the values.
+ */
+inline const char *read_values_aos(const char *p, uint32_t fields, uint32_t w, frame &f, std::vector<float_type> &mass)
+{
+    using namespace traj_format;
+
+    for (int n = 0; n < f.natoms; n++)
+    {
+        if (fields & field_index)
         {
-            in_file.read(reinterpret_cast<char *>(&f.mass[n]), sizeof(float_type));
-            in_file.read(reinterpret_cast<char *>(&f.r[n].x), sizeof(float_type));
-            in_file.read(reinterpret_cast<char *>(&f.v[n].x), sizeof(float_type));
-#ifdef MD_FORCES
-            in_file.read(reinterpret_cast<char *>(&f.f[n].x), sizeof(float_type));
-#endif
-            in_file.read(reinterpret_cast<char *>(&f.r[n].y), sizeof(float_type));
-            in_file.read(reinterpret_cast<char *>(&f.v[n].y), sizeof(float_type));
-#ifdef MD_FORCES
-            in_file.read(reinterpret_cast<char *>(&f.f[n].y), sizeof(float_type));
-#endif
-            in_file.read(reinterpret_cast<char *>(&f.r[n].z), sizeof(float_type));
-            in_file.read(reinterpret_cast<char *>(&f.v[n].z), sizeof(float_type));
-#ifdef MD_FORCES
-            in_file.read(reinterpret_cast<char *>(&f.f[n].z), sizeof(float_type));
-#endif
+            std::memcpy(&f.id[n], p, sizeof(int32_t));
+            p += sizeof(int32_t);
         }
 
-        // Add frame to the trajectory
-        if (!in_file.eof())
+        if (fields & field_mass)
         {
-            trj.emplace_back(f);
+            mass[n] = read_float(p, w);
+            p += w;
+        }
+
+        for (int d = 0; d < 3; d++)
+        {
+            if (fields & field_x)
+            {
+                (&f.r[n].x)[d] = read_float(p, w);
+                p += w;
+            }
+            if (fields & field_v)
+            {
+                (&f.v[n].x)[d] = read_float(p, w);
+                p += w;
+            }
+            if (fields & field_f)
+            {
+                (&f.f[n].x)[d] = read_float(p, w);
+                p += w;
+            }
         }
     }
 
-    // Close the file
-    in_file.close();
+    return p;
+}
 
-    return natoms;
+/*
+ * Returns false if the frame header is invalid
+ */
+inline bool valid_frame_header(const traj_format::frame_header &fh)
+{
+    using namespace traj_format;
+
+    // Velocities and forces as 16-bit values
+    const uint32_t half = fh.fields & (field_half_fp16 | field_half_bf16);
+
+    return fh.natoms >= 0 && half != (field_half_fp16 | field_half_bf16);
 }
 
+/*
+ * Returns false if `size` is not the size of the decoded body of the frame (bytes)
+ */
+inline bool valid_body_size(const traj_format::frame_header &fh, const traj_format::file_header &header, uint64_t size)
+{
+    using namespace traj_format;
+
+    const size_t record = atom_size(fh.fields, header.float_width);
+
+    // Quantized coordinates follow the per-atom values as a block of variable size
+    const bool quantized = fh.fields & field_x_quantized;
+
+    return quantized ? size >= record * fh.natoms : size == record * fh.natoms;
+}
+
+/*
+ * Decodes the frame from its header `fh` and its decoded body (`size` bytes at `body`, after
+ * decompression and the XOR of delta frames), e.g. in a file buffer or in shared memory.
+ * Static data (masses, ...) are shared with `statics` unless the frame has its own.
+ * Returns false in case of error.
+ */
+bool decode_body(const traj_format::frame_header &fh,
+                 const traj_format::file_header &header,
+                 const static_section &statics,
+                 const char *body,
+                 size_t size,
+                 frame &f)
+{
+    using namespace traj_format;
+
+    const bool quantized = fh.fields & field_x_quantized;
+    const uint32_t half = fh.fields & (field_half_fp16 | field_half_bf16);
+
+    f.natoms = fh.natoms;
+    f.step = fh.step;
+    f.time = fh.time;
+    f.fields = fh.fields;
+
+    f.box = {static_cast<float_type>(fh.box[0][0]), static_cast<float_type>(fh.box[1][1]), static_cast<float_type>(fh.box[2][2])};
+
+    for (int i = 0; i < 3; i++)
+    {
+        f.box_vectors[i] = {static_cast<float_type>(fh.box[i][0]), static_cast<float_type>(fh.box[i][1]), static_cast<float_type>(fh.box[i][2])};
+    }
+
+    // Allocate only the fields present in the frame
+    std::vector<float_type> mass((fh.fields & field_mass) ? fh.natoms : 0);
+
+    f.id.resize((fh.fields & field_index) ? fh.natoms : 0);
+
+    // Fields stored as per-atom values
+    const uint32_t value_fields = fh.fields & ~(quantized ? field_x : 0u) & ~(half ? (field_v | field_f) : 0u);
+
+    const uint32_t w = header.float_width;
+    const char *p = body;
+
+    if (header.layout == layout_soa)
+    {
+        // Contiguous blocks: copied directly into the SoA arrays
+        f.layout = layout_soa;
+
+        if (!f.id.empty())
+        {
+            std::memcpy(f.id.data(), p, f.id.size() * sizeof(int32_t));
+            p += f.id.size() * sizeof(int32_t);
+        }
+
+        p = read_floats(p, mass.data(), mass.size(), w);
+
+        std::pair<uint32_t, float_soa *> fields[] = {{field_x, &f.r_soa}, {field_v, &f.v_soa}, {field_f, &f.f_soa}};
+
+        for (auto &field : fields)
+        {
+            float_soa &dst = *field.second;
+
+            dst.resize((fh.fields & field.first) ? fh.natoms : 0);
+
+            if (value_fields & field.first)
+            {
+                p = read_floats(p, dst.x.data(), dst.size(), w);
+                p = read_floats(p, dst.y.data(), dst.size(), w);
+                p = read_floats(p, dst.z.data(), dst.size(), w);
+            }
+        }
+    }
+    else
+    {
+        f.layout = layout_aos;
+        f.r.resize((fh.fields & field_x) ? fh.natoms : 0);
+        f.v.resize((fh.fields & field_v) ? fh.natoms : 0);
+        f.f.resize((fh.fields & field_f) ? fh.natoms : 0);
+
+        p = read_values_aos(p, value_fields, w, f, mass);
+    }
+
+    f.vv.resize((fh.fields & field_vv) ? fh.natoms : 0);
+
+    if (!f.vv.empty())
+    {
+        p = read_floats(p, &f.vv[0].xx, 6 * f.vv.size(), w);
+    }
+
+    if (half)
+    {
+        const traj_codec::half_format format = (half == field_half_bf16) ? traj_codec::half_bf16 : traj_codec::half_fp16;
+        const size_t natoms = fh.natoms;
+
+        std::pair<std::vector<float_vec> *, float_soa *> fields[] = {{&f.v, &f.v_soa}, {&f.f, &f.f_soa}};
+
+        for (auto &field : fields)
+        {
+            if (f.layout == layout_soa && !field.second->empty())
+            {
+                for (std::vector<float_type> *dst : {&field.second->x, &field.second->y, &field.second->z})
+                {
+                    traj_codec::half_to_float(p, dst->data(), natoms, format);
+                    p += natoms * sizeof(uint16_t);
+                }
+            }
+            else if (f.layout == layout_aos && !field.first->empty())
+            {
+                traj_codec::half_to_float(p, &(*field.first)[0].x, 3 * natoms, format);
+                p += 3 * natoms * sizeof(uint16_t);
+            }
+        }
+    }
+
+    if (quantized && fh.natoms > 0)
+    {
+        float_type *const out[3] = {f.layout == layout_soa ? f.r_soa.x.data() : &f.r[0].x,
+                                    f.layout == layout_soa ? f.r_soa.y.data() : &f.r[0].y,
+                                    f.layout == layout_soa ? f.r_soa.z.data() : &f.r[0].z};
+
+        if (!traj_codec::dequantize_positions(p, body + size - p, fh.natoms, out, f.layout == layout_soa ? 1 : 3))
+        {
+            std::cerr << "Error in trajectory file: Invalid quantized coordinates at step " << fh.step << std::endl;
+            return false;
+        }
+    }
+
+    f.mass = (fh.fields & field_mass) ? shared_array<float_type>(std::move(mass)) : statics.mass;
+    f.charge = statics.charge;
+    f.type = statics.type;
+    f.global_id = statics.id;
+
+    return true;
+}
+
+/*
+ * Reads the next frame of a version 2 file at the current position of the stream.
+ * Static data (masses, ...) are shared with `statics` unless the frame has its own.
+ * `body` is a scratch buffer that keeps the decoded body of the frame; delta frames are
+ * decoded against it, so pass the same buffer for consecutive frames of a file.
+ * Returns false at the end of the file or in case of error.
+ */
+bool read_frame(std::istream &in_file,
+                const traj_format::file_header &header,
+                const static_section &statics,
+                frame &f,
+                std::vector<char> &body)
+{
+    using namespace traj_format;
+
+    frame_header fh;
+
+    in_file.read(reinterpret_cast<char *>(&fh), sizeof(fh));
+
+    if (!in_file)
+    {
+        return false;
+    }
+
+    // Compressed bodies are checked once they are decompressed
+    const bool compressed = fh.fields & field_compressed;
+
+    if (!valid_frame_header(fh) || (!compressed && !valid_body_size(fh, header, fh.size)))
+    {
+        std::cerr << "Error in trajectory file: Invalid frame at step " << fh.step << std::endl;
+        return false;
+    }
+
+    // Delta frames are read aside and XORed into the body of the previous frame
+    const bool delta = fh.fields & field_delta;
+
+    std::vector<char> delta_body;
+    std::vector<char> &data = delta ? delta_body : body;
+
+    data.resize(fh.size);
+    in_file.read(data.data(), fh.size);
+
+    if (!in_file)
+    {
+        std::cerr << "Error in trajectory file: Truncated frame at step " << fh.step << std::endl;
+        return false;
+    }
+
+    if (compressed)
+    {
+        uint64_t raw_size = 0;
+        std::vector<char> raw;
+
+        bool ok = traj_codec::compressed_raw_size(data.data(), data.size(), raw_size) && valid_body_size(fh, header, raw_size);
+
+        if (ok)
+        {
+            raw.resize(raw_size);
+            ok = traj_codec::decompress(data.data(), data.size(), raw.data());
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Error in trajectory file: Invalid compressed frame at step " << fh.step << std::endl;
+            return false;
+        }
+
+        data.swap(raw);
+    }
+
+    if (delta)
+    {
+        if (body.size() != data.size())
+        {
+            std::cerr << "Error in trajectory file: Delta frame without its previous frame at step " << fh.step << std::endl;
+            return false;
+        }
+
+        char *__restrict dst = body.data();
+        const char *__restrict src = data.data();
+
+        for (size_t i = 0; i < body.size(); i++)
+        {
+            dst[i] ^= src[i];
+        }
+    }
+
+    return decode_body(fh, header, statics, body.data(), body.size(), f);
+}
+
+/*
+ * Returns the path of the out-file `fname` (e.g. "traj.000003.out"): `fname` if it exists, otherwise
+ * the path recorded in the manifest next to it (e.g. "traj.manifest", see traj_manifest), for
+ * out-files striped over several directories (GMX_OUT_DIRS). Returns `fname` if neither exists.
+ */
+inline std::string resolve(const std::string &fname)
+{
+    struct stat st;
+
+    if (::stat(fname.c_str(), &st) == 0)
+    {
+        return fname;
+    }
+
+    const std::string directory = traj_manifest::directory_name(fname);
+    const std::string base = traj_manifest::base_name(fname);
+
+    // Manifest of the out-files named up to the first dot, e.g. "traj.000003.out" -> "traj.manifest"
+    const std::string manifest = directory + traj_manifest::manifest_name(base.substr(0, base.find('.')));
+
+    traj_manifest::entry e;
+
+    if (!traj_manifest::find_entry(manifest, base, e))
+    {
+        return fname;
+    }
+
+    // Relative paths in the manifest are relative to its directory
+    return e.file[0] == '/' ? e.file : directory + e.file;
+}
+
+/*
+ * Reads the frame index of a version 2 file from its footer or, if the file has
+ * no footer (e.g. it is still being written), by scanning the frame headers.
+ * Returns the number of frames or -1 in case of error.
+ */
+int read_index(const std::string &fname, std::vector<traj_format::index_entry> &index)
+{
+    using namespace traj_format;
+
+    std::ifstream in_file(resolve(fname), std::ios::binary);
+
+    file_header header;
+
+    if (!in_file || !read_file_header(in_file, header))
+    {
+        std::cerr << "Error: Not a version 2 trajectory file: " << fname << std::endl;
+        return -1;
+    }
+
+    index.clear();
+
+    // Footer
+    index_trailer trailer;
+
+    in_file.seekg(0, std::ios::end);
+    const uint64_t file_size = in_file.tellg();
+
+    if (file_size >= sizeof(header) + sizeof(trailer))
+    {
+        in_file.seekg(file_size - sizeof(trailer));
+        in_file.read(reinterpret_cast<char *>(&trailer), sizeof(trailer));
+
+        if (in_file && std::memcmp(trailer.magic, index_magic, sizeof(trailer.magic)) == 0
+            && trailer.offset + trailer.nframes * sizeof(index_entry) + sizeof(trailer) == file_size)
+        {
+            index.resize(trailer.nframes);
+            in_file.seekg(trailer.offset);
+            in_file.read(reinterpret_cast<char *>(index.data()), trailer.nframes * sizeof(index_entry));
+
+            return in_file ? static_cast<int>(index.size()) : -1;
+        }
+    }
+
+    // No footer: scan the frame headers
+    uint64_t offset = sizeof(header) + static_size(header.static_fields, header.natoms, header.float_width);
+
+    while (offset + sizeof(frame_header) <= file_size)
+    {
+        frame_header fh;
+
+        in_file.clear();
+        in_file.seekg(offset);
+        in_file.read(reinterpret_cast<char *>(&fh), sizeof(fh));
+
+        if (!in_file || offset + sizeof(fh) + fh.size > file_size)
+        {
+            break; // Incomplete frame
+        }
+
+        index.push_back({offset, fh.step, fh.time});
+
+        offset += sizeof(fh) + fh.size;
+    }
+
+    return static_cast<int>(index.size());
+}
+
+/*
+ * Reads `count` frames starting from frame `first` of a version 2 file, seeking
+ * directly to them through the frame index (or to the preceding keyframe if frame
+ * `first` is a delta frame). Independent ranges of the same file can be read in parallel.
+ * Returns the number of frames read or -1 in case of error.
+ */
+int read_frames(const std::string &fname, const std::vector<traj_format::index_entry> &index, size_t first, size_t count, traj &trj)
+{
+    std::ifstream in_file(resolve(fname), std::ios::binary);
+
+    traj_format::file_header header;
+
+    if (!in_file || !read_file_header(in_file, header))
+    {
+        std::cerr << "Error: Not a version 2 trajectory file: " << fname << std::endl;
+        return -1;
+    }
+
+    static_section statics;
+
+    if (!read_static(in_file, header, statics))
+    {
+        std::cerr << "Error in trajectory file " << fname << ": Truncated static section." << std::endl;
+        return -1;
+    }
+
+    // Delta frames are decoded forward from the preceding keyframe
+    size_t keyframe = std::min(first, index.size());
+
+    while (keyframe > 0 && keyframe < index.size())
+    {
+        traj_format::frame_header fh;
+
+        in_file.seekg(index[keyframe].offset);
+        in_file.read(reinterpret_cast<char *>(&fh), sizeof(fh));
+
+        if (!in_file)
+        {
+            std::cerr << "Error in trajectory file " << fname << ": Truncated frame." << std::endl;
+            return -1;
+        }
+
+        if (!(fh.fields & traj_format::field_delta))
+        {
+            break;
+        }
+
+        keyframe--;
+    }
+
+    std::vector<char> body;
+
+    int nframes{0};
+
+    for (size_t i = keyframe; i < first + count && i < index.size(); i++)
+    {
+        frame f;
+
+        in_file.seekg(index[i].offset);
+
+        if (!read_frame(in_file, header, statics, f, body))
+        {
+            return -1;
+        }
+
+        if (i >= first)
+        {
+            trj.emplace_back(std::move(f));
+            nframes++;
+        }
+    }
+
+    return nframes;
+}
+
+/*
+ * Reads all frames of a version 2 file.
+ * Returns the number of frames or -1 in case of error.
+ */
+int read_v2(const std::string &fname, traj &trj)
+{
+    std::vector<traj_format::index_entry> index;
+
+    if (read_index(fname, index) < 0)
+    {
+        return -1;
+    }
+
+    return read_frames(fname, index, 0, index.size(), trj);
+}
+
+/*
+ * Reads trajectory from a version 1 output file.
+ * Returns the number of atoms or 0 in case of error.
+ */
+int read_v1(const std::string &fname, traj &trj)
+{
+    // Open the binary file for reading
+    std::ifstream in_file(fname, std::ios::binary);
+
+    // Check if the file opened successfully
+    if (!in_file && in_file.is_open())
+    {
+        std::cerr << "Error opening file for reading: " << fname << std::endl;
+        return 0;
+    }
+
+    // Create an empty frame
+    frame f;
+
+    // Masses of the current frame; shared with the previous frame if they did not change
+    std::vector<float_type> mass;
+
+    // Number of atoms
+    int natoms{0};
+
+    // Read file
+    while (!in_file.eof())
+    {
+        // Read header
+        int step_int{0}; // Version 1 files store the time step as int
+        in_file.read(reinterpret_cast<char *>(&step_int), sizeof(step_int));
+        f.step = step_int;
+        in_file.read(reinterpret_cast<char *>(&f.natoms), sizeof(f.natoms));
+        in_file.read(reinterpret_cast<char *>(&f.time), sizeof(f.time));
+        in_file.read(reinterpret_cast<char *>(&f.box.x), sizeof(f.box.x));
+        in_file.read(reinterpret_cast<char *>(&f.box.y), sizeof(f.box.y));
+        in_file.read(reinterpret_cast<char *>(&f.box.z), sizeof(f.box.z));
+
+        if (f.natoms <= 0)
+        {
+            std::cerr << "Error in trajectory file " << fname << ": Natoms = " << f.natoms << std::endl;
+            return 0;
+        }
+
+        // Allocate memory for the frame if needed
+        if (mass.size() == 0)
+        {
+            natoms = f.natoms; // Number of atoms should not change
+            mass.resize(natoms);
+            f.r.resize(natoms);
+            f.v.resize(natoms);
+            f.fields = traj_format::field_mass | traj_format::field_x | traj_format::field_v;
+#ifdef MD_FORCES
+            f.fields |= traj_format::field_f;
+            f.f.resize(natoms);
+#endif
+        }
+
+        if (natoms != f.natoms)
+        {
+            std::cerr << "Error in trajectory file " << fname << ": Inconsistent number of atoms." << std::endl;
+            return 0;
+        }
+
+        // Read frame
+        for (int n = 0; n < natoms; n++)
+        {
+            in_file.read(reinterpret_cast<char *>(&mass[n]), sizeof(float_type));
+            in_file.read(reinterpret_cast<char *>(&f.r[n].x), sizeof(float_type));
+            in_file.read(reinterpret_cast<char *>(&f.v[n].x), sizeof(float_type));
+#ifdef MD_FORCES
+            in_file.read(reinterpret_cast<char *>(&f.f[n].x), sizeof(float_type));
+#endif
+            in_file.read(reinterpret_cast<char *>(&f.r[n].y), sizeof(float_type));
+            in_file.read(reinterpret_cast<char *>(&f.v[n].y), sizeof(float_type));
+#ifdef MD_FORCES
+            in_file.read(reinterpret_cast<char *>(&f.f[n].y), sizeof(float_type));
+#endif
+            in_file.read(reinterpret_cast<char *>(&f.r[n].z), sizeof(float_type));
+            in_file.read(reinterpret_cast<char *>(&f.v[n].z), sizeof(float_type));
+#ifdef MD_FORCES
+            in_file.read(reinterpret_cast<char *>(&f.f[n].z), sizeof(float_type));
+#endif
+        }
+
+        // Masses are written into every frame but never change
+        if (f.mass.empty() || !std::equal(mass.begin(), mass.end(), f.mass.data()))
+        {
+            f.mass = shared_array<float_type>(mass);
+        }
+
+        // Add frame to the trajectory
+        if (!in_file.eof())
+        {
+            trj.emplace_back(f);
+        }
+    }
+
+    // Close the file
+    in_file.close();
+
+    return natoms;
+}
+
+/*
+ * Reads trajectory from the output file, detecting the file version.
+ * Returns the number of atoms or 0 in case of error.
+ */
+int read(const std::string &fname, traj &trj)
+{
+    // Out-files striped into other directories are found through the manifest
+    const std::string path = resolve(fname);
+
+    std::ifstream in_file(path, std::ios::binary);
+
+    if (!in_file || !in_file.is_open())
+    {
+        std::cerr << "Error opening file for reading: " << fname << std::endl;
+        return 0;
+    }
+
+    traj_format::file_header header;
+
+    if (!read_file_header(in_file, header))
+    {
+        return read_v1(path, trj);
+    }
+
+    size_t first = trj.size();
+
+    if (read_v2(path, trj) < 0)
+    {
+        return 0;
+    }
+
+    // Number of atoms should not change
+    for (size_t i = first; i < trj.size(); i++)
+    {
+        if (trj[i].natoms != trj[first].natoms)
+        {
+            std::cerr << "Error in trajectory file " << fname << ": Inconsistent number of atoms." << std::endl;
+            return 0;
+        }
+    }
+
+    return header.natoms;
+}
+
+/*
+ * Reads a single shard file written by one PP rank under domain decomposition.
+ * Each atom record is preceded by its index in the atom order of the file (the global
+ * atom index unless atoms are selected), stored in `frame::id`; static data (masses, ...)
+ * are in the atom order of the file.
+ * Returns the number of frames or -1 in case of error.
+ */
+int read_shard(const std::string &fname, traj &trj)
+{
+    return read_v2(fname, trj);
+}
+
+/*
+ * Merges the frames of all shards into frames in global atom order.
+ * All shards must contain the same time steps.
+ * Returns the number of atoms or 0 in case of error.
+ */
+int merge_shards(const std::vector<traj> &shards, traj &trj)
+{
+    if (shards.empty())
+    {
+        return 0;
+    }
+
+    const size_t nframes = shards[0].size();
+
+    int natoms{0};
+
+    for (size_t i = 0; i < nframes; i++)
+    {
+        frame f;
+
+        f.step = shards[0][i].step;
+        f.time = shards[0][i].time;
+        f.box = shards[0][i].box;
+        f.fields = shards[0][i].fields & ~traj_format::field_index;
+
+        for (int d = 0; d < 3; d++)
+        {
+            f.box_vectors[d] = shards[0][i].box_vectors[d];
+        }
+
+        // Total number of atoms in the frame
+        for (const auto &shard : shards)
+        {
+            if (shard.size() != nframes || shard[i].step != f.step || (shard[i].fields & ~traj_format::field_index) != f.fields)
+            {
+                std::cerr << "Error merging shards: Inconsistent frames." << std::endl;
+                return 0;
+            }
+
+            f.natoms += shard[i].natoms;
+        }
+
+        if (i == 0)
+        {
+            natoms = f.natoms;
+        }
+
+        if (f.natoms != natoms)
+        {
+            std::cerr << "Error merging shards: Inconsistent number of atoms." << std::endl;
+            return 0;
+        }
+
+        // Static data are already in global order; per-frame masses are scattered below
+        std::vector<float_type> mass((f.fields & traj_format::field_mass) ? natoms : 0);
+
+        f.charge = shards[0][i].charge;
+        f.type = shards[0][i].type;
+        f.global_id = shards[0][i].global_id;
+
+        f.r.resize((f.fields & traj_format::field_x) ? natoms : 0);
+        f.v.resize((f.fields & traj_format::field_v) ? natoms : 0);
+        f.f.resize((f.fields & traj_format::field_f) ? natoms : 0);
+
+        std::vector<bool> found(natoms, false);
+
+        // Scatter home atoms of each rank to their global positions
+        for (const auto &shard : shards)
+        {
+            // SoA shards are merged through a copy in AoS layout
+            frame converted;
+
+            if (shard[i].layout == traj_format::layout_soa)
+            {
+                converted = shard[i];
+                to_aos(converted);
+            }
+
+            const frame &s = (shard[i].layout == traj_format::layout_soa) ? converted : shard[i];
+
+            for (int n = 0; n < s.natoms; n++)
+            {
+                int g = s.id[n];
+
+                if (g < 0 || g >= natoms || found[g])
+                {
+                    std::cerr << "Error merging shards: Invalid global atom index " << g << "." << std::endl;
+                    return 0;
+                }
+
+                found[g] = true;
+
+                if (!mass.empty())
+                {
+                    mass[g] = s.mass[n];
+                }
+                if (!f.r.empty())
+                {
+                    f.r[g] = s.r[n];
+                }
+                if (!f.v.empty())
+                {
+                    f.v[g] = s.v[n];
+                }
+                if (!f.f.empty())
+                {
+                    f.f[g] = s.f[n];
+                }
+            }
+        }
+
+        f.mass = mass.empty() ? shards[0][i].mass : shared_array<float_type>(std::move(mass));
+
+        // Keep the layout of the shards
+        if (shards[0][i].layout == traj_format::layout_soa)
+        {
+            to_soa(f);
+        }
+
+        trj.emplace_back(std::move(f));
+    }
+
+    return natoms;
+}
+
+/*
+ * Returns the file name of the shard written by `rank` for the given out-file,
+ * e.g. "traj.000003" and rank 7 -> "traj.000003.rank0007.out"
+ */
+std::string shard_name(const std::string &prefix, int rank)
+{
+    std::ostringstream name;
+    name << prefix << ".rank" << std::setw(4) << std::setfill('0') << rank << ".out";
+    return name.str();
+}
+
+/*
+ * Reads all shards of the out-file `prefix` (e.g. "traj.000003"), starting
+ * from rank 0 until the next shard does not exist, and merges them into
+ * frames in global atom order.
+ * Returns the number of atoms or 0 in case of error.
+ */
+int read_shards(const std::string &prefix, traj &trj)
+{
+    std::vector<traj> shards;
+
+    for (int rank = 0; std::ifstream(resolve(shard_name(prefix, rank))).good(); rank++)
+    {
+        shards.emplace_back();
+
+        if (read_shard(shard_name(prefix, rank), shards.back()) < 0)
+        {
+            return 0;
+        }
+    }
+
+    if (shards.empty())
+    {
+        std::cerr << "Error: No shards found for " << prefix << std::endl;
+        return 0;
+    }
+
+    return merge_shards(shards, trj);
+}
+
+/*
+ * Consumer of the frames that mdrun publishes into a shared-memory ring (GMX_OUT_SHM, see traj_shm),
+ * without any file: attaches to the ring and reads every frame from the oldest one still in the ring.
+ *
+ * `acquire` returns the packed frame in place (zero-copy): a frame_header followed by the body,
+ * as in an out-file; the producer does not overwrite it until `release`. A consumer that does not
+ * release its frames holds the producer (back-pressure), unless it publishes with `drop_frames`.
+ * `read` decodes the next frame into a `frame` and releases it. Frames are numbered from 0 in the
+ * order they were published (`sequence`).
+ */
+class shm_reader
+{
+public:
+    shm_reader() = default;
+
+    ~shm_reader()
+    {
+        close();
+    }
+
+    shm_reader(const shm_reader &) = delete;
+    shm_reader &operator=(const shm_reader &) = delete;
+
+    /*
+     * Attaches to the ring `name` (e.g. "traj"), waiting up to `timeout_ms` milliseconds for mdrun
+     * to create it (-1: no limit). Returns false on timeout or error.
+     */
+    bool open(const std::string &name, int timeout_ms = -1)
+    {
+        using namespace traj_shm;
+
+        close();
+
+        const auto start = std::chrono::steady_clock::now();
+
+        while (!map(segment_name(name)))
+        {
+            const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+            if (timeout_ms >= 0 && waited >= timeout_ms)
+            {
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        // Static image: file header and static section, as at the beginning of an out-file
+        std::istringstream image(std::string(reinterpret_cast<const char *>(ring) + sizeof(ring_header), ring->static_size));
+
+        if (!read_file_header(image, header) || !read_static(image, header, statics))
+        {
+            std::cerr << "Error in shared-memory ring " << name << ": Invalid static image" << std::endl;
+            close();
+            return false;
+        }
+
+        // Claim a free consumer entry; reading starts with the oldest frame in the ring
+        for (consumer_header &c : ring->consumers)
+        {
+            int32_t expected = 0;
+
+            if (c.pid.compare_exchange_strong(expected, ::getpid()))
+            {
+                consumer = &c;
+                break;
+            }
+        }
+
+        if (!consumer)
+        {
+            std::cerr << "Error in shared-memory ring " << name << ": Too many consumers" << std::endl;
+            close();
+            return false;
+        }
+
+        const uint64_t published = ring->published.load(std::memory_order_acquire);
+
+        next = published > ring->nslots ? published - ring->nslots : 0;
+        consumer->position.store(next, std::memory_order_seq_cst);
+
+        notify(ring->space_futex, ring->space_waiters);
+
+        return true;
+    }
+
+    /*
+     * Waits up to `timeout_ms` milliseconds (-1: no limit) for the next frame and returns it in
+     * place: a frame_header followed by the body of `frame_header::size` bytes. The frame stays
+     * valid until `release`. Returns nullptr on timeout or at the end of the frames (`finished`).
+     */
+    const char *acquire(int timeout_ms = -1)
+    {
+        using namespace traj_shm;
+
+        if (!ring)
+        {
+            return nullptr;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        while (true)
+        {
+            const uint32_t ticket = ring->frames_futex.load(std::memory_order_seq_cst);
+
+            if (ring->published.load(std::memory_order_acquire) > next)
+            {
+                break;
+            }
+
+            // The last frames are read before the end is reported
+            if (ring->closed.load(std::memory_order_acquire) || !process_alive(ring->producer_pid))
+            {
+                if (ring->published.load(std::memory_order_acquire) > next)
+                {
+                    continue;
+                }
+
+                finished_flag = true;
+                return nullptr;
+            }
+
+            int wait_ms = 100; // Checks that the producer is alive
+
+            if (timeout_ms >= 0)
+            {
+                const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+                if (waited >= timeout_ms)
+                {
+                    return nullptr;
+                }
+
+                wait_ms = std::min<int>(wait_ms, timeout_ms - waited);
+            }
+
+            ring->frames_waiters.fetch_add(1, std::memory_order_seq_cst);
+            futex_wait(ring->frames_futex, ticket, wait_ms);
+            ring->frames_waiters.fetch_sub(1, std::memory_order_seq_cst);
+        }
+
+        const slot_header *slot = slot_at(next);
+
+        uint64_t sequence = slot->sequence.load(std::memory_order_seq_cst);
+
+        // The producer is checking whether it can overwrite the slot, or overwriting it
+        while (sequence == 0)
+        {
+            std::this_thread::yield();
+            sequence = slot->sequence.load(std::memory_order_seq_cst);
+        }
+
+        if (sequence != next + 1)
+        {
+            // Overwritten: this consumer attached while the producer was overwriting its oldest frame,
+            // or was detached by the producer (e.g. stopped in a debugger and taken for dead)
+            const uint64_t published = ring->published.load(std::memory_order_acquire);
+
+            lost_frames += published - next;
+            next = published;
+            consumer->position.store(next, std::memory_order_seq_cst);
+
+            return acquire(timeout_ms);
+        }
+
+        return reinterpret_cast<const char *>(slot) + sizeof(slot_header);
+    }
+
+    /*
+     * Releases the frame returned by `acquire`, so the producer can reuse its slot
+     */
+    void release()
+    {
+        if (!ring)
+        {
+            return;
+        }
+
+        next++;
+        consumer->position.store(next, std::memory_order_seq_cst);
+
+        traj_shm::notify(ring->space_futex, ring->space_waiters);
+    }
+
+    /*
+     * Decodes the next frame into `f` and releases it, waiting up to `timeout_ms` milliseconds
+     * (-1: no limit). Returns false on timeout, at the end of the frames (`finished`) or on error.
+     */
+    bool read(frame &f, int timeout_ms = -1)
+    {
+        const char *data = acquire(timeout_ms);
+
+        if (!data)
+        {
+            return false;
+        }
+
+        traj_format::frame_header fh;
+        std::memcpy(&fh, data, sizeof(fh));
+
+        const bool ok = valid_frame_header(fh) && !(fh.fields & (traj_format::field_compressed | traj_format::field_delta))
+                        && valid_body_size(fh, header, fh.size) && decode_body(fh, header, statics, data + sizeof(fh), fh.size, f);
+
+        if (!ok)
+        {
+            std::cerr << "Error in shared-memory ring: Invalid frame at step " << fh.step << std::endl;
+        }
+
+        release();
+
+        return ok;
+    }
+
+    /*
+     * Number of the next frame to read, counted from the first frame published into the ring
+     */
+    uint64_t sequence() const
+    {
+        return next;
+    }
+
+    /*
+     * Number of frames the producer skipped because a consumer was too slow (`drop_frames`)
+     */
+    uint64_t dropped() const
+    {
+        return ring ? ring->dropped.load(std::memory_order_relaxed) : 0;
+    }
+
+    /*
+     * Number of frames this consumer missed because it was detached
+     */
+    uint64_t lost() const
+    {
+        return lost_frames;
+    }
+
+    /*
+     * Returns true once the producer has closed the ring (or exited) and all frames are read
+     */
+    bool finished() const
+    {
+        return finished_flag;
+    }
+
+    /*
+     * File header of the frames (fields, number of atoms, layout)
+     */
+    const traj_format::file_header &file_header() const
+    {
+        return header;
+    }
+
+    /*
+     * Static per-atom data (masses, ...), shared with the decoded frames
+     */
+    const static_section &static_data() const
+    {
+        return statics;
+    }
+
+    /*
+     * Releases the consumer entry and detaches from the ring
+     */
+    void close()
+    {
+        if (!ring)
+        {
+            return;
+        }
+
+        if (consumer)
+        {
+            consumer->pid.store(0, std::memory_order_seq_cst);
+            consumer = nullptr;
+
+            traj_shm::notify(ring->space_futex, ring->space_waiters);
+        }
+
+        ::munmap(ring, mapped_size);
+        ring = nullptr;
+    }
+
+private:
+    traj_shm::ring_header *ring{nullptr}; // Mapped segment
+
+    size_t mapped_size{0}; // Size of the mapped segment (bytes)
+
+    traj_shm::consumer_header *consumer{nullptr}; // Entry of this consumer
+
+    uint64_t next{0}; // Number of the next frame to read
+
+    uint64_t lost_frames{0}; // Frames missed after being detached
+
+    bool finished_flag{false}; // The producer has closed the ring and all frames are read
+
+    traj_format::file_header header{}; // File header of the static image
+
+    static_section statics; // Static per-atom data
+
+    /*
+     * Returns the slot of frame `sequence`
+     */
+    const traj_shm::slot_header *slot_at(uint64_t sequence) const
+    {
+        const char *base = reinterpret_cast<const char *>(ring) + ring->slots_offset;
+
+        return reinterpret_cast<const traj_shm::slot_header *>(base + (sequence % ring->nslots) * ring->slot_size);
+    }
+
+    /*
+     * Maps the segment once it exists and is ready. Returns false otherwise.
+     */
+    bool map(const std::string &shm_name)
+    {
+        using namespace traj_shm;
+
+        const int fd = ::shm_open(shm_name.c_str(), O_RDWR, 0);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+
+        void *addr = MAP_FAILED;
+
+        if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ring_header))
+        {
+            addr = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        ::close(fd);
+
+        if (addr == MAP_FAILED)
+        {
+            return false; // Not sized yet
+        }
+
+        ring = static_cast<ring_header *>(addr);
+        mapped_size = st.st_size;
+        finished_flag = false;
+
+        if (!ring->ready.load(std::memory_order_acquire) || std::memcmp(ring->magic, ring_magic, sizeof(ring->magic)) != 0
+            || ring->version != traj_shm::version)
+        {
+            ::munmap(ring, mapped_size);
+            ring = nullptr;
+
+            return false; // Not ready yet
+        }
+
+        return true;
+    }
+};
+
+/*
+ * Watches the manifest of the out-files (see traj_manifest) with inotify and returns every out-file
+ * as soon as the writer has closed it, without polling the directory. The manifest does not have
+ * to exist yet: its directory is watched until it is created. Entries are returned in the order
+ * they were appended, from the first line on; a manifest replaced or truncated by a new simulation
+ * is read again from its beginning. The file names are returned as paths the consumer can open:
+ * relative paths in the manifest get the directory of the manifest.
+ */
+class manifest_watcher
+{
+public:
+    manifest_watcher() = default;
+
+    ~manifest_watcher()
+    {
+        close();
+    }
+
+    manifest_watcher(const manifest_watcher &) = delete;
+    manifest_watcher &operator=(const manifest_watcher &) = delete;
+
+    /*
+     * Starts watching the manifest `name` (e.g. "traj.manifest"). Returns false on error.
+     */
+    bool open(const std::string &name)
+    {
+        close();
+
+        const size_t slash = name.rfind('/');
+
+        manifest = name;
+        manifest_base = slash == std::string::npos ? name : name.substr(slash + 1);
+
+        const std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : name.substr(0, slash));
+
+        inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (inotify_fd < 0)
+        {
+            return false;
+        }
+
+        // Creation of the manifest, or its replacement by a new simulation
+        directory_watch = ::inotify_add_watch(inotify_fd, directory.c_str(), IN_CREATE | IN_MOVED_TO);
+
+        if (directory_watch < 0)
+        {
+            close();
+            return false;
+        }
+
+        watch_manifest();
+
+        return true;
+    }
+
+    /*
+     * Waits up to `timeout_ms` milliseconds (-1: no limit) for the next closed out-file and returns
+     * its entry. Returns false on timeout or error.
+     */
+    bool next(traj_manifest::entry &e, int timeout_ms = -1)
+    {
+        if (inotify_fd < 0)
+        {
+            return false;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        while (true)
+        {
+            // Events that arrive meanwhile stay queued: no line is missed between reading and waiting
+            read_lines();
+
+            if (!pending.empty())
+            {
+                e = std::move(pending.front());
+                pending.pop_front();
+
+                return true;
+            }
+
+            int wait_ms = -1;
+
+            if (timeout_ms >= 0)
+            {
+                const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+                if (waited >= timeout_ms)
+                {
+                    return false;
+                }
+
+                wait_ms = static_cast<int>(timeout_ms - waited);
+            }
+
+            pollfd events{inotify_fd, POLLIN, 0};
+
+            const int ready = ::poll(&events, 1, wait_ms);
+
+            if (ready < 0 && errno != EINTR)
+            {
+                return false;
+            }
+
+            if (ready > 0 && !drain_events())
+            {
+                return false;
+            }
+        }
+    }
+
+    /*
+     * Stops watching the manifest
+     */
+    void close()
+    {
+        if (inotify_fd >= 0)
+        {
+            ::close(inotify_fd);
+        }
+
+        inotify_fd = -1;
+        directory_watch = -1;
+
+        manifest_inode = 0;
+        offset = 0;
+        partial.clear();
+        pending.clear();
+    }
+
+private:
+    std::string manifest;      // Name of the manifest
+    std::string manifest_base; // Name of the manifest without its directory
+
+    int inotify_fd{-1};      // inotify instance
+    int directory_watch{-1}; // Watch of the directory of the manifest
+
+    ino_t manifest_inode{0}; // Inode of the manifest read so far
+    uint64_t offset{0};      // Bytes of the manifest read so far
+
+    std::string partial;                      // Line not yet complete
+    std::deque<traj_manifest::entry> pending; // Entries read but not yet returned
+
+    /*
+     * Watches the manifest for appended lines, if it exists
+     */
+    void watch_manifest()
+    {
+        // The watch of a replaced manifest is removed by the kernel along with its inode
+        ::inotify_add_watch(inotify_fd, manifest.c_str(), IN_MODIFY);
+    }
+
+    /*
+     * Reads the pending inotify events; a (re)created manifest is watched. Returns false on error.
+     */
+    bool drain_events()
+    {
+        alignas(inotify_event) char buffer[4096];
+
+        while (true)
+        {
+            const ssize_t size = ::read(inotify_fd, buffer, sizeof(buffer));
+
+            if (size < 0)
+            {
+                return errno == EAGAIN || errno == EINTR;
+            }
+
+            for (ssize_t i = 0; i < size;)
+            {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + i);
+
+                if (event->wd == directory_watch && event->len > 0 && manifest_base == event->name)
+                {
+                    watch_manifest();
+                }
+
+                i += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    /*
+     * Reads the lines appended to the manifest since the last call into `pending`
+     */
+    void read_lines()
+    {
+        const int fd = ::open(manifest.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+        {
+            return; // Not created yet
+        }
+
+        struct stat st;
+
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return;
+        }
+
+        // Replaced or truncated by a new simulation
+        if (st.st_ino != manifest_inode || static_cast<uint64_t>(st.st_size) < offset)
+        {
+            manifest_inode = st.st_ino;
+            offset = 0;
+            partial.clear();
+        }
+
+        char buffer[4096];
+
+        ssize_t size = 0;
+
+        while ((size = ::pread(fd, buffer, sizeof(buffer), offset)) > 0)
+        {
+            partial.append(buffer, size);
+            offset += size;
+        }
+
+        ::close(fd);
+
+        // Complete lines; the writer appends each line with a single write
+        size_t begin = 0;
+
+        for (size_t end = partial.find('\n'); end != std::string::npos; end = partial.find('\n', begin))
+        {
+            traj_manifest::entry e;
+
+            if (traj_manifest::parse_entry(partial.substr(begin, end - begin), e))
+            {
+                if (e.file[0] != '/')
+                {
+                    e.file = traj_manifest::directory_name(manifest) + e.file;
+                }
+
+                pending.push_back(std::move(e));
+            }
+            else
+            {
+                std::cerr << "Error in manifest " << manifest << ": Invalid line" << std::endl;
+            }
+
+            begin = end + 1;
+        }
+
+        partial.erase(0, begin);
+    }
+};
+
 } // namespace traj_reader
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "traj_writer/format.hpp"
+#include "traj_writer/writer.hpp"
+
+namespace traj_writer
+{
+
+/*
+ * Running sums of coordinates, velocities and v⊗v per atom over blocks of consecutive steps,
+ * turned into a single averaged frame per block.
+ *
+ * Coordinates are summed as displacements from a reference position (the coordinates at the
+ * first step of the block) with the minimum-image convention, so atoms that are put back into
+ * the box during a block are averaged correctly as long as they move less than half a box.
+ * Sums are kept in double precision and in the atom order of the out-file, so that with domain
+ * decomposition every rank adds its home atoms and the sums of all ranks are simply added up
+ * (e.g. with `gmx_sumd`) before `average` is called.
+ */
+template <typename Real>
+class block_average
+{
+public:
+    /*
+     * Averages the `fields` (field_x, field_v, field_vv) of `natoms` atoms
+     */
+    block_average(int natoms, uint32_t fields)
+        : natoms(natoms)
+    {
+        const size_t n = natoms;
+
+        reference_x.assign((fields & traj_format::field_x) ? 3 * n : 0, 0.0);
+        sum.assign(((fields & traj_format::field_x) ? 3 * n : 0) + ((fields & traj_format::field_v) ? 3 * n : 0)
+                           + ((fields & traj_format::field_vv) ? 6 * n : 0),
+                   0.0);
+
+        avg_x.resize(reference_x.size());
+        avg_v.resize((fields & traj_format::field_v) ? 3 * n : 0);
+        avg_vv.resize((fields & traj_format::field_vv) ? 6 * n : 0);
+    }
+
+    /*
+     * Returns the number of steps added since the last `reset`
+     */
+    int samples() const
+    {
+        return count;
+    }
+
+    /*
+     * Sets the reference positions of the atoms of `fr` (in the atom order of the out-file,
+     * see `frame_view::index`) to their coordinates; called at the first step of a block.
+     * The references of other atoms stay zero, so the references of all ranks can be added up.
+     */
+    void set_reference(const frame_view<Real> &fr)
+    {
+        if (reference_x.empty())
+        {
+            return;
+        }
+
+        for (int i = 0; i < fr.natoms; i++)
+        {
+            const size_t n = fr.index ? fr.index[i] : i;
+
+            for (int d = 0; d < 3; d++)
+            {
+                reference_x[3 * n + d] = fr.x[i][d];
+            }
+        }
+    }
+
+    /*
+     * Reference positions of all atoms, to be added up over all ranks after `set_reference`
+     */
+    std::vector<double> &reference()
+    {
+        return reference_x;
+    }
+
+    /*
+     * Adds the coordinates and velocities of the atoms of `fr` to the sums; `fr.box` is used
+     * for the minimum image
+     */
+    void add(const frame_view<Real> &fr)
+    {
+        double *const sum_x = sum.data();
+        double *const sum_v = sum_x + reference_x.size();
+        double *const sum_vv = sum_v + avg_v.size();
+
+        const Real(*box)[3] = fr.box;
+
+        const bool add_x = !reference_x.empty();
+        const bool add_v = !avg_v.empty();
+        const bool add_vv = !avg_vv.empty();
+
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < fr.natoms; i++)
+        {
+            const size_t n = fr.index ? fr.index[i] : i;
+
+            if (add_x)
+            {
+                double dx[3];
+
+                for (int d = 0; d < 3; d++)
+                {
+                    dx[d] = fr.x[i][d] - reference_x[3 * n + d];
+                }
+
+                // Minimum image of the displacement (triclinic boxes have box[d][e] = 0 for e > d)
+                for (int d = 2; d >= 0; d--)
+                {
+                    if (dx[d] > 0.5 * box[d][d])
+                    {
+                        for (int e = 0; e <= d; e++)
+                        {
+                            dx[e] -= box[d][e];
+                        }
+                    }
+                    else if (dx[d] < -0.5 * box[d][d])
+                    {
+                        for (int e = 0; e <= d; e++)
+                        {
+                            dx[e] += box[d][e];
+                        }
+                    }
+                }
+
+                for (int d = 0; d < 3; d++)
+                {
+                    sum_x[3 * n + d] += dx[d];
+                }
+            }
+
+            if (add_v)
+            {
+                for (int d = 0; d < 3; d++)
+                {
+                    sum_v[3 * n + d] += fr.v[i][d];
+                }
+            }
+
+            if (add_vv)
+            {
+                const double vx = fr.v[i][0];
+                const double vy = fr.v[i][1];
+                const double vz = fr.v[i][2];
+
+                double *vv = sum_vv + 6 * n;
+
+                vv[0] += vx * vx;
+                vv[1] += vy * vy;
+                vv[2] += vz * vz;
+                vv[3] += vx * vy;
+                vv[4] += vx * vz;
+                vv[5] += vy * vz;
+            }
+        }
+
+        count++;
+    }
+
+    /*
+     * Sums of all atoms (displacements, velocities, v⊗v), to be added up over all ranks before `average`
+     */
+    std::vector<double> &sums()
+    {
+        return sum;
+    }
+
+    /*
+     * Returns the averaged frame of all atoms with the step, time and box of `fr` (the last step of the block).
+     * The frame points into this object and is valid until the next call.
+     */
+    frame_view<Real> average(const frame_view<Real> &fr)
+    {
+        const double *const sum_x = sum.data();
+        const double *const sum_v = sum_x + reference_x.size();
+        const double *const sum_vv = sum_v + avg_v.size();
+
+        const double scale = count > 0 ? 1.0 / count : 0.0;
+
+        for (size_t i = 0; i < avg_x.size(); i++)
+        {
+            avg_x[i] = static_cast<Real>(reference_x[i] + scale * sum_x[i]);
+        }
+        for (size_t i = 0; i < avg_v.size(); i++)
+        {
+            avg_v[i] = static_cast<Real>(scale * sum_v[i]);
+        }
+        for (size_t i = 0; i < avg_vv.size(); i++)
+        {
+            avg_vv[i] = static_cast<Real>(scale * sum_vv[i]);
+        }
+
+        frame_view<Real> out;
+
+        out.step = fr.step;
+        out.time = fr.time;
+        out.box = fr.box;
+        out.natoms = natoms;
+        out.natoms_global = natoms;
+        out.x = avg_x.empty() ? nullptr : reinterpret_cast<const Real(*)[3]>(avg_x.data());
+        out.v = avg_v.empty() ? nullptr : reinterpret_cast<const Real(*)[3]>(avg_v.data());
+        out.vv = avg_vv.empty() ? nullptr : reinterpret_cast<const Real(*)[6]>(avg_vv.data());
+        out.average = true;
+
+        return out;
+    }
+
+    /*
+     * Clears the sums and references to start a new block
+     */
+    void reset()
+    {
+        std::fill(reference_x.begin(), reference_x.end(), 0.0);
+        std::fill(sum.begin(), sum.end(), 0.0);
+
+        count = 0;
+    }
+
+private:
+    const int natoms; // Number of atoms in the out-file
+
+    int count{0}; // Number of steps added
+
+    std::vector<double> reference_x; // Reference positions (3 per atom)
+    std::vector<double> sum;         // Sums of displacements, velocities and v⊗v
+
+    std::vector<Real> avg_x;  // Averaged coordinates
+    std::vector<Real> avg_v;  // Averaged velocities
+    std::vector<Real> avg_vv; // Averaged v⊗v
+};
+
+} // namespace traj_writer
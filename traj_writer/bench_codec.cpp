@@ -0,0 +1,420 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "traj_reader/reader.hpp"
+#include "traj_writer/writer.hpp"
+
+/*
+ * Micro-benchmark: packing time and size of a frame with full-precision and quantized
+ * coordinates, compared to the time of an MD step. With `traj_writer::writer`, the MD
+ * thread only copies the coordinates and the writer thread quantizes them; both parts
+ * are timed. The quantized frames are decoded again to check the error. Both frames are
+ * also compressed losslessly (as on the writer thread with GMX_OUT_COMPRESS) and
+ * decompressed again. Velocities are then stored as fp16 and bf16 values (GMX_OUT_HALF),
+ * comparing the SIMD conversion with the scalar code. Finally, a short trajectory with small
+ * displacements per step is stored as keyframes and XOR deltas (GMX_OUT_DELTA) and decoded again.
+ *
+ * Usage: bench_codec [natoms] [nframes] [precision, nm] [MD step time, ms]
+ */
+
+typedef float real;
+typedef real rvec[3];
+
+/*
+ * Returns the elapsed time in seconds since `start`
+ */
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Packs `nframes` frames with `options` into `buf` and returns the average time per frame (ms).
+ * With `deferred`, the time to quantize the coordinates is returned in `encode_ms`.
+ */
+double time_pack(traj_writer::frame_view<real> frame,
+                 int nframes,
+                 const traj_writer::format_options &options,
+                 traj_writer::aligned_buffer &buf,
+                 traj_writer::deferred_positions *deferred = nullptr,
+                 double *encode_ms = nullptr)
+{
+    buf.resize(traj_writer::max_frame_size(frame.natoms, frame.fields(), options));
+
+    size_t size = 0;
+
+    double pack_sec = 0.0;
+    double encode_sec = 0.0;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        frame.step = i;
+
+        auto start = std::chrono::steady_clock::now();
+        size = traj_writer::pack_frame(buf.data(), frame, options, deferred);
+        pack_sec += seconds_since(start);
+
+        if (deferred && deferred->pending)
+        {
+            start = std::chrono::steady_clock::now();
+            deferred->encode(buf.data());
+            encode_sec += seconds_since(start);
+        }
+    }
+
+    buf.resize(size);
+
+    if (encode_ms)
+    {
+        *encode_ms = 1.0e3 * encode_sec / nframes;
+    }
+
+    return 1.0e3 * pack_sec / nframes;
+}
+
+/*
+ * Compresses the packed frame `in` `nframes` times into `out` and returns the average time per frame (ms)
+ */
+double time_compress(const traj_writer::aligned_buffer &in, int nframes, traj_writer::aligned_buffer &out)
+{
+    std::vector<char> scratch;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < nframes; i++)
+    {
+        traj_writer::compress_frame(in, out, scratch, traj_codec::default_chunk_size);
+    }
+
+    return 1.0e3 * seconds_since(start) / nframes;
+}
+
+/*
+ * Reads the packed frame `buf` `nframes` times into `f` and returns the average time per frame (ms)
+ */
+double time_read(const traj_writer::aligned_buffer &buf, int nframes, const traj_format::file_header &header, traj_reader::frame &f)
+{
+    traj_reader::static_section statics;
+    std::vector<char> body;
+
+    const std::string data(buf.data(), buf.size());
+
+    double sec = 0.0;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        std::istringstream in(data);
+
+        auto start = std::chrono::steady_clock::now();
+
+        if (!traj_reader::read_frame(in, header, statics, f, body))
+        {
+            return -1.0;
+        }
+
+        sec += seconds_since(start);
+    }
+
+    return 1.0e3 * sec / nframes;
+}
+
+/*
+ * Converts `in` to 16-bit values and back `nframes` times and returns the average times per frame (ms)
+ */
+std::pair<double, double> time_half(const std::vector<real> &in, int nframes, traj_codec::half_format format, bool simd, std::vector<real> &out)
+{
+    std::vector<char> packed(2 * in.size());
+    out.resize(in.size());
+
+    double pack_sec = 0.0;
+    double unpack_sec = 0.0;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        traj_codec::float_to_half(in.data(), packed.data(), in.size(), format, simd);
+        pack_sec += seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        traj_codec::half_to_float(packed.data(), out.data(), out.size(), format, simd);
+        unpack_sec += seconds_since(start);
+    }
+
+    return {1.0e3 * pack_sec / nframes, 1.0e3 * unpack_sec / nframes};
+}
+
+/*
+ * Packs `nframes` consecutive frames of a trajectory that moves every atom by `v * dt` per frame,
+ * compresses them with a keyframe every `keyframe_interval` frames (1: compression only) into `file`
+ * and returns the average time per frame in the writer thread (ms)
+ */
+double time_delta(traj_writer::frame_view<real> frame,
+                  std::vector<real> xv,
+                  std::vector<real> vv,
+                  int nframes,
+                  int keyframe_interval,
+                  std::string &file)
+{
+    const real dt = 0.002;
+
+    std::mt19937 gen(2);
+    std::normal_distribution<real> kick(0.0, 0.01);
+
+    traj_writer::aligned_buffer buf;
+    traj_writer::aligned_buffer compressed;
+    traj_writer::aligned_buffer reference;
+    std::vector<char> scratch;
+
+    file.clear();
+
+    double sec = 0.0;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        for (size_t k = 0; k < xv.size(); k++)
+        {
+            xv[k] += vv[k] * dt;
+            vv[k] += kick(gen);
+        }
+
+        frame.step = i;
+        frame.x = reinterpret_cast<const rvec *>(xv.data());
+        frame.v = reinterpret_cast<const rvec *>(vv.data());
+
+        buf.resize(traj_writer::max_frame_size(frame.natoms, frame.fields(), {}));
+        buf.resize(traj_writer::pack_frame(buf.data(), frame));
+
+        auto start = std::chrono::steady_clock::now();
+
+        if (i % keyframe_interval == 0)
+        {
+            reference.resize(buf.size());
+            std::memcpy(reference.data(), buf.data(), buf.size());
+        }
+        else
+        {
+            traj_writer::delta_encode(buf, reference);
+        }
+
+        traj_writer::compress_frame(buf, compressed, scratch, traj_codec::default_chunk_size);
+
+        sec += seconds_since(start);
+
+        file.append(compressed.data(), compressed.size());
+    }
+
+    return 1.0e3 * sec / nframes;
+}
+
+int main(int argc, char *argv[])
+{
+    int natoms = argc > 1 ? std::stoi(argv[1]) : 330000; // ~15 nm water box
+    int nframes = argc > 2 ? std::stoi(argv[2]) : 20;
+    double precision = argc > 3 ? std::stod(argv[3]) : 0.001;
+    double step_ms = argc > 4 ? std::stod(argv[4]) : 0.0;
+
+    const real L = 15.0;
+
+    // Water-like positions: oxygen anywhere in the box, hydrogens within 0.1 nm
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<real> box_pos(0.0, L);
+    std::uniform_real_distribution<real> bond(-0.1, 0.1);
+    std::normal_distribution<real> vel(0.0, 0.5);
+
+    std::vector<real> xv(3 * natoms);
+    std::vector<real> vv(3 * natoms);
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            xv[3 * n + d] = (n % 3 == 0) ? box_pos(gen) : xv[3 * (n - n % 3) + d] + bond(gen);
+            vv[3 * n + d] = vel(gen);
+        }
+    }
+
+    rvec box[3] = {{L, 0, 0}, {0, L, 0}, {0, 0, L}};
+
+    traj_writer::frame_view<real> frame;
+
+    frame.box = box;
+    frame.natoms = natoms;
+    frame.natoms_global = natoms;
+    frame.x = reinterpret_cast<const rvec *>(xv.data());
+    frame.v = reinterpret_cast<const rvec *>(vv.data());
+
+    std::cout << "natoms = " << natoms << ", frames = " << nframes << ", precision = " << precision << " nm\n\n";
+
+    traj_writer::aligned_buffer full;
+    traj_writer::aligned_buffer quantized;
+
+    traj_writer::format_options options;
+    const double full_ms = time_pack(frame, nframes, options, full);
+
+    options.precision = precision;
+    const double quantized_ms = time_pack(frame, nframes, options, quantized);
+
+    traj_writer::deferred_positions deferred;
+    double encode_ms = 0.0;
+    const double deferred_ms = time_pack(frame, nframes, options, quantized, &deferred, &encode_ms);
+
+    std::cout << "full precision: " << full_ms << " ms/frame, " << full.size() / 1.0e6 << " MB/frame\n";
+    std::cout << "quantized:      " << quantized_ms << " ms/frame, " << quantized.size() / 1.0e6 << " MB/frame"
+              << " (x + v: " << static_cast<double>(full.size()) / quantized.size() << "x smaller, x alone: "
+              << (12.0 * natoms) / (static_cast<double>(quantized.size()) - static_cast<double>(full.size()) + 12.0 * natoms) << "x smaller)\n";
+    std::cout << "  as in writer: " << deferred_ms << " ms/frame in the MD thread + " << encode_ms << " ms/frame in the writer thread\n";
+
+    if (step_ms > 0.0)
+    {
+        std::cout << "\nMD step: " << step_ms << " ms; the MD thread spends " << 100.0 * deferred_ms / step_ms
+                  << "% of a step on an output frame (" << 100.0 * full_ms / step_ms << "% with full precision)\n";
+    }
+
+    // Lossless compression of both frames
+    traj_writer::aligned_buffer full_lz;
+    traj_writer::aligned_buffer quantized_lz;
+
+    const double full_lz_ms = time_compress(full, nframes, full_lz);
+    const double quantized_lz_ms = time_compress(quantized, nframes, quantized_lz);
+
+    traj_format::file_header header = traj_format::make_file_header(frame.fields(), 0, natoms, sizeof(float));
+    traj_reader::frame f;
+
+    const double full_read_ms = time_read(full, nframes, header, f);
+    const double full_lz_read_ms = time_read(full_lz, nframes, header, f);
+
+    std::cout << "\ncompressed full precision: " << full_lz_ms << " ms/frame in the writer thread, "
+              << static_cast<double>(full.size()) / full_lz.size() << "x smaller; read in " << full_lz_read_ms
+              << " ms/frame (" << full_read_ms << " ms/frame uncompressed)\n";
+    std::cout << "compressed quantized:      " << quantized_lz_ms << " ms/frame in the writer thread, "
+              << static_cast<double>(quantized.size()) / quantized_lz.size() << "x smaller than quantized, "
+              << static_cast<double>(full.size()) / quantized_lz.size() << "x smaller than full precision\n";
+
+    // The compressed frame must decode to the original values
+    if (full_lz_read_ms < 0.0 || f.r.size() != static_cast<size_t>(natoms)
+        || std::memcmp(f.r.data(), xv.data(), xv.size() * sizeof(real)) != 0
+        || std::memcmp(f.v.data(), vv.data(), vv.size() * sizeof(real)) != 0)
+    {
+        std::cerr << "ERROR: The compressed frame does not decode to the original values\n";
+        return 1;
+    }
+
+    // Decode the quantized frame (compressed) and check the error
+    if (time_read(quantized_lz, 1, header, f) < 0.0)
+    {
+        std::cerr << "ERROR: Cannot decode the quantized frame\n";
+        return 1;
+    }
+
+    double max_error = 0.0;
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            max_error = std::max(max_error, static_cast<double>(std::fabs((&f.r[n].x)[d] - xv[3 * n + d])));
+        }
+    }
+
+    std::cout << "\nMaximum coordinate error: " << max_error << " nm\n";
+
+    if (max_error > 0.5 * precision + 1.0e-5 * L)
+    {
+        return 1;
+    }
+
+    // Velocities as 16-bit values
+    std::cout << "\n";
+
+    for (traj_codec::half_format format : {traj_codec::half_fp16, traj_codec::half_bf16})
+    {
+        const char *name = format == traj_codec::half_fp16 ? "fp16" : "bf16";
+
+        std::vector<real> simd_v;
+        std::vector<real> scalar_v;
+
+        const std::pair<double, double> simd_ms = time_half(vv, nframes, format, true, simd_v);
+        const std::pair<double, double> scalar_ms = time_half(vv, nframes, format, false, scalar_v);
+
+        traj_writer::format_options half_options;
+        half_options.half = format == traj_codec::half_fp16 ? traj_format::field_half_fp16 : traj_format::field_half_bf16;
+
+        traj_writer::aligned_buffer half;
+        const double half_ms = time_pack(frame, nframes, half_options, half);
+
+        // Relative to the smallest normal fp16 value for tiny velocities, which fp16 stores with fewer bits
+        double max_relative_error = 0.0;
+
+        for (size_t i = 0; i < vv.size(); i++)
+        {
+            max_relative_error = std::max(max_relative_error, static_cast<double>(std::fabs(simd_v[i] - vv[i]) / std::max(std::fabs(vv[i]), 6.1035e-5f)));
+        }
+
+        std::cout << name << " velocities: " << half_ms << " ms/frame, " << half.size() / 1.0e6 << " MB/frame ("
+                  << static_cast<double>(full.size()) / half.size() << "x smaller than full precision); maximum relative error "
+                  << max_relative_error << "\n";
+        std::cout << "  " << traj_codec::half_simd_name(format) << ": " << simd_ms.first << " ms to convert, " << simd_ms.second
+                  << " ms to convert back; scalar: " << scalar_ms.first << " ms, " << scalar_ms.second << " ms\n";
+
+        // The SIMD conversion must give the same values as the scalar code
+        if (std::memcmp(simd_v.data(), scalar_v.data(), vv.size() * sizeof(real)) != 0
+            || max_relative_error > (format == traj_codec::half_fp16 ? 1.0 / 2048 : 1.0 / 256))
+        {
+            std::cerr << "ERROR: Invalid " << name << " conversion\n";
+            return 1;
+        }
+    }
+
+    // Keyframes and XOR deltas of a moving system
+    const int keyframe_interval = 100;
+
+    std::string compressed_file;
+    std::string delta_file;
+
+    const double compressed_ms = time_delta(frame, xv, vv, nframes, 1, compressed_file);
+    const double delta_ms = time_delta(frame, xv, vv, nframes, keyframe_interval, delta_file);
+
+    std::cout << "\nkeyframe every " << keyframe_interval << " frames + XOR deltas: " << delta_ms << " ms/frame in the writer thread, "
+              << static_cast<double>(nframes) * full.size() / delta_file.size() << "x smaller than full precision ("
+              << static_cast<double>(compressed_file.size()) / delta_file.size() << "x smaller than compressed frames, " << compressed_ms
+              << " ms/frame)\n";
+
+    // The delta frames must decode to the last frame of the trajectory
+    std::istringstream in(delta_file);
+    std::vector<char> body;
+    traj_reader::static_section statics;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        if (!traj_reader::read_frame(in, header, statics, f, body))
+        {
+            std::cerr << "ERROR: Cannot decode the delta frames\n";
+            return 1;
+        }
+    }
+
+    std::istringstream in_compressed(compressed_file);
+    traj_reader::frame last;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        traj_reader::read_frame(in_compressed, header, statics, last, body);
+    }
+
+    if (std::memcmp(f.r.data(), last.r.data(), f.r.size() * sizeof(real)) != 0
+        || std::memcmp(f.v.data(), last.v.data(), f.v.size() * sizeof(real)) != 0)
+    {
+        std::cerr << "ERROR: The delta frames do not decode to the original values\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "traj_writer/writer.hpp"
+
+/*
+ * Micro-benchmark: per-scalar `std::ofstream::write` path vs. packed single-write path vs.
+ * packed paths through `traj_writer::output_file` (preallocated O_DIRECT file, io_uring, both).
+ * All paths write the same frames (without file header and index); the size of each file
+ * in the page cache after writing is reported.
+ *
+ * Usage: bench_pack [natoms] [nframes] [directory]
+ */
+
+typedef float real;
+typedef real rvec[3];
+
+std::ofstream out_file;
+
+/*
+ * Writes variable `var` to the file stream (original output path)
+ */
+template <typename T>
+inline void write_data_to_out(T var)
+{
+    out_file.write(reinterpret_cast<char *>(&var), sizeof(var));
+}
+
+/*
+ * Writes the frame one scalar at a time (original output path)
+ */
+void write_frame_per_scalar(int64_t step, real t, const rvec *box, int natoms, const rvec *x, const rvec *v)
+{
+    write_data_to_out(step);
+    write_data_to_out(static_cast<double>(t));
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            write_data_to_out(static_cast<double>(box[i][d]));
+        }
+    }
+
+    write_data_to_out(natoms);
+    write_data_to_out(traj_format::field_x | traj_format::field_v);
+    write_data_to_out(static_cast<uint64_t>(natoms) * 6 * sizeof(float));
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            write_data_to_out(x[n][d]);
+            write_data_to_out(v[n][d]);
+        }
+    }
+}
+
+/*
+ * Returns the number of bytes of the file in the page cache (MB)
+ */
+double cached_mb(const std::string &fname)
+{
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    off_t size = fd >= 0 ? ::lseek(fd, 0, SEEK_END) : 0;
+
+    double mb = 0.0;
+
+    if (size > 0)
+    {
+        void *addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (addr != MAP_FAILED)
+        {
+            const long page = ::sysconf(_SC_PAGESIZE);
+            std::vector<unsigned char> resident((size + page - 1) / page);
+
+            if (::mincore(addr, size, resident.data()) == 0)
+            {
+                mb = std::count_if(resident.begin(), resident.end(), [](unsigned char r) { return r & 1; }) * (page / 1.0e6);
+            }
+
+            ::munmap(addr, size);
+        }
+    }
+
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+
+    return mb;
+}
+
+/*
+ * Returns the elapsed time in seconds since `start`
+ */
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    int natoms = argc > 1 ? std::stoi(argv[1]) : 330000; // ~15 nm water box
+    int nframes = argc > 2 ? std::stoi(argv[2]) : 20;
+    std::string dir = argc > 3 ? argv[3] : ".";
+
+    std::vector<real> xv(3 * natoms);
+    std::vector<real> vv(3 * natoms);
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            xv[3 * n + d] = 0.001 * ((n * 7 + d * 13) % 15000);
+            vv[3 * n + d] = 0.01 * ((n * 11 + d * 5) % 200) - 1.0;
+        }
+    }
+
+    rvec box[3] = {{15, 0, 0}, {0, 15, 0}, {0, 0, 15}};
+
+    const rvec *x = reinterpret_cast<const rvec *>(xv.data());
+    const rvec *v = reinterpret_cast<const rvec *>(vv.data());
+
+    traj_writer::frame_view<real> frame;
+
+    frame.box = box;
+    frame.natoms = natoms;
+    frame.natoms_global = natoms;
+    frame.x = x;
+    frame.v = v;
+
+    const size_t frame_bytes = traj_writer::frame_size(natoms, frame.fields());
+    const double bytes = static_cast<double>(frame_bytes) * nframes;
+
+    std::cout << "natoms = " << natoms << ", frames = " << nframes
+              << ", frame size = " << frame_bytes / 1.0e6 << " MB\n\n";
+
+    // Original path
+    std::string fname_scalar = dir + "/bench_pack_scalar.tmp";
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        out_file.open(fname_scalar, std::ios::binary);
+
+        for (int i = 0; i < nframes; i++)
+        {
+            write_frame_per_scalar(i, static_cast<real>(0.002 * i), box, natoms, x, v);
+        }
+
+        out_file.close();
+
+        double sec = seconds_since(start);
+
+        std::cout << "per-scalar ofstream: " << sec << " s, " << bytes / sec / 1.0e6 << " MB/s"
+                  << " (page cache: " << cached_mb(fname_scalar) << " MB)\n";
+    }
+
+    // Packed path
+    std::string fname_packed = dir + "/bench_pack_packed.tmp";
+    {
+        traj_writer::aligned_buffer buf;
+        buf.resize(frame_bytes);
+
+        double pack_sec = 0.0;
+
+        auto start = std::chrono::steady_clock::now();
+
+        int fd = ::open(fname_packed.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        for (int i = 0; i < nframes; i++)
+        {
+            auto pack_start = std::chrono::steady_clock::now();
+            frame.step = i;
+            frame.time = static_cast<real>(0.002 * i);
+            traj_writer::pack_frame(buf.data(), frame);
+            pack_sec += seconds_since(pack_start);
+
+            if (!traj_writer::write_all(fd, buf.data(), buf.size()))
+            {
+                std::cerr << "ERROR: Cannot write " << fname_packed << "\n";
+                return 1;
+            }
+        }
+
+        ::close(fd);
+
+        double sec = seconds_since(start);
+
+        std::cout << "packed single write: " << sec << " s, " << bytes / sec / 1.0e6 << " MB/s"
+                  << " (packing only: " << bytes / pack_sec / 1.0e6 << " MB/s, page cache: " << cached_mb(fname_packed) << " MB)\n";
+    }
+
+    // Packed path through traj_writer::output_file: preallocated O_DIRECT file and/or io_uring
+    auto write_output_file = [&](const std::string &fname, bool direct, bool uring)
+    {
+        traj_writer::aligned_buffer buf;
+        buf.resize(frame_bytes);
+
+        auto start = std::chrono::steady_clock::now();
+
+        traj_writer::io_options io;
+        io.direct = direct;
+        io.uring = uring;
+
+        traj_writer::output_file file;
+
+        if (!file.open(fname, static_cast<uint64_t>(bytes), io))
+        {
+            std::cerr << "ERROR: Cannot open " << fname << "\n";
+            return false;
+        }
+
+        // Modes actually used (fallbacks)
+        std::string mode = file.is_direct() ? "O_DIRECT" : "buffered";
+
+        if (file.is_uring())
+        {
+            mode += file.fixed_buffers() ? " io_uring (registered buffers)" : " io_uring";
+        }
+
+        for (int i = 0; i < nframes; i++)
+        {
+            frame.step = i;
+            frame.time = static_cast<real>(0.002 * i);
+            traj_writer::pack_frame(buf.data(), frame);
+
+            if (!file.append(buf.data(), buf.size()))
+            {
+                std::cerr << "ERROR: Cannot write " << fname << "\n";
+                return false;
+            }
+        }
+
+        // No file header to rewrite
+        if (!file.close(nullptr, 0))
+        {
+            std::cerr << "ERROR: Cannot write " << fname << "\n";
+            return false;
+        }
+
+        double sec = seconds_since(start);
+
+        std::cout << "packed " << mode << ": " << sec << " s, " << bytes / sec / 1.0e6 << " MB/s (page cache: " << cached_mb(fname) << " MB)\n";
+
+        return true;
+    };
+
+    std::string fname_direct = dir + "/bench_pack_direct.tmp";
+    std::string fname_uring = dir + "/bench_pack_uring.tmp";
+    std::string fname_uring_direct = dir + "/bench_pack_uring_direct.tmp";
+
+    if (!write_output_file(fname_direct, true, false) || !write_output_file(fname_uring, false, true)
+        || !write_output_file(fname_uring_direct, true, true))
+    {
+        return 1;
+    }
+
+    // Both paths must produce identical files
+    bool same = true;
+
+    for (const std::string &fname : {fname_packed, fname_direct, fname_uring, fname_uring_direct})
+    {
+        std::ifstream a(fname_scalar, std::ios::binary);
+        std::ifstream b(fname, std::ios::binary);
+
+        same = same && std::equal(std::istreambuf_iterator<char>(a), std::istreambuf_iterator<char>(),
+                                  std::istreambuf_iterator<char>(b), std::istreambuf_iterator<char>());
+    }
+
+    std::cout << "\nOutput " << (same ? "identical" : "DIFFERS") << "\n";
+
+    std::remove(fname_scalar.c_str());
+    std::remove(fname_packed.c_str());
+    std::remove(fname_direct.c_str());
+    std::remove(fname_uring.c_str());
+    std::remove(fname_uring_direct.c_str());
+
+    return same ? 0 : 1;
+}
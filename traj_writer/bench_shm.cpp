@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "traj_reader/reader.hpp"
+#include "traj_writer/shm_writer.hpp"
+
+/*
+ * Benchmark of the shared-memory ring: a producer publishes frames and a consumer process
+ * reads them with `traj_reader::shm_reader`.
+ *
+ * Latency: a frame every millisecond; the consumer measures the time from `write` (the frame
+ * time, before packing) to its `acquire` (zero-copy) and then decodes the frame.
+ * Throughput: frames published as fast as the consumer releases them (back-pressure).
+ *
+ * Usage: bench_shm [natoms] [nframes] [nslots]
+ */
+
+typedef float real;
+typedef real rvec[3];
+
+/*
+ * Returns the steady-clock time in seconds
+ */
+double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Consumer process: reads all frames of both runs and prints the latency and throughput
+ */
+int consume(const std::string &name, int nframes)
+{
+    traj_reader::shm_reader ring;
+
+    if (!ring.open(name, 10000))
+    {
+        std::cerr << "ERROR: Cannot attach to the ring.\n";
+        return 1;
+    }
+
+    traj_reader::frame f;
+
+    // Latency run
+    std::vector<double> latency;
+    double decode = 0.0;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        const char *data = ring.acquire();
+
+        if (!data)
+        {
+            break;
+        }
+
+        traj_format::frame_header fh;
+        std::memcpy(&fh, data, sizeof(fh));
+
+        latency.push_back(now() - fh.time);
+
+        // Decoded copy of the frame
+        const double start = now();
+
+        traj_reader::decode_body(fh, ring.file_header(), ring.static_data(), data + sizeof(fh), fh.size, f);
+
+        decode += now() - start;
+
+        ring.release();
+    }
+
+    std::sort(latency.begin(), latency.end());
+
+    // Throughput run: zero-copy
+    double start = 0.0;
+    double bytes = 0.0;
+    int frames = 0;
+
+    for (; frames < nframes; frames++)
+    {
+        const char *data = ring.acquire();
+
+        if (!data)
+        {
+            break;
+        }
+
+        traj_format::frame_header fh;
+        std::memcpy(&fh, data, sizeof(fh));
+
+        if (frames == 0)
+        {
+            start = now();
+        }
+
+        bytes += sizeof(fh) + fh.size;
+
+        ring.release();
+    }
+
+    const double sec = now() - start;
+
+    if (latency.empty() || frames < 2)
+    {
+        std::cerr << "ERROR: Missing frames.\n";
+        return 1;
+    }
+
+    std::cout << "latency (write -> acquire): median " << 1.0e6 * latency[latency.size() / 2] << " us, 99% "
+              << 1.0e6 * latency[latency.size() * 99 / 100] << " us, max " << 1.0e6 * latency.back() << " us\n";
+    std::cout << "decode into traj_reader::frame: " << 1.0e6 * decode / latency.size() << " us per frame\n";
+    std::cout << "throughput (zero-copy, with back-pressure): " << (frames - 1) / sec << " frames/s, " << bytes / frames * (frames - 1) / sec / 1.0e9
+              << " GB/s\n";
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int natoms = argc > 1 ? std::stoi(argv[1]) : 100000; // ~10 nm water box
+    int nframes = argc > 2 ? std::stoi(argv[2]) : 200;
+    int nslots = argc > 3 ? std::stoi(argv[3]) : 8;
+
+    const std::string name = "bench_shm." + std::to_string(::getpid());
+
+    std::vector<real> xv(3 * natoms);
+    std::vector<real> vv(3 * natoms);
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            xv[3 * n + d] = 0.001 * ((n * 7 + d * 13) % 10000);
+            vv[3 * n + d] = 0.01 * ((n * 11 + d * 5) % 200) - 1.0;
+        }
+    }
+
+    rvec box[3] = {{10, 0, 0}, {0, 10, 0}, {0, 0, 10}};
+
+    traj_writer::frame_view<real> frame;
+
+    frame.box = box;
+    frame.natoms = natoms;
+    frame.natoms_global = natoms;
+    frame.x = reinterpret_cast<const rvec *>(xv.data());
+    frame.v = reinterpret_cast<const rvec *>(vv.data());
+
+    std::cout << "natoms = " << natoms << ", frames = " << nframes << ", slots = " << nslots
+              << ", frame size = " << traj_writer::frame_size(natoms, frame.fields()) / 1.0e6 << " MB\n\n"
+              << std::flush;
+
+    traj_writer::static_data atoms;
+    atoms.mass.assign(natoms, 18.0f / 3);
+
+    traj_writer::shm_writer ring(name, nslots, frame.fields(), atoms);
+
+    // The ring is created by the first frame; the consumer attaches before the measured frames
+    frame.step = -1;
+    frame.time = now();
+
+    if (!ring.write(frame))
+    {
+        std::cerr << "ERROR: Cannot create the shared-memory ring.\n";
+        return 1;
+    }
+
+    pid_t pid = ::fork();
+
+    if (pid == 0)
+    {
+        // Without the destructors, which would close the ring of the producer
+        const int status = consume(name, nframes);
+        std::cout.flush();
+        ::_exit(status);
+    }
+
+    // Wait for the consumer to attach (it starts with the next frame)
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    for (int i = 0; i < nframes; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        frame.step = i;
+        frame.time = now();
+        ring.write(frame);
+    }
+
+    for (int i = 0; i < nframes; i++)
+    {
+        frame.step = nframes + i;
+        frame.time = now();
+        ring.write(frame);
+    }
+
+    ring.close();
+
+    int status = 1;
+    ::waitpid(pid, &status, 0);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
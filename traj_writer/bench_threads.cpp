@@ -0,0 +1,226 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "traj_writer/writer.hpp"
+
+/*
+ * Micro-benchmark: time to pack a frame on the MD thread with 1 to N OpenMP threads
+ * (`format_options::threads`, the OpenMP threads of mdrun), for the default frame and the other
+ * encodings that convert values on the MD thread. Every frame must be byte-identical to the frame
+ * packed by one thread.
+ *
+ * Usage: bench_threads [natoms] [nframes] [max threads]
+ */
+
+typedef float real;
+typedef real rvec[3];
+
+/*
+ * Returns the elapsed time in seconds since `start`
+ */
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Encoding of the benchmark
+ */
+struct encoding
+{
+    const char *name;
+
+    traj_writer::format_options options;
+
+    traj_writer::frame_view<real> frame;
+
+    bool deferred; // Coordinates quantized later by the writer thread, as in `traj_writer::writer`
+};
+
+/*
+ * Packs `nframes` frames of `e` with `nthreads` threads into `buf` and returns the average time per frame (ms)
+ */
+double time_pack(const encoding &e, int nframes, int nthreads, traj_writer::aligned_buffer &buf)
+{
+    traj_writer::format_options options = e.options;
+    options.threads = nthreads;
+
+    traj_writer::frame_view<real> frame = e.frame;
+
+    traj_writer::deferred_positions positions;
+    traj_writer::deferred_positions *deferred = e.deferred ? &positions : nullptr;
+
+    buf.resize(traj_writer::max_frame_size(frame.natoms, frame.fields(), options));
+
+    size_t size = 0;
+
+    // The first frame warms up the buffers and the threads
+    size = traj_writer::pack_frame(buf.data(), frame, options, deferred);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < nframes; i++)
+    {
+        frame.step = i;
+        size = traj_writer::pack_frame(buf.data(), frame, options, deferred);
+    }
+
+    const double ms = 1.0e3 * seconds_since(start) / nframes;
+
+    // The deferred coordinates complete the frame for the comparison
+    if (deferred && deferred->pending)
+    {
+        deferred->encode(buf.data());
+    }
+
+    buf.resize(size);
+
+    return ms;
+}
+
+int main(int argc, char *argv[])
+{
+    int natoms = argc > 1 ? std::stoi(argv[1]) : 1000000;
+    int nframes = argc > 2 ? std::stoi(argv[2]) : 10;
+    int max_threads = argc > 3 ? std::stoi(argv[3]) : omp_get_max_threads();
+
+    const real L = 22.0; // ~1M atoms of water
+
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<real> box_pos(0.0, L);
+    std::normal_distribution<real> vel(0.0, 0.5);
+    std::normal_distribution<real> force(0.0, 500.0);
+
+    std::vector<real> xv(3 * natoms);
+    std::vector<real> vv(3 * natoms);
+    std::vector<real> fv(3 * natoms);
+    std::vector<real> vvv(6 * natoms);
+    std::vector<real> mass(natoms);
+    std::vector<int> index(natoms);
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            xv[3 * n + d] = box_pos(gen);
+            vv[3 * n + d] = vel(gen);
+            fv[3 * n + d] = force(gen);
+        }
+
+        // xx yy zz xy xz yz
+        const int a[6] = {0, 1, 2, 0, 0, 1};
+        const int b[6] = {0, 1, 2, 1, 2, 2};
+
+        for (int k = 0; k < 6; k++)
+        {
+            vvv[6 * n + k] = vv[3 * n + a[k]] * vv[3 * n + b[k]];
+        }
+
+        mass[n] = (n % 3 == 0) ? 15.9994 : 1.008;
+        index[n] = natoms - 1 - n;
+    }
+
+    rvec box[3] = {{L, 0, 0}, {0, L, 0}, {0, 0, L}};
+
+    traj_writer::frame_view<real> frame;
+
+    frame.box = box;
+    frame.natoms = natoms;
+    frame.natoms_global = natoms;
+    frame.x = reinterpret_cast<const rvec *>(xv.data());
+    frame.v = reinterpret_cast<const rvec *>(vv.data());
+
+    std::vector<encoding> encodings;
+
+    encodings.push_back({"x, v (default)", {}, frame, false});
+
+    // Shard of a domain decomposition with all per-atom fields
+    traj_writer::frame_view<real> all = frame;
+    all.mass = mass.data();
+    all.f = reinterpret_cast<const rvec *>(fv.data());
+    all.index = index.data();
+
+    encodings.push_back({"mass, x, v, f, index", {}, all, false});
+
+    traj_writer::format_options soa;
+    soa.layout = traj_format::layout_soa;
+
+    encodings.push_back({"mass, x, v, f, index (SoA)", soa, all, false});
+
+    // Averaged frame
+    traj_writer::frame_view<real> average = frame;
+    average.vv = reinterpret_cast<const real(*)[6]>(vvv.data());
+    average.average = true;
+
+    encodings.push_back({"x, v, vv (averaged)", {}, average, false});
+
+    // Quantized coordinates and 16-bit velocities and forces
+    traj_writer::format_options quantized;
+    quantized.precision = 0.001;
+    quantized.half = traj_format::field_half_fp16;
+
+    traj_writer::frame_view<real> xvf = frame;
+    xvf.f = reinterpret_cast<const rvec *>(fv.data());
+
+    encodings.push_back({"x 0.001 nm, v, f fp16 (writer)", quantized, xvf, true});
+
+    quantized.half = traj_format::field_half_bf16;
+    quantized.layout = traj_format::layout_soa;
+
+    encodings.push_back({"x 0.001 nm, v, f bf16 SoA (shm)", quantized, xvf, false});
+
+    std::cout << "natoms = " << natoms << ", frames = " << nframes << ", threads = 1.." << max_threads << "\n\n";
+
+    std::cout << std::left << std::setw(34) << "encoding" << std::right;
+
+    for (int t = 1; t <= max_threads; t++)
+    {
+        std::cout << std::setw(14) << (std::to_string(t) + (t == 1 ? " thread" : " threads"));
+    }
+
+    std::cout << "\n";
+
+    int errors = 0;
+
+    for (const encoding &e : encodings)
+    {
+        traj_writer::aligned_buffer serial;
+        traj_writer::aligned_buffer parallel;
+
+        const double serial_ms = time_pack(e, nframes, 1, serial);
+
+        std::cout << std::left << std::setw(34) << e.name << std::right << std::fixed << std::setprecision(2) << std::setw(11) << serial_ms
+                  << " ms";
+
+        for (int t = 2; t <= max_threads; t++)
+        {
+            const double ms = time_pack(e, nframes, t, parallel);
+
+            std::cout << std::setw(7) << ms << " ms " << std::setw(3) << std::setprecision(1) << serial_ms / ms << "x" << std::setprecision(2);
+
+            // The frame must not depend on the number of threads
+            if (parallel.size() != serial.size() || std::memcmp(parallel.data(), serial.data(), serial.size()) != 0)
+            {
+                std::cout << " (differs!)";
+                errors++;
+            }
+        }
+
+        std::cout << "  " << serial.size() / 1.0e6 << " MB\n";
+    }
+
+    if (errors)
+    {
+        std::cerr << "\nERROR: " << errors << " frames packed by several threads differ from the frames of one thread\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,481 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Binning of mass, momentum and the velocity tensor onto Cartesian grids, shared by
+ * `water_pure/read_traj.cpp` (from the out-files) and mdrun (in situ, without out-files).
+ *
+ * Records of the output files `output_<N>.dat` (one file per grid of N x N x N cells),
+ * one per frame, all values as float:
+ *     time, cell volume, then for each cell (i + N * j + N * N * k):
+ *     density, momentum x y z, velocity tensor xx yy zz xy xz yz
+ * The density and momentum are divided by the cell volume, the velocity tensor
+ * (sum of m v v) by the mass of the cell.
+ */
+namespace traj_binning
+{
+
+/*
+ * Number of grids
+ */
+constexpr int N_grids = 3;
+
+/*
+ * Number of values per cell
+ */
+constexpr int N_cell_values = 10;
+
+/*
+ * Returns x^3
+ */
+template <typename T>
+T cube(const T x) noexcept
+{
+    return x * x * x;
+}
+
+/*
+ * Sets the grids for the box size in nm ("7", "10" or "15").
+ * Returns false for other box sizes.
+ */
+inline bool grids_for_box(const std::string &boxsize, std::array<int, N_grids> &grids)
+{
+    if (boxsize == "7")
+    {
+        grids = {2, 5, 10};
+    }
+    else if (boxsize == "10")
+    {
+        grids = {3, 7, 15};
+    }
+    else if (boxsize == "15")
+    {
+        grids = {5, 10, 22};
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Statistics of a single frame on all grids.
+ *
+ * `add` accumulates the sums of the atoms (in parallel with OpenMP), `finish` turns them
+ * into the values of the output records. With domain decomposition, every rank adds its
+ * home atoms and the raw `sums` of all ranks are added up before `finish`.
+ */
+class grid_binning
+{
+public:
+    explicit grid_binning(const std::array<int, N_grids> &grids)
+        : grids(grids)
+    {
+        size_t offset = 0;
+
+        for (int ng = 0; ng < N_grids; ++ng)
+        {
+            offsets[ng] = offset;
+            offset += static_cast<size_t>(cube(grids[ng])) * N_cell_values;
+        }
+
+        values.assign(offset, 0.0);
+    }
+
+    /*
+     * Clears the sums
+     */
+    void reset()
+    {
+        std::fill(values.begin(), values.end(), 0.0);
+
+        cell_volume.fill(0.0);
+
+        time = 0.0;
+        step = 0;
+    }
+
+    /*
+     * Adds `natoms` atoms with coordinates (x[s * n], y[s * n], z[s * n]) and velocities
+     * (vx[s * n], ...) with the stride s = `stride` (1 for SoA arrays, 3 for rvec arrays),
+     * wrapped into the cubic box of size `L`, using up to `nthreads` OpenMP threads.
+     * Returns false if an atom cannot be assigned to a cell.
+     */
+    template <typename Real>
+    bool add(int natoms,
+             const Real *x,
+             const Real *y,
+             const Real *z,
+             const Real *vx,
+             const Real *vy,
+             const Real *vz,
+             size_t stride,
+             const Real *mass,
+             Real L,
+             int nthreads = 1)
+    {
+        bool ok = true;
+
+#ifdef _OPENMP
+        nthreads = nthreads > 1 ? nthreads : 1;
+#else
+        (void)nthreads;
+#endif
+
+#pragma omp parallel num_threads(nthreads) reduction(&& : ok)
+        {
+#ifdef _OPENMP
+            const int thread = omp_get_thread_num();
+
+            // Per-thread sums, added up below (the first thread adds into `values`)
+#pragma omp single
+            partial.resize(omp_get_num_threads() - 1);
+#else
+            const int thread = 0;
+#endif
+            std::vector<double> &sums = thread == 0 ? values : partial[thread - 1];
+
+            if (thread > 0)
+            {
+                sums.assign(values.size(), 0.0);
+            }
+
+#pragma omp for schedule(static)
+            for (int n = 0; n < natoms; ++n)
+            {
+                ok = add_atom(sums, x[stride * n], y[stride * n], z[stride * n], vx[stride * n], vy[stride * n], vz[stride * n], mass[n], L) && ok;
+            }
+
+            // Reduce the per-thread sums in parallel over the values
+#pragma omp for schedule(static)
+            for (long i = 0; i < static_cast<long>(values.size()); ++i)
+            {
+                for (const auto &p : partial)
+                {
+                    values[i] += p[i];
+                }
+            }
+        }
+
+        return ok;
+    }
+
+    /*
+     * Raw sums of all grids, to be added up over all ranks before `finish`
+     */
+    std::vector<double> &sums()
+    {
+        return values;
+    }
+
+    /*
+     * Turns the sums into the values of the output records of the frame at `time` and `step`
+     * in the cubic box of size `L`
+     */
+    template <typename Real>
+    void finish(double frame_time, int64_t frame_step, Real L)
+    {
+        for (int ng = 0; ng < N_grids; ++ng)
+        {
+            // Control volumes: N x N x N
+            const int N = grids[ng];
+            const int N3 = cube<int>(N);
+
+            // CV volume [nm] (edge in the precision of `L`)
+            const double V_cell = cube<double>(L / N);
+
+            cell_volume[ng] = V_cell;
+
+            // Loop over cells in the grid
+            for (int ind = 0; ind < N3; ++ind)
+            {
+                double *cell = values.data() + offsets[ng] + static_cast<size_t>(ind) * N_cell_values;
+
+                for (int c = 0; c < 4; ++c)
+                {
+                    cell[c] /= V_cell;
+                }
+
+                // Mass of the cell
+                const double mass = cell[0] * V_cell;
+
+                for (int c = 4; c < N_cell_values; ++c)
+                {
+                    cell[c] /= mass;
+                }
+            }
+        }
+
+        time = frame_time;
+        step = frame_step;
+    }
+
+    /*
+     * Writes the output record of grid `ng` after `finish`
+     */
+    bool write_record(std::ostream &out, int ng) const
+    {
+        const size_t ncells = cube(grids[ng]);
+
+        std::vector<float> record(2 + ncells * N_cell_values);
+
+        record[0] = static_cast<float>(time);
+        record[1] = static_cast<float>(cell_volume[ng]);
+
+        const double *cells = values.data() + offsets[ng];
+
+        for (size_t i = 0; i < ncells * N_cell_values; ++i)
+        {
+            record[2 + i] = static_cast<float>(cells[i]);
+        }
+
+        out.write(reinterpret_cast<const char *>(record.data()), record.size() * sizeof(float));
+
+        return static_cast<bool>(out);
+    }
+
+    /*
+     * Returns the grid sizes
+     */
+    const std::array<int, N_grids> &grid_sizes() const
+    {
+        return grids;
+    }
+
+private:
+    const std::array<int, N_grids> grids; // Cells per box edge of each grid
+
+    std::array<size_t, N_grids> offsets{}; // Offset of each grid in `values`
+
+    std::vector<double> values; // Sums, then record values: N_cell_values per cell of each grid
+
+    std::vector<std::vector<double>> partial; // Sums of the other OpenMP threads
+
+    std::array<double, N_grids> cell_volume{}; // Cell volume of each grid [nm^3]
+
+    double time{0.0}; // Time of the frame [ps]
+
+    int64_t step{0}; // Time step of the frame
+
+    /*
+     * Adds a single atom to `sums`. Returns false if it cannot be assigned to a cell.
+     */
+    template <typename Real>
+    bool add_atom(std::vector<double> &sums, Real rx, Real ry, Real rz, Real vx, Real vy, Real vz, Real mass, Real L) const
+    {
+        // PBC for atoms less than one box away
+        rx += rx < 0 ? L : 0;
+        ry += ry < 0 ? L : 0;
+        rz += rz < 0 ? L : 0;
+
+        rx -= rx >= L ? L : 0;
+        ry -= ry >= L ? L : 0;
+        rz -= rz >= L ? L : 0;
+
+        // PBC for atoms further away (rare)
+        while (rx < 0)
+        {
+            rx += L;
+        }
+        while (ry < 0)
+        {
+            ry += L;
+        }
+        while (rz < 0)
+        {
+            rz += L;
+        }
+        while (rx >= L)
+        {
+            rx -= L;
+        }
+        while (ry >= L)
+        {
+            ry -= L;
+        }
+        while (rz >= L)
+        {
+            rz -= L;
+        }
+
+        // Loop over grids
+        for (int ng = 0; ng < N_grids; ++ng)
+        {
+            // Control volumes: N x N x N
+            const int N = grids[ng];
+
+            // Local indexes
+            const int i = (rx / L) * N;
+            const int j = (ry / L) * N;
+            const int k = (rz / L) * N;
+
+            // Should never happen
+            if (i < 0 || i >= N || j < 0 || j >= N || k < 0 || k >= N)
+            {
+                return false;
+            }
+
+            // Global index (0..N^3-1)
+            const int ind = i + N * j + N * N * k;
+
+            double *cell = sums.data() + offsets[ng] + static_cast<size_t>(ind) * N_cell_values;
+
+            // Density
+            cell[0] += mass;
+
+            // Momentum
+            cell[1] += mass * vx;
+            cell[2] += mass * vy;
+            cell[3] += mass * vz;
+
+            // Velocity tensor
+            cell[4] += mass * vx * vx;
+            cell[5] += mass * vy * vy;
+            cell[6] += mass * vz * vz;
+            cell[7] += mass * vx * vy;
+            cell[8] += mass * vx * vz;
+            cell[9] += mass * vy * vz;
+        }
+
+        return true;
+    }
+};
+
+/*
+ * Writes the records of `grid_binning` into the output files `output_<N>.dat`, one per grid.
+ * With `frames_per_file` > 0, the records are split into files `output_<N>.NNNNNN.dat` of
+ * `frames_per_file` records each; every file is written as `output_<N>.NNNNNN` and renamed
+ * once it is complete, like the out-files of the trajectory writer.
+ */
+class grid_output
+{
+public:
+    grid_output(const std::array<int, N_grids> &grids, int frames_per_file = 0)
+        : grids(grids),
+          N_frames_per_file(frames_per_file)
+    {
+    }
+
+    ~grid_output()
+    {
+        close();
+    }
+
+    grid_output(const grid_output &) = delete;
+    grid_output &operator=(const grid_output &) = delete;
+
+    /*
+     * Appends the records of the frame to the output files. Returns false on error.
+     */
+    bool write(const grid_binning &frame)
+    {
+        if (N_frames_per_file > 0 && N_frame_counter % N_frames_per_file == 0 && !close())
+        {
+            return false;
+        }
+
+        if (!is_open && !open())
+        {
+            return false;
+        }
+
+        for (int ng = 0; ng < N_grids; ++ng)
+        {
+            if (!frame.write_record(files[ng], ng))
+            {
+                return false; // Error writing the record
+            }
+        }
+
+        N_frame_counter++;
+
+        return true;
+    }
+
+    /*
+     * Closes the output files and renames them adding the extension. Returns false on error.
+     */
+    bool close()
+    {
+        if (!is_open)
+        {
+            return true;
+        }
+
+        is_open = false;
+
+        bool ok = true;
+
+        for (int ng = 0; ng < N_grids; ++ng)
+        {
+            files[ng].close();
+
+            ok = ok && static_cast<bool>(files[ng]);
+
+            if (ok && N_frames_per_file > 0)
+            {
+                ok = std::rename(file_names[ng].c_str(), (file_names[ng] + ".dat").c_str()) == 0;
+            }
+        }
+
+        return ok;
+    }
+
+private:
+    const std::array<int, N_grids> grids; // Cells per box edge of each grid
+
+    const int N_frames_per_file; // Number of records per file, 0 for a single file
+
+    int N_frame_counter{0}; // Counts written records
+
+    bool is_open{false}; // Output files are open
+
+    std::array<std::ofstream, N_grids> files; // Output file of each grid
+
+    std::array<std::string, N_grids> file_names; // Names of the open files (without extension while written)
+
+    /*
+     * Opens the output files of the current records
+     */
+    bool open()
+    {
+        for (int ng = 0; ng < N_grids; ++ng)
+        {
+            file_names[ng] = "output_" + std::to_string(grids[ng]);
+
+            if (N_frames_per_file > 0)
+            {
+                char suffix[16];
+                std::snprintf(suffix, sizeof(suffix), ".%06d", N_frame_counter / N_frames_per_file);
+
+                file_names[ng] += suffix;
+            }
+
+            files[ng].open(N_frames_per_file > 0 ? file_names[ng] : file_names[ng] + ".dat", std::ios::binary);
+
+            if (!files[ng])
+            {
+                return false; // Error opening file
+            }
+        }
+
+        is_open = true;
+
+        return true;
+    }
+};
+
+} // namespace traj_binning
@@ -0,0 +1,1255 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Encoders and decoders of frame blocks, shared by the writer and the reader
+ */
+namespace traj_codec
+{
+
+/*
+ * Atoms per block of the atom ranges of OpenMP threads: whole 64-bit words of quantized
+ * coordinates and whole cache lines of packed values
+ */
+constexpr size_t atom_block = 64;
+
+/*
+ * Minimum number of atoms per OpenMP thread; smaller frames are encoded by fewer threads,
+ * for which the parallel region costs more than it saves
+ */
+constexpr size_t min_atoms_per_thread = 16384;
+
+/*
+ * Returns the number of OpenMP threads, at most `nthreads`, to encode `natoms` atoms (1 without OpenMP)
+ */
+inline int atom_threads(size_t natoms, int nthreads)
+{
+#ifdef _OPENMP
+    const size_t max_threads = natoms / min_atoms_per_thread;
+
+    return (nthreads > 1 && max_threads > 1) ? static_cast<int>(std::min(static_cast<size_t>(nthreads), max_threads)) : 1;
+#else
+    (void)natoms;
+    (void)nthreads;
+
+    return 1;
+#endif
+}
+
+/*
+ * Returns the atoms [begin, end) of the calling OpenMP thread when `natoms` atoms are split into
+ * contiguous ranges of whole blocks of `atom_block` atoms (the last thread also takes the rest),
+ * or all atoms outside a parallel region. Returns the number of the thread.
+ */
+inline int atom_range(size_t natoms, size_t &begin, size_t &end)
+{
+#ifdef _OPENMP
+    const int thread = omp_get_thread_num();
+    const int nthreads = omp_get_num_threads();
+#else
+    const int thread = 0;
+    const int nthreads = 1;
+#endif
+
+    const size_t nblocks = natoms / atom_block;
+
+    begin = nblocks * thread / nthreads * atom_block;
+    end = (thread + 1 == nthreads) ? natoms : nblocks * (thread + 1) / nthreads * atom_block;
+
+    return thread;
+}
+
+/*
+ * Header of a block of quantized coordinates.
+ *
+ * Coordinates are rounded to integer multiples of `precision` (nm); for each
+ * component d, the values q - min[d] are stored with bits[d] bits each, packed
+ * atom by atom (x, y, z) into a bit stream of 64-bit words, least significant
+ * bit first (native byte order, like the rest of the file).
+ */
+struct quantized_header
+{
+    double precision; // Precision of the coordinates (nm)
+    int32_t min[3];   // Minimum quantized value of each component
+    uint32_t bits[3]; // Number of bits per value of each component
+};
+
+static_assert(sizeof(quantized_header) == 32, "Unexpected padding in quantized_header");
+
+/*
+ * Returns the size of a block of quantized coordinates (bytes), including its header
+ */
+inline size_t quantized_size(int natoms, const uint32_t bits[3])
+{
+    const uint64_t total_bits = static_cast<uint64_t>(natoms) * (bits[0] + bits[1] + bits[2]);
+
+    return sizeof(quantized_header) + (total_bits + 63) / 64 * sizeof(uint64_t);
+}
+
+/*
+ * Returns the buffer size needed to quantize `natoms` coordinates (bytes):
+ * the largest block plus one word of scratch space used by the encoder
+ */
+inline size_t max_quantized_size(int natoms)
+{
+    const uint32_t bits[3] = {32, 32, 32};
+
+    return quantized_size(natoms, bits) + sizeof(uint64_t);
+}
+
+/*
+ * Returns `y` rounded to the nearest integer (halves up); `y` must fit into int64.
+ * Truncation and correction instead of std::floor, which is often not inlined.
+ */
+inline int64_t round_half_up(double y)
+{
+    const double z = y + 0.5;
+    const int64_t t = static_cast<int64_t>(z);
+
+    return t - (static_cast<double>(t) > z ? 1 : 0);
+}
+
+/*
+ * Computes the range of the quantized coordinates and the number of bits per component,
+ * using up to `nthreads` OpenMP threads (with the same result).
+ * Returns false if the coordinates cannot be quantized with this precision (int32 overflow).
+ */
+template <typename Real>
+bool quantize_range(const Real (*x)[3], int natoms, double precision, quantized_header &q, int nthreads = 1)
+{
+    const double inv = 1.0 / precision;
+
+    Real lo[3] = {0, 0, 0};
+    Real hi[3] = {0, 0, 0};
+
+    if (natoms > 0)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            lo[d] = hi[d] = x[0][d];
+        }
+    }
+
+    nthreads = atom_threads(natoms, nthreads);
+
+    // Bounds of the atom range of each thread, starting from the first atom like a single loop;
+    // combined in the order of the threads, they are the bounds of a single loop (which skips NaN)
+    std::vector<Real> bounds(6 * nthreads);
+
+#pragma omp parallel num_threads(nthreads) if (nthreads > 1)
+    {
+        size_t begin;
+        size_t end;
+
+        const int thread = atom_range(natoms, begin, end);
+
+        Real tlo[3] = {lo[0], lo[1], lo[2]};
+        Real thi[3] = {hi[0], hi[1], hi[2]};
+
+        // In the precision of the input, which the compiler vectorizes
+        for (size_t n = begin; n < end; n++)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                tlo[d] = x[n][d] < tlo[d] ? x[n][d] : tlo[d];
+                thi[d] = x[n][d] > thi[d] ? x[n][d] : thi[d];
+            }
+        }
+
+        for (int d = 0; d < 3; d++)
+        {
+            bounds[6 * thread + d] = tlo[d];
+            bounds[6 * thread + 3 + d] = thi[d];
+        }
+    }
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            lo[d] = bounds[6 * t + d] < lo[d] ? bounds[6 * t + d] : lo[d];
+            hi[d] = bounds[6 * t + 3 + d] > hi[d] ? bounds[6 * t + 3 + d] : hi[d];
+        }
+    }
+
+    q.precision = precision;
+
+    for (int d = 0; d < 3; d++)
+    {
+        const double ylo = lo[d] * inv;
+        const double yhi = hi[d] * inv;
+
+        if (!(ylo >= std::numeric_limits<int32_t>::min() && yhi <= std::numeric_limits<int32_t>::max()))
+        {
+            return false; // Out of range or not finite
+        }
+
+        q.min[d] = static_cast<int32_t>(round_half_up(ylo));
+
+        const uint64_t range = static_cast<uint64_t>(round_half_up(yhi) - q.min[d]);
+
+        q.bits[d] = 0;
+
+        while (q.bits[d] < 32 && (range >> q.bits[d]) != 0)
+        {
+            q.bits[d]++;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Quantizes and bit-packs the coordinates of the atoms [begin, end) into the bit stream at `stream`,
+ * starting at a byte boundary. Stores whole words, so up to 8 bytes after the packed bits are overwritten.
+ * Returns the position of the last incomplete byte; its bits are left in `rest`.
+ */
+template <typename Real>
+char *quantize_atoms(char *stream, const Real (*x)[3], size_t begin, size_t end, const quantized_header &q, uint64_t &rest)
+{
+    const double inv = 1.0 / q.precision;
+
+    uint64_t acc = 0;  // Bits not yet stored (fewer than 8 after each store)
+    uint32_t fill = 0; // Number of bits in `acc`
+
+    // Appends `nbits` bits of `v` to the stream: stores all 8 bytes, keeps the incomplete byte
+    auto append = [&](uint64_t v, uint32_t nbits) {
+        acc |= v << fill;
+        fill += nbits;
+
+        std::memcpy(stream, &acc, sizeof(acc));
+        stream += fill >> 3;
+        acc >>= fill & ~7u;
+        fill &= 7;
+    };
+
+    const uint32_t atom_bits = q.bits[0] + q.bits[1] + q.bits[2];
+
+    for (size_t n = begin; n < end; n++)
+    {
+        // Zero if the component has no bits: all values are equal to the minimum
+        const uint64_t vx = static_cast<uint64_t>(round_half_up(x[n][0] * inv) - q.min[0]);
+        const uint64_t vy = static_cast<uint64_t>(round_half_up(x[n][1] * inv) - q.min[1]);
+        const uint64_t vz = static_cast<uint64_t>(round_half_up(x[n][2] * inv) - q.min[2]);
+
+        if (atom_bits <= 57)
+        {
+            // The whole atom at once (e.g. 3 x 14 bits for a 15 nm box at 0.001 nm)
+            append(vx | (vy << q.bits[0]) | (vz << (q.bits[0] + q.bits[1])), atom_bits);
+        }
+        else
+        {
+            append(vx, q.bits[0]);
+            append(vy, q.bits[1]);
+            append(vz, q.bits[2]);
+        }
+    }
+
+    rest = acc;
+
+    return stream;
+}
+
+/*
+ * Quantizes and bit-packs the coordinates into `out`, which must hold
+ * `quantized_size(natoms, q.bits) + sizeof(uint64_t)` bytes; `q` comes from `quantize_range`.
+ * With `nthreads` > 1, OpenMP threads pack ranges of whole blocks of `atom_block` atoms, which
+ * start at whole words of the stream, so the block is the same.
+ * Returns the size of the block (bytes).
+ */
+template <typename Real>
+size_t quantize_positions(char *out, const Real (*x)[3], int natoms, const quantized_header &q, int nthreads = 1)
+{
+    const size_t size = quantized_size(natoms, q.bits);
+
+    std::memcpy(out, &q, sizeof(q));
+
+    char *const stream = out + sizeof(q);
+
+    const uint32_t atom_bits = q.bits[0] + q.bits[1] + q.bits[2];
+
+    nthreads = atom_bits > 0 ? atom_threads(natoms, nthreads) : 1;
+
+    char *tail = stream; // Last incomplete byte
+    uint64_t rest = 0;   // and its bits
+
+#pragma omp parallel num_threads(nthreads) if (nthreads > 1)
+    {
+        size_t begin;
+        size_t end;
+
+        atom_range(natoms, begin, end);
+
+        char *const first = stream + begin * atom_bits / 8;
+
+        // The first block is packed aside and copied once all threads are done, as the thread
+        // before stores up to 8 bytes past its range (64 atoms of up to 3 x 32 bits, plus a word)
+        uint64_t head[3 * 32 + 1];
+
+        const size_t head_end = std::min(end, begin + atom_block);
+
+        uint64_t acc = 0;
+
+        const size_t head_bytes = quantize_atoms(reinterpret_cast<char *>(head), x, begin, head_end, q, acc) - reinterpret_cast<char *>(head);
+
+        char *last = first + head_bytes;
+
+        if (head_end < end)
+        {
+            last = quantize_atoms(last, x, head_end, end, q, acc);
+        }
+
+#pragma omp barrier
+
+        std::memcpy(first, head, head_bytes);
+
+        if (end == static_cast<size_t>(natoms))
+        {
+            tail = last;
+            rest = acc;
+        }
+    }
+
+    // Last incomplete byte and zero padding up to the end of the last word
+    std::memset(tail, 0, out + size - tail);
+    std::memcpy(tail, &rest, 1);
+
+    return size;
+}
+
+/*
+ * Decodes a block of quantized coordinates of `size` bytes into
+ * out[d][n * stride] (e.g. stride 3 for an array of xyz vectors, 1 for separate arrays).
+ * Returns false if the block is invalid.
+ */
+inline bool dequantize_positions(const char *in, size_t size, int natoms, float *const out[3], size_t stride)
+{
+    quantized_header q;
+
+    if (size < sizeof(q))
+    {
+        return false;
+    }
+
+    std::memcpy(&q, in, sizeof(q));
+
+    if (q.bits[0] > 32 || q.bits[1] > 32 || q.bits[2] > 32 || size != quantized_size(natoms, q.bits))
+    {
+        return false;
+    }
+
+    const char *words = in + sizeof(q);
+    const size_t nwords = (size - sizeof(q)) / sizeof(uint64_t);
+
+    uint64_t pos = 0; // Bit position in the stream
+
+    for (int n = 0; n < natoms; n++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            const uint32_t b = q.bits[d];
+
+            uint64_t v = 0;
+
+            if (b > 0)
+            {
+                const uint64_t word = pos >> 6;
+                const uint32_t off = pos & 63;
+
+                uint64_t lo;
+                std::memcpy(&lo, words + word * sizeof(lo), sizeof(lo));
+                v = lo >> off;
+
+                if (off + b > 64 && word + 1 < nwords)
+                {
+                    uint64_t hi;
+                    std::memcpy(&hi, words + (word + 1) * sizeof(hi), sizeof(hi));
+                    v |= hi << (64 - off);
+                }
+
+                v &= (b == 64) ? ~0ull : ((1ull << b) - 1);
+                pos += b;
+            }
+
+            out[d][n * stride] = static_cast<float>((static_cast<int64_t>(v) + q.min[d]) * q.precision);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Lossless compression of a frame body.
+ *
+ * The body is split into chunks of `chunk_size` bytes, which are compressed
+ * independently and can be decompressed in parallel. Each chunk is
+ * byte-shuffled (byte 0 of all 4-byte values, then byte 1, ...) into four
+ * byte planes, which separates the slowly varying sign and exponent bytes of
+ * the floats from the noisy mantissa bytes. Each plane is then stored as it is,
+ * compressed with a small LZ77 coder (LZ4-style sequences, for repeated values)
+ * or with a canonical Huffman code (for few distinct bytes in any order),
+ * whichever is smallest.
+ *
+ * Block: compressed_header, uint32 compressed size of each chunk, chunks
+ * Chunk: for each plane: uint8 `stream_method`, uint32 size; then the planes
+ */
+struct compressed_header
+{
+    uint64_t raw_size;   // Size of the uncompressed body (bytes)
+    uint32_t chunk_size; // Size of an uncompressed chunk (bytes), except for the last one
+    uint32_t nchunks;    // Number of chunks
+};
+
+static_assert(sizeof(compressed_header) == 16, "Unexpected padding in compressed_header");
+
+/*
+ * Default size of an uncompressed chunk (bytes)
+ */
+constexpr uint32_t default_chunk_size = 1u << 20;
+
+/*
+ * Width of the shuffled values (bytes)
+ */
+constexpr size_t shuffle_width = 4;
+
+/*
+ * Byte-shuffles `n` bytes: byte b of value i goes to position b * (n / 4) + i.
+ * Trailing bytes that do not form a whole value are copied as they are.
+ */
+inline void shuffle(const char *in, char *out, size_t n)
+{
+    const size_t count = n / shuffle_width;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t b = 0; b < shuffle_width; b++)
+        {
+            out[b * count + i] = in[i * shuffle_width + b];
+        }
+    }
+
+    std::memcpy(out + count * shuffle_width, in + count * shuffle_width, n - count * shuffle_width);
+}
+
+/*
+ * Reverses `shuffle`
+ */
+inline void unshuffle(const char *in, char *out, size_t n)
+{
+    const size_t count = n / shuffle_width;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t b = 0; b < shuffle_width; b++)
+        {
+            out[i * shuffle_width + b] = in[b * count + i];
+        }
+    }
+
+    std::memcpy(out + count * shuffle_width, in + count * shuffle_width, n - count * shuffle_width);
+}
+
+/*
+ * Returns the largest size of `n` bytes compressed by `lz_compress`
+ */
+inline size_t lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+/*
+ * Writes a length extension: runs of 255 and a final byte
+ */
+inline uint8_t *lz_put_length(uint8_t *out, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        *out++ = 255;
+    }
+
+    *out++ = static_cast<uint8_t>(len);
+
+    return out;
+}
+
+/*
+ * Compresses `n` bytes into `out`, which must hold `lz_bound(n)` bytes, using `table`
+ * (1 << 16 entries) as scratch. Returns the compressed size.
+ *
+ * Sequence: token (literal length << 4 | match length - 4, 15 = extended),
+ * [literal length extension], literals, uint16 match offset, [match length extension].
+ * The last sequence has literals only.
+ */
+inline size_t lz_compress(const char *in, size_t n, char *out, uint32_t *table)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(in);
+    uint8_t *dst = reinterpret_cast<uint8_t *>(out);
+
+    constexpr size_t min_match = 4;
+    constexpr size_t max_offset = 65535;
+    constexpr int hash_bits = 16;
+
+    std::memset(table, 0, sizeof(uint32_t) << hash_bits);
+
+    auto read32 = [src](size_t i) {
+        uint32_t v;
+        std::memcpy(&v, src + i, sizeof(v));
+        return v;
+    };
+
+    // Emits literals [anchor, ip) followed by a match (none if len == 0)
+    auto emit = [&dst, src](size_t anchor, size_t ip, size_t offset, size_t len) {
+        const size_t lit = ip - anchor;
+        const size_t mlen = len ? len - min_match : 0;
+
+        *dst++ = static_cast<uint8_t>(((lit < 15 ? lit : 15) << 4) | (mlen < 15 ? mlen : 15));
+
+        if (lit >= 15)
+        {
+            dst = lz_put_length(dst, lit - 15);
+        }
+
+        std::memcpy(dst, src + anchor, lit);
+        dst += lit;
+
+        if (len)
+        {
+            *dst++ = static_cast<uint8_t>(offset);
+            *dst++ = static_cast<uint8_t>(offset >> 8);
+
+            if (mlen >= 15)
+            {
+                dst = lz_put_length(dst, mlen - 15);
+            }
+        }
+    };
+
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    // Matches start at least 12 bytes before the end and leave the last 5 bytes as literals
+    const size_t match_limit = n > 12 ? n - 12 : 0;
+    const size_t match_end = n > 5 ? n - 5 : 0;
+
+    while (ip < match_limit)
+    {
+        const uint32_t seq = read32(ip);
+        const uint32_t h = (seq * 2654435761u) >> (32 - hash_bits);
+        const size_t ref = table[h];
+
+        table[h] = static_cast<uint32_t>(ip);
+
+        if (ref < ip && ip - ref <= max_offset && read32(ref) == seq)
+        {
+            size_t len = min_match;
+
+            while (ip + len < match_end && src[ref + len] == src[ip + len])
+            {
+                len++;
+            }
+
+            emit(anchor, ip, ip - ref, len);
+
+            ip += len;
+            anchor = ip;
+        }
+        else
+        {
+            // Skip faster through data that does not compress
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+
+    emit(anchor, n, 0, 0);
+
+    return dst - reinterpret_cast<uint8_t *>(out);
+}
+
+/*
+ * Decompresses `size` bytes into exactly `n` bytes at `out`.
+ * Returns false if the input is invalid.
+ */
+inline bool lz_decompress(const char *in, size_t size, char *out, size_t n)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(in);
+    const uint8_t *const src_end = src + size;
+    uint8_t *dst = reinterpret_cast<uint8_t *>(out);
+    uint8_t *const dst_begin = dst;
+    uint8_t *const dst_end = dst + n;
+
+    // Reads a length extension
+    auto get_length = [&src, src_end](size_t &len) {
+        uint8_t b;
+
+        do
+        {
+            if (src >= src_end)
+            {
+                return false;
+            }
+
+            b = *src++;
+            len += b;
+        } while (b == 255);
+
+        return true;
+    };
+
+    while (src < src_end)
+    {
+        const uint8_t token = *src++;
+
+        size_t lit = token >> 4;
+
+        if (lit == 15 && !get_length(lit))
+        {
+            return false;
+        }
+
+        if (lit > static_cast<size_t>(src_end - src) || lit > static_cast<size_t>(dst_end - dst))
+        {
+            return false;
+        }
+
+        std::memcpy(dst, src, lit);
+        src += lit;
+        dst += lit;
+
+        if (src == src_end)
+        {
+            break; // Last sequence
+        }
+
+        if (src_end - src < 2)
+        {
+            return false;
+        }
+
+        const size_t offset = src[0] | (static_cast<size_t>(src[1]) << 8);
+        src += 2;
+
+        size_t len = token & 15;
+
+        if (len == 15 && !get_length(len))
+        {
+            return false;
+        }
+
+        len += 4;
+
+        if (offset == 0 || offset > static_cast<size_t>(dst - dst_begin) || len > static_cast<size_t>(dst_end - dst))
+        {
+            return false;
+        }
+
+        const uint8_t *ref = dst - offset;
+
+        if (offset >= len)
+        {
+            std::memcpy(dst, ref, len);
+            dst += len;
+        }
+        else
+        {
+            // Overlapping match: repeats the last `offset` bytes
+            for (size_t i = 0; i < len; i++)
+            {
+                *dst++ = ref[i];
+            }
+        }
+    }
+
+    return dst == dst_end;
+}
+
+/*
+ * Longest Huffman code (bits)
+ */
+constexpr int huffman_max_bits = 12;
+
+/*
+ * Size of the code lengths in front of a Huffman stream (4 bits per byte value)
+ */
+constexpr size_t huffman_table_size = 128;
+
+/*
+ * Computes the lengths of a Huffman code for the byte frequencies `freq`, limited to
+ * `huffman_max_bits` bits; unused bytes get length 0. Returns the coded size in bits.
+ */
+inline uint64_t huffman_lengths(const uint64_t freq[256], uint8_t length[256])
+{
+    uint64_t weight[256];
+    std::memcpy(weight, freq, sizeof(weight));
+
+    while (true)
+    {
+        // Nodes 0-255 are the leaves; each merge appends a node
+        uint64_t node_weight[511];
+        int parent[511];
+        int nodes = 256;
+
+        std::vector<std::pair<uint64_t, int>> heap;
+
+        for (int b = 0; b < 256; b++)
+        {
+            node_weight[b] = weight[b];
+            parent[b] = -1;
+            length[b] = 0;
+
+            if (weight[b])
+            {
+                heap.push_back({weight[b], b});
+            }
+        }
+
+        if (heap.empty())
+        {
+            return 0;
+        }
+
+        if (heap.size() == 1)
+        {
+            length[heap[0].second] = 1;
+            return freq[heap[0].second];
+        }
+
+        auto greater = [](const std::pair<uint64_t, int> &a, const std::pair<uint64_t, int> &b) { return a > b; };
+
+        std::make_heap(heap.begin(), heap.end(), greater);
+
+        while (heap.size() > 1)
+        {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const auto a = heap.back();
+            heap.pop_back();
+
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const auto b = heap.back();
+            heap.pop_back();
+
+            node_weight[nodes] = a.first + b.first;
+            parent[nodes] = -1;
+            parent[a.second] = parent[b.second] = nodes;
+
+            heap.push_back({node_weight[nodes], nodes});
+            std::push_heap(heap.begin(), heap.end(), greater);
+
+            nodes++;
+        }
+
+        // Depth of each leaf
+        int max_length = 0;
+        uint64_t bits = 0;
+
+        for (int b = 0; b < 256; b++)
+        {
+            if (!weight[b])
+            {
+                continue;
+            }
+
+            int depth = 0;
+
+            for (int n = b; parent[n] >= 0; n = parent[n])
+            {
+                depth++;
+            }
+
+            length[b] = static_cast<uint8_t>(depth);
+            max_length = depth > max_length ? depth : max_length;
+            bits += freq[b] * depth;
+        }
+
+        if (max_length <= huffman_max_bits)
+        {
+            return bits;
+        }
+
+        // Too long: flatten the distribution and try again
+        for (int b = 0; b < 256; b++)
+        {
+            weight[b] = weight[b] ? (weight[b] >> 1) | 1 : 0;
+        }
+    }
+}
+
+/*
+ * Assigns canonical codes to the code lengths `length`, bit-reversed for a
+ * bit stream written least significant bit first
+ */
+inline void huffman_codes(const uint8_t length[256], uint16_t code[256])
+{
+    uint32_t next = 0;
+
+    for (int len = 1; len <= huffman_max_bits; len++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            if (length[b] != len)
+            {
+                continue;
+            }
+
+            uint32_t reversed = 0;
+
+            for (int i = 0; i < len; i++)
+            {
+                reversed |= ((next >> i) & 1u) << (len - 1 - i);
+            }
+
+            code[b] = static_cast<uint16_t>(reversed);
+            next++;
+        }
+
+        next <<= 1;
+    }
+}
+
+/*
+ * Writes `n` bytes as a Huffman stream with the code lengths `length` into `out`.
+ * Returns the size of the stream.
+ */
+inline size_t huffman_compress(const char *in, size_t n, const uint8_t length[256], char *out)
+{
+    uint16_t code[256] = {};
+    huffman_codes(length, code);
+
+    for (size_t b = 0; b < huffman_table_size; b++)
+    {
+        out[b] = static_cast<char>(length[2 * b] | (length[2 * b + 1] << 4));
+    }
+
+    char *dst = out + huffman_table_size;
+
+    uint64_t acc = 0;
+    int nbits = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const uint8_t b = static_cast<uint8_t>(in[i]);
+
+        acc |= static_cast<uint64_t>(code[b]) << nbits;
+        nbits += length[b];
+
+        if (nbits >= 32)
+        {
+            const uint32_t word = static_cast<uint32_t>(acc);
+            std::memcpy(dst, &word, sizeof(word));
+            dst += sizeof(word);
+
+            acc >>= 32;
+            nbits -= 32;
+        }
+    }
+
+    for (; nbits > 0; nbits -= 8)
+    {
+        *dst++ = static_cast<char>(acc);
+        acc >>= 8;
+    }
+
+    return dst - out;
+}
+
+/*
+ * Decodes a Huffman stream of `size` bytes into exactly `n` bytes at `out`.
+ * Returns false if the input is invalid.
+ */
+inline bool huffman_decompress(const char *in, size_t size, char *out, size_t n)
+{
+    if (size < huffman_table_size)
+    {
+        return false;
+    }
+
+    uint8_t length[256];
+
+    for (size_t b = 0; b < huffman_table_size; b++)
+    {
+        length[2 * b] = static_cast<uint8_t>(in[b]) & 15;
+        length[2 * b + 1] = static_cast<uint8_t>(in[b]) >> 4;
+    }
+
+    uint16_t code[256] = {};
+    huffman_codes(length, code);
+
+    // Decoding table: byte value | code length << 8 for every `huffman_max_bits`-bit prefix
+    uint16_t table[1 << huffman_max_bits] = {};
+
+    for (int b = 0; b < 256; b++)
+    {
+        if (length[b] == 0 || length[b] > huffman_max_bits)
+        {
+            continue;
+        }
+
+        for (uint32_t i = code[b]; i < (1u << huffman_max_bits); i += 1u << length[b])
+        {
+            table[i] = static_cast<uint16_t>(b | (length[b] << 8));
+        }
+    }
+
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(in) + huffman_table_size;
+    const uint8_t *const src_end = reinterpret_cast<const uint8_t *>(in) + size;
+
+    constexpr uint64_t mask = (1u << huffman_max_bits) - 1;
+
+    uint64_t acc = 0;
+    int nbits = 0;
+    size_t i = 0;
+
+    // Fast path: one refill to at least 56 bits, then 4 codes of at most 12 bits
+    bool valid = true;
+
+    for (; i + 4 <= n && src_end - src >= 8; i += 4)
+    {
+        // Bits beyond the whole bytes taken here are loaded again by the next refill
+        uint64_t word;
+        std::memcpy(&word, src, sizeof(word));
+
+        acc |= word << nbits;
+        src += (63 - nbits) >> 3;
+        nbits |= 56;
+
+        for (int k = 0; k < 4; k++)
+        {
+            const uint16_t entry = table[acc & mask];
+            const int len = entry >> 8;
+
+            valid &= len != 0;
+
+            out[i + k] = static_cast<char>(entry);
+            acc >>= len;
+            nbits -= len;
+        }
+    }
+
+    if (!valid)
+    {
+        return false;
+    }
+
+    for (; i < n; i++)
+    {
+        if (nbits < huffman_max_bits)
+        {
+            for (; nbits <= 56 && src < src_end; nbits += 8)
+            {
+                acc |= static_cast<uint64_t>(*src++) << nbits;
+            }
+        }
+
+        const uint16_t entry = table[acc & mask];
+        const int len = entry >> 8;
+
+        if (len == 0 || len > nbits)
+        {
+            return false;
+        }
+
+        out[i] = static_cast<char>(entry);
+        acc >>= len;
+        nbits -= len;
+    }
+
+    return true;
+}
+
+/*
+ * Encoding of a byte plane in a compressed chunk
+ */
+enum stream_method : uint8_t
+{
+    stream_stored = 0,  // Bytes as they are
+    stream_lz = 1,      // lz_compress
+    stream_huffman = 2, // huffman_compress
+};
+
+/*
+ * Size of the stream headers in front of a compressed chunk
+ */
+constexpr size_t chunk_header_size = shuffle_width * (sizeof(uint8_t) + sizeof(uint32_t));
+
+/*
+ * Returns the range of byte plane `p` of a shuffled chunk of `n` bytes
+ * (the bytes that do not form a whole value belong to the last plane)
+ */
+inline void plane_range(size_t n, size_t p, size_t &begin, size_t &len)
+{
+    const size_t count = n / shuffle_width;
+
+    begin = p * count;
+    len = (p + 1 == shuffle_width) ? n - begin : count;
+}
+
+/*
+ * Returns the largest size of a compressed chunk of `n` bytes
+ */
+inline size_t max_chunk_size(size_t n)
+{
+    return chunk_header_size + n + n / 255 + shuffle_width * 16;
+}
+
+/*
+ * Compresses a chunk of `n` bytes into `out`, which must hold `max_chunk_size(n)` bytes,
+ * using `shuffled` (`n` bytes) and `table` (1 << 16 entries) as scratch. Returns its size.
+ */
+inline size_t compress_chunk(const char *in, size_t n, char *out, char *shuffled, uint32_t *table)
+{
+    shuffle(in, shuffled, n);
+
+    char *header = out;
+    char *dst = out + chunk_header_size;
+
+    for (size_t p = 0; p < shuffle_width; p++)
+    {
+        size_t begin, len;
+        plane_range(n, p, begin, len);
+
+        const char *plane = shuffled + begin;
+
+        uint64_t freq[256] = {};
+
+        for (size_t i = 0; i < len; i++)
+        {
+            freq[static_cast<uint8_t>(plane[i])]++;
+        }
+
+        uint8_t length[256];
+        const size_t huffman_size = huffman_table_size + (huffman_lengths(freq, length) + 7) / 8;
+
+        uint8_t method = stream_stored;
+        size_t size = len;
+
+        // Coded planes must save at least 1/16 of their size to be worth decoding
+        const size_t max_size = len - len / 16;
+
+        // LZ first: it writes into `dst` even if the result is not used
+        const size_t lz_size = lz_compress(plane, len, dst, table);
+
+        if (lz_size < max_size && lz_size <= huffman_size)
+        {
+            method = stream_lz;
+            size = lz_size;
+        }
+        else if (huffman_size < max_size)
+        {
+            method = stream_huffman;
+            size = huffman_compress(plane, len, length, dst);
+        }
+        else
+        {
+            std::memcpy(dst, plane, len);
+        }
+
+        const uint32_t size32 = static_cast<uint32_t>(size);
+
+        *header++ = static_cast<char>(method);
+        std::memcpy(header, &size32, sizeof(size32));
+        header += sizeof(size32);
+
+        dst += size;
+    }
+
+    return dst - out;
+}
+
+/*
+ * Decompresses a chunk of `size` bytes into exactly `n` bytes at `out`, using `shuffled`
+ * (`n` bytes) as scratch. Returns false if the input is invalid.
+ */
+inline bool decompress_chunk(const char *in, size_t size, char *out, size_t n, char *shuffled)
+{
+    if (size < chunk_header_size)
+    {
+        return false;
+    }
+
+    const char *header = in;
+    const char *src = in + chunk_header_size;
+    const char *const src_end = in + size;
+
+    for (size_t p = 0; p < shuffle_width; p++)
+    {
+        size_t begin, len;
+        plane_range(n, p, begin, len);
+
+        const uint8_t method = static_cast<uint8_t>(*header++);
+
+        uint32_t stream_size;
+        std::memcpy(&stream_size, header, sizeof(stream_size));
+        header += sizeof(stream_size);
+
+        if (stream_size > static_cast<size_t>(src_end - src))
+        {
+            return false;
+        }
+
+        bool ok = false;
+
+        switch (method)
+        {
+        case stream_stored:
+            ok = stream_size == len;
+            if (ok)
+            {
+                std::memcpy(shuffled + begin, src, len);
+            }
+            break;
+        case stream_lz:
+            ok = lz_decompress(src, stream_size, shuffled + begin, len);
+            break;
+        case stream_huffman:
+            ok = huffman_decompress(src, stream_size, shuffled + begin, len);
+            break;
+        }
+
+        if (!ok)
+        {
+            return false;
+        }
+
+        src += stream_size;
+    }
+
+    unshuffle(shuffled, out, n);
+
+    return src == src_end;
+}
+
+/*
+ * Returns the largest size of a compressed block for a body of `n` bytes
+ */
+inline size_t max_compressed_size(size_t n, uint32_t chunk_size = default_chunk_size)
+{
+    const size_t nchunks = (n + chunk_size - 1) / chunk_size;
+
+    return sizeof(compressed_header) + nchunks * (sizeof(uint32_t) + max_chunk_size(chunk_size));
+}
+
+/*
+ * Compresses the body of `n` bytes into `out`, which must hold `max_compressed_size(n, chunk_size)` bytes.
+ * `scratch` is resized as needed and can be reused between calls.
+ * Returns the size of the compressed block.
+ */
+inline size_t compress(const char *in, size_t n, char *out, std::vector<char> &scratch, uint32_t chunk_size = default_chunk_size)
+{
+    compressed_header h{};
+    h.raw_size = n;
+    h.chunk_size = chunk_size;
+    h.nchunks = static_cast<uint32_t>((n + chunk_size - 1) / chunk_size);
+
+    std::memcpy(out, &h, sizeof(h));
+
+    char *sizes = out + sizeof(h);
+    char *dst = sizes + h.nchunks * sizeof(uint32_t);
+
+    // Hash table of the LZ coder, followed by the shuffled chunk
+    const size_t table_size = sizeof(uint32_t) << 16;
+
+    scratch.resize(table_size + chunk_size);
+
+    uint32_t *table = reinterpret_cast<uint32_t *>(scratch.data());
+    char *shuffled = scratch.data() + table_size;
+
+    for (uint32_t c = 0; c < h.nchunks; c++)
+    {
+        const size_t begin = static_cast<size_t>(c) * chunk_size;
+        const size_t len = (n - begin < chunk_size) ? n - begin : chunk_size;
+
+        const uint32_t size = static_cast<uint32_t>(compress_chunk(in + begin, len, dst, shuffled, table));
+
+        std::memcpy(sizes + c * sizeof(uint32_t), &size, sizeof(size));
+        dst += size;
+    }
+
+    return dst - out;
+}
+
+/*
+ * Reads the uncompressed size of a compressed block of `size` bytes.
+ * Returns false if the block is invalid.
+ */
+inline bool compressed_raw_size(const char *in, size_t size, uint64_t &raw_size)
+{
+    compressed_header h;
+
+    if (size < sizeof(h))
+    {
+        return false;
+    }
+
+    std::memcpy(&h, in, sizeof(h));
+
+    raw_size = h.raw_size;
+
+    return h.chunk_size > 0 && h.nchunks == (h.raw_size + h.chunk_size - 1) / h.chunk_size
+           && size >= sizeof(h) + static_cast<uint64_t>(h.nchunks) * sizeof(uint32_t);
+}
+
+/*
+ * Decompresses a block of `size` bytes into `out`, which must hold the uncompressed
+ * size (see `compressed_raw_size`). The chunks are decompressed in parallel if
+ * OpenMP is enabled. Returns false if the block is invalid.
+ */
+inline bool decompress(const char *in, size_t size, char *out)
+{
+    compressed_header h;
+    uint64_t raw_size;
+
+    if (!compressed_raw_size(in, size, raw_size))
+    {
+        return false;
+    }
+
+    std::memcpy(&h, in, sizeof(h));
+
+    // Offset of each chunk in the block
+    std::vector<uint64_t> offsets(h.nchunks + 1);
+    offsets[0] = sizeof(h) + static_cast<uint64_t>(h.nchunks) * sizeof(uint32_t);
+
+    for (uint32_t c = 0; c < h.nchunks; c++)
+    {
+        uint32_t chunk;
+        std::memcpy(&chunk, in + sizeof(h) + c * sizeof(uint32_t), sizeof(chunk));
+
+        offsets[c + 1] = offsets[c] + chunk;
+    }
+
+    if (offsets[h.nchunks] != size)
+    {
+        return false;
+    }
+
+    int errors = 0;
+
+#pragma omp parallel for reduction(+ : errors) schedule(dynamic)
+    for (int64_t c = 0; c < static_cast<int64_t>(h.nchunks); c++)
+    {
+        const uint64_t begin = static_cast<uint64_t>(c) * h.chunk_size;
+        const size_t len = (raw_size - begin < h.chunk_size) ? raw_size - begin : h.chunk_size;
+
+        std::vector<char> shuffled(len);
+
+        if (!decompress_chunk(in + offsets[c], offsets[c + 1] - offsets[c], out + begin, len, shuffled.data()))
+        {
+            errors++;
+        }
+    }
+
+    return errors == 0;
+}
+
+} // namespace traj_codec
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * On-disk layout of the out-files (version 2), shared by the writer and the reader.
+ *
+ * File:   file_header, static section, frames, [index entries, index_trailer]
+ * Static: per-atom data that does not change during the run, written once per file:
+ *         [mass of all atoms] [charge of all atoms] [type of all atoms] [index of all atoms],
+ *         keeping only the fields set in `file_header::static_fields`,
+ *         in the atom order of the file. With an atom selection, the file contains only
+ *         the selected atoms and the static index maps them to their global atom indices;
+ *         otherwise the atoms are in global order
+ * Frame:  frame_header, body of `frame_header::size` bytes
+ * Body:   for each atom: [index] [mass] x.x v.x f.x x.y v.y f.y x.z v.z f.z,
+ *         keeping only the fields set in `frame_header::fields` (layout_aos), or
+ *         [index of all atoms] [mass of all atoms] [x.x of all atoms] [x.y ...] [x.z ...]
+ *         [v.x ...] [v.y ...] [v.z ...] [f.x ...] [f.y ...] [f.z ...] (layout_soa),
+ *         as set in `file_header::layout`; both layouts have the same size.
+ *         With `field_vv`, the averages of v⊗v follow the values above as
+ *         [vv.xx vv.yy vv.zz vv.xy vv.xz vv.yz of each atom] in both layouts.
+ *         With `field_half_fp16` or `field_half_bf16`, velocities and forces are
+ *         not part of the values above but follow them as 16-bit values:
+ *         [v.x v.y v.z of each atom] [f.x f.y f.z of each atom] (layout_aos) or
+ *         [v.x of all atoms] [v.y ...] [v.z ...] [f.x ...] [f.y ...] [f.z ...] (layout_soa).
+ *         With `field_x_quantized`, the coordinates are not part of the values
+ *         above but follow them as a single block of variable size
+ *         (see traj_codec::quantize_positions).
+ *         With `field_delta`, the whole body above is stored XORed byte by byte with
+ *         the body of the previous frame of the file, which has the same fields and
+ *         size (delta frame); frames without it are keyframes. The first frame of
+ *         every file is a keyframe.
+ *         With `field_compressed`, the whole body above (after the XOR) is stored as a
+ *         block of independently compressed chunks (see traj_codec::compress) and
+ *         `frame_header::size` is the size of that block
+ *
+ * Frames of the same file may contain different fields (e.g. forces only every
+ * 10th frame); `file_header::fields` is the union of the fields of all frames,
+ * updated when the file is closed.
+ *
+ * All values are stored in native byte order; floating-point values in the
+ * body and in the static section are `file_header::float_width` bytes wide,
+ * atom indices and types are int32.
+ * The index (one entry per frame) is appended by the writer when the file is
+ * closed; files without it (e.g. after a crash) can still be read linearly.
+ *
+ * Version 1 files have no file header: each frame is (int step, int natoms,
+ * float time, Lx, Ly, Lz) followed by (mass, x.x, v.x, x.y, v.y, x.z, v.z) per atom.
+ */
+namespace traj_format
+{
+
+constexpr char file_magic[8] = {'M', 'D', 'F', 'H', 'T', 'R', 'J', '\0'};
+constexpr char index_magic[8] = {'M', 'D', 'F', 'H', 'I', 'D', 'X', '\0'};
+
+constexpr uint32_t version = 2;
+
+/*
+ * Field bitmask
+ */
+enum field : uint32_t
+{
+    field_mass = 1u << 0,   // Atom mass
+    field_x = 1u << 1,      // Coordinates
+    field_v = 1u << 2,      // Velocities
+    field_f = 1u << 3,      // Forces
+    field_index = 1u << 4,  // Atom index in the file (shard files), or global atom index (static section)
+    field_charge = 1u << 5, // Atom charge (static section only)
+    field_type = 1u << 6,   // Atom type (static section only)
+
+    field_x_quantized = 1u << 7, // Coordinates quantized to a fixed precision (traj_codec::quantized_header)
+    field_compressed = 1u << 8,  // Body compressed losslessly (traj_codec::compressed_header)
+    field_half_fp16 = 1u << 9,   // Velocities and forces as IEEE half-precision values
+    field_half_bf16 = 1u << 10,  // Velocities and forces as bfloat16 values
+    field_vv = 1u << 11,         // Average of the outer product of the velocities v⊗v (averaged frames only)
+    field_average = 1u << 12,    // Coordinates and velocities averaged over the steps since the previous frame
+    field_delta = 1u << 13,      // Body XORed with the body of the previous frame (delta frame)
+};
+
+/*
+ * Layout of the frame body
+ */
+enum layout : uint32_t
+{
+    layout_aos = 0, // Array of structures: all values of an atom together
+    layout_soa = 1, // Structure of arrays: each component of all atoms together
+};
+
+/*
+ * File header, at the beginning of the file
+ */
+struct file_header
+{
+    char magic[8];          // `file_magic`
+    uint32_t version;       // Format version
+    uint32_t float_width;   // Width of floating-point values (4 or 8 bytes)
+    uint32_t fields;        // Fields written into any frame of this file
+    int32_t natoms;         // Number of atoms in the file: the system, or the atom selection
+    uint32_t static_fields; // Fields in the static section
+    uint32_t layout;        // Layout of the frame bodies (zero in files written before it was added)
+};
+
+/*
+ * Frame header, in front of each frame
+ */
+struct frame_header
+{
+    int64_t step;      // Time step
+    double time;       // Time (ps)
+    double box[3][3];  // Box vectors (nm)
+    int32_t natoms;    // Number of atoms in this frame
+    uint32_t fields;   // Fields written into this frame
+    uint64_t size;     // Size of the frame body (bytes)
+};
+
+/*
+ * Frame index entry
+ */
+struct index_entry
+{
+    uint64_t offset; // Offset of the frame header from the beginning of the file
+    int64_t step;    // Time step
+    double time;     // Time (ps)
+};
+
+/*
+ * Index trailer, at the end of the file
+ */
+struct index_trailer
+{
+    uint64_t nframes; // Number of index entries
+    uint64_t offset;  // Offset of the first index entry
+    char magic[8];    // `index_magic`
+};
+
+static_assert(sizeof(file_header) == 32, "Unexpected padding in file_header");
+static_assert(sizeof(frame_header) == 104, "Unexpected padding in frame_header");
+static_assert(sizeof(index_entry) == 24, "Unexpected padding in index_entry");
+static_assert(sizeof(index_trailer) == 24, "Unexpected padding in index_trailer");
+
+/*
+ * Returns the number of floating-point values per atom for the given fields
+ * (quantized coordinates and 16-bit velocities and forces are stored separately)
+ */
+inline int atom_values(uint32_t fields)
+{
+    const bool x_values = (fields & field_x) && !(fields & field_x_quantized);
+    const bool half = fields & (field_half_fp16 | field_half_bf16);
+
+    return ((fields & field_mass) ? 1 : 0) + 3 * ((x_values ? 1 : 0) + ((fields & field_v) && !half ? 1 : 0) + ((fields & field_f) && !half ? 1 : 0));
+}
+
+/*
+ * Returns the number of 16-bit values per atom for the given fields
+ */
+inline int atom_half_values(uint32_t fields)
+{
+    if (!(fields & (field_half_fp16 | field_half_bf16)))
+    {
+        return 0;
+    }
+
+    return 3 * (((fields & field_v) ? 1 : 0) + ((fields & field_f) ? 1 : 0));
+}
+
+/*
+ * Returns the size of a single atom record (bytes), including its v⊗v and 16-bit values
+ */
+inline size_t atom_size(uint32_t fields, uint32_t float_width)
+{
+    return (atom_values(fields) + ((fields & field_vv) ? 6 : 0)) * float_width + ((fields & field_index) ? sizeof(int32_t) : 0)
+           + atom_half_values(fields) * sizeof(uint16_t);
+}
+
+/*
+ * Returns the size of the static section (bytes)
+ */
+inline size_t static_size(uint32_t static_fields, int32_t natoms, uint32_t float_width)
+{
+    size_t per_atom = ((static_fields & field_mass) ? float_width : 0) + ((static_fields & field_charge) ? float_width : 0)
+                      + ((static_fields & field_type) ? sizeof(int32_t) : 0) + ((static_fields & field_index) ? sizeof(int32_t) : 0);
+
+    return per_atom * natoms;
+}
+
+/*
+ * Returns a file header for the given fields, number of atoms and body layout
+ */
+inline file_header make_file_header(uint32_t fields, uint32_t static_fields, int32_t natoms, uint32_t float_width, uint32_t body_layout = layout_aos)
+{
+    file_header h{};
+
+    std::memcpy(h.magic, file_magic, sizeof(h.magic));
+    h.version = version;
+    h.float_width = float_width;
+    h.fields = fields;
+    h.natoms = natoms;
+    h.static_fields = static_fields;
+    h.layout = body_layout;
+
+    return h;
+}
+
+} // namespace traj_format
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TRAJ_HALF_X86 1
+#else
+#define TRAJ_HALF_X86 0
+#endif
+
+/*
+ * Conversion between float and 16-bit floating-point values, shared by the writer and the reader.
+ *
+ * On x86 the conversion uses F16C or AVX-512 (fp16) and AVX-512 BF16 (bf16) if the CPU
+ * supports them, detected at run time, so the code needs no special compiler flags;
+ * otherwise it falls back to scalar code with the same results (round to nearest even).
+ * 16-bit values are stored in native byte order.
+ */
+namespace traj_codec
+{
+
+/*
+ * 16-bit floating-point format
+ */
+enum half_format
+{
+    half_fp16, // IEEE 754 half precision: 11-bit mantissa, values up to 65504
+    half_bf16, // bfloat16: 8-bit mantissa, same range as float
+};
+
+/*
+ * Converts a float to fp16, rounding to nearest even; values above 65504 become infinite
+ */
+inline uint16_t float_to_fp16(float value)
+{
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+
+    const uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+
+    uint32_t h;
+
+    if (f >= 0x47800000u)
+    {
+        h = (f > 0x7f800000u) ? 0x7e00u : 0x7c00u; // NaN or infinite
+    }
+    else if (f < 0x38800000u)
+    {
+        // Subnormal or zero: let the FPU round the mantissa
+        const uint32_t magic_bits = 0x3f000000u;
+        float magic, a;
+        std::memcpy(&magic, &magic_bits, sizeof(magic));
+        std::memcpy(&a, &f, sizeof(a));
+
+        a += magic;
+
+        std::memcpy(&h, &a, sizeof(h));
+        h -= magic_bits;
+    }
+    else
+    {
+        const uint32_t odd = (f >> 13) & 1u;
+
+        h = (f + 0xc8000fffu + odd) >> 13; // Rebias the exponent and round the mantissa
+    }
+
+    return static_cast<uint16_t>(h | (sign >> 16));
+}
+
+/*
+ * Converts an fp16 value to float (exact)
+ */
+inline float fp16_to_float(uint16_t h)
+{
+    const uint32_t shifted_exp = 0x7c00u << 13;
+
+    uint32_t f = (h & 0x7fffu) << 13;
+    const uint32_t exp = f & shifted_exp;
+
+    f += (127 - 15) << 23;
+
+    float value;
+
+    if (exp == shifted_exp)
+    {
+        f += (128 - 16) << 23; // NaN or infinite
+
+        if (h & 0x03ffu)
+        {
+            f |= 0x00400000u; // Quiet NaN, as F16C
+        }
+
+        std::memcpy(&value, &f, sizeof(value));
+    }
+    else if (exp == 0)
+    {
+        // Subnormal or zero
+        const uint32_t magic_bits = 113u << 23;
+        float magic;
+        std::memcpy(&magic, &magic_bits, sizeof(magic));
+
+        f += 1u << 23;
+        std::memcpy(&value, &f, sizeof(value));
+        value -= magic;
+    }
+    else
+    {
+        std::memcpy(&value, &f, sizeof(value));
+    }
+
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    bits |= static_cast<uint32_t>(h & 0x8000u) << 16;
+    std::memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+/*
+ * Converts a float to bf16, rounding to nearest even; subnormal floats become zero, as AVX-512 BF16
+ */
+inline uint16_t float_to_bf16(float value)
+{
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+
+    if ((f & 0x7fffffffu) > 0x7f800000u)
+    {
+        return static_cast<uint16_t>((f >> 16) | 0x40u); // Quiet NaN
+    }
+
+    if ((f & 0x7f800000u) == 0)
+    {
+        return static_cast<uint16_t>((f >> 16) & 0x8000u); // Zero or subnormal
+    }
+
+    return static_cast<uint16_t>((f + 0x7fffu + ((f >> 16) & 1u)) >> 16);
+}
+
+/*
+ * Converts a bf16 value to float (exact)
+ */
+inline float bf16_to_float(uint16_t h)
+{
+    const uint32_t f = static_cast<uint32_t>(h) << 16;
+
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+
+    return value;
+}
+
+#if TRAJ_HALF_X86
+
+__attribute__((target("avx,f16c"))) inline void fp16_pack_f16c(const float *in, char *out, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), h);
+    }
+
+    for (; i < n; i++)
+    {
+        const uint16_t h = float_to_fp16(in[i]);
+        std::memcpy(out + 2 * i, &h, sizeof(h));
+    }
+}
+
+__attribute__((target("avx,f16c"))) inline void fp16_unpack_f16c(const char *in, float *out, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i))));
+    }
+
+    for (; i < n; i++)
+    {
+        uint16_t h;
+        std::memcpy(&h, in + 2 * i, sizeof(h));
+        out[i] = fp16_to_float(h);
+    }
+}
+
+__attribute__((target("avx512f"))) inline void fp16_pack_avx512(const float *in, char *out, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256i h = _mm512_maskz_cvtps_ph(0xffff, _mm512_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), h);
+    }
+
+    fp16_pack_f16c(in + i, out + 2 * i, n - i);
+}
+
+__attribute__((target("avx512f"))) inline void fp16_unpack_avx512(const char *in, float *out, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(out + i, _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i))));
+    }
+
+    fp16_unpack_f16c(in + 2 * i, out + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bf16"))) inline void bf16_pack_avx512(const float *in, char *out, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(in + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), reinterpret_cast<const __m256i &>(h));
+    }
+
+    for (; i < n; i++)
+    {
+        const uint16_t h = float_to_bf16(in[i]);
+        std::memcpy(out + 2 * i, &h, sizeof(h));
+    }
+}
+
+__attribute__((target("avx2"))) inline void bf16_unpack_avx2(const char *in, float *out, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256i f = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i))), 16);
+        _mm256_storeu_ps(out + i, _mm256_castsi256_ps(f));
+    }
+
+    for (; i < n; i++)
+    {
+        uint16_t h;
+        std::memcpy(&h, in + 2 * i, sizeof(h));
+        out[i] = bf16_to_float(h);
+    }
+}
+
+/*
+ * SIMD extensions of this CPU used for the conversion
+ */
+struct half_simd
+{
+    bool f16c;
+    bool avx2;
+    bool avx512;
+    bool avx512_bf16;
+};
+
+inline const half_simd &half_simd_support()
+{
+    static const half_simd simd = [] {
+        __builtin_cpu_init();
+
+        half_simd s;
+        s.f16c = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+        s.avx2 = __builtin_cpu_supports("avx2");
+        s.avx512 = s.f16c && __builtin_cpu_supports("avx512f");
+        s.avx512_bf16 = s.avx512 && __builtin_cpu_supports("avx512bf16");
+
+        return s;
+    }();
+
+    return simd;
+}
+
+#endif
+
+/*
+ * Returns the name of the SIMD conversion used for `format` ("scalar" if none)
+ */
+inline const char *half_simd_name(half_format format)
+{
+#if TRAJ_HALF_X86
+    const half_simd &simd = half_simd_support();
+
+    if (format == half_fp16)
+    {
+        return simd.avx512 ? "AVX-512" : (simd.f16c ? "F16C" : "scalar");
+    }
+
+    return simd.avx512_bf16 ? "AVX-512 BF16" : (simd.avx2 ? "AVX2 (unpack only)" : "scalar");
+#else
+    (void)format;
+    return "scalar";
+#endif
+}
+
+/*
+ * Converts `n` floats to 16-bit values at `out` (2 * n bytes, any alignment).
+ * With `simd` false, the scalar code is used (e.g. for comparison).
+ */
+inline void float_to_half(const float *in, char *out, size_t n, half_format format, bool simd = true)
+{
+#if TRAJ_HALF_X86
+    if (simd)
+    {
+        const half_simd &support = half_simd_support();
+
+        if (format == half_fp16 && support.avx512)
+        {
+            fp16_pack_avx512(in, out, n);
+            return;
+        }
+        if (format == half_fp16 && support.f16c)
+        {
+            fp16_pack_f16c(in, out, n);
+            return;
+        }
+        if (format == half_bf16 && support.avx512_bf16)
+        {
+            bf16_pack_avx512(in, out, n);
+            return;
+        }
+    }
+#else
+    (void)simd;
+#endif
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const uint16_t h = (format == half_fp16) ? float_to_fp16(in[i]) : float_to_bf16(in[i]);
+        std::memcpy(out + 2 * i, &h, sizeof(h));
+    }
+}
+
+/*
+ * Converts `n` 16-bit values at `in` (any alignment) to floats.
+ * With `simd` false, the scalar code is used (e.g. for comparison).
+ */
+inline void half_to_float(const char *in, float *out, size_t n, half_format format, bool simd = true)
+{
+#if TRAJ_HALF_X86
+    if (simd)
+    {
+        const half_simd &support = half_simd_support();
+
+        if (format == half_fp16 && support.avx512)
+        {
+            fp16_unpack_avx512(in, out, n);
+            return;
+        }
+        if (format == half_fp16 && support.f16c)
+        {
+            fp16_unpack_f16c(in, out, n);
+            return;
+        }
+        if (format == half_bf16 && support.avx2)
+        {
+            bf16_unpack_avx2(in, out, n);
+            return;
+        }
+    }
+#else
+    (void)simd;
+#endif
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint16_t h;
+        std::memcpy(&h, in + 2 * i, sizeof(h));
+        out[i] = (format == half_fp16) ? fp16_to_float(h) : bf16_to_float(h);
+    }
+}
+
+} // namespace traj_codec
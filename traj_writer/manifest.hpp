@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Append-only manifest of the closed out-files, shared by the writer and the reader.
+ *
+ * The writer appends a line for every out-file once it is closed and renamed, so a consumer can
+ * read the file as soon as its line appears (`traj_reader::manifest_watcher`):
+ *
+ *     <file name> <first step> <last step> <frames> <bytes>
+ *
+ * The file name is the path the writer used, e.g. "traj.000003.out", "traj.000003.rank0001.out" or,
+ * with out-files striped over several directories, "/nvme1/traj.000003.out" (no spaces); relative
+ * paths are relative to the directory of the manifest. Each line is appended with a single write to
+ * the manifest opened with O_APPEND, so the writers of all shards share one manifest without
+ * interleaving their lines (on local file systems; not on NFS). A new simulation removes the manifest;
+ * a restart keeps appending to it. A consumer started before mdrun removes a manifest left by an earlier
+ * run itself, so it does not find the old entries before mdrun removes them.
+ */
+namespace traj_manifest
+{
+
+/*
+ * Closed out-file
+ */
+struct entry
+{
+    std::string file;   // File name
+    int64_t first_step; // Time step of the first frame
+    int64_t last_step;  // Time step of the last frame
+    uint64_t frames;    // Number of frames
+    uint64_t bytes;     // Size of the file (bytes)
+};
+
+/*
+ * Returns the name of the manifest of the out-files `out_file_name` (e.g. "traj" -> "traj.manifest")
+ */
+inline std::string manifest_name(const std::string &out_file_name)
+{
+    return out_file_name + ".manifest";
+}
+
+/*
+ * Returns the file name of `path` without its directory (e.g. "/nvme1/traj.000003.out" -> "traj.000003.out")
+ */
+inline std::string base_name(const std::string &path)
+{
+    return path.substr(path.rfind('/') + 1);
+}
+
+/*
+ * Returns the directory of `path` including the trailing slash, or "" for a name without directory
+ */
+inline std::string directory_name(const std::string &path)
+{
+    const size_t slash = path.rfind('/');
+
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+/*
+ * Returns the line of `e`, including the newline
+ */
+inline std::string format_entry(const entry &e)
+{
+    char numbers[96];
+
+    std::snprintf(numbers, sizeof(numbers), " %" PRId64 " %" PRId64 " %" PRIu64 " %" PRIu64 "\n", e.first_step, e.last_step, e.frames, e.bytes);
+
+    return e.file + numbers;
+}
+
+/*
+ * Parses a line (without the newline) into `e`. Returns false if the line is malformed.
+ */
+inline bool parse_entry(const std::string &line, entry &e)
+{
+    const size_t space = line.find(' ');
+
+    if (space == 0 || space == std::string::npos)
+    {
+        return false;
+    }
+
+    e.file = line.substr(0, space);
+
+    return std::sscanf(line.c_str() + space, " %" SCNd64 " %" SCNd64 " %" SCNu64 " %" SCNu64, &e.first_step, &e.last_step, &e.frames, &e.bytes) == 4;
+}
+
+/*
+ * Finds the last entry of the out-file `file` in the manifest `name`, in whichever directory it was
+ * written (the file names without directory are compared). Returns false if there is none.
+ */
+inline bool find_entry(const std::string &name, const std::string &file, entry &e)
+{
+    std::ifstream in(name);
+
+    std::string line;
+
+    bool found = false;
+
+    while (std::getline(in, line))
+    {
+        entry candidate;
+
+        if (parse_entry(line, candidate) && base_name(candidate.file) == base_name(file))
+        {
+            e = candidate;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Appends the line of `e` to the manifest `name`, creating it if needed. Returns false on error.
+ */
+inline bool append_entry(const std::string &name, const entry &e)
+{
+    const std::string line = format_entry(e);
+
+    const int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    const bool ok = ::write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size());
+
+    return ::close(fd) == 0 && ok;
+}
+
+} // namespace traj_manifest
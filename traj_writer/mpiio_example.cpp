@@ -0,0 +1,186 @@
+#include <iostream>
+#include <vector>
+
+#include "traj_reader/reader.hpp"
+#include "traj_writer/mpiio_writer.hpp"
+#include "traj_writer/selection.hpp"
+
+/*
+ * Example and self-check of the collective MPI-IO writer.
+ *
+ * Every rank owns a shuffled, interleaved subset of the atoms (as with domain
+ * decomposition) and writes it into shared out-files. The first rank then reads
+ * the files back with `traj_reader::read` and checks every value. With `select`,
+ * only every 7th atom is written (as with an index group).
+ *
+ * Usage: mpirun -np 4 ./mpiio-example [soa] [select]
+ */
+
+typedef float real;
+typedef real rvec[3];
+
+const int natoms = 1000;
+const int nframes = 25;
+const int frames_per_file = 10;
+const int force_stride = 3; // Forces are written into every 3rd frame
+const int select_stride = 7; // Atoms written with `select`
+
+/*
+ * Value of the component `d` of atom `n` at frame `i`
+ */
+real value(int i, int n, int d)
+{
+    return 1000.0f * i + n + 0.25f * d;
+}
+
+int main(int argc, char *argv[])
+{
+    MPI_Init(&argc, &argv);
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Home atoms of this rank, in reverse global order
+    std::vector<int> index;
+
+    for (int n = natoms - 1; n >= 0; n--)
+    {
+        if (n % size == rank)
+        {
+            index.push_back(n);
+        }
+    }
+
+    const int nhome = index.size();
+
+    // Frame layout and atom selection
+    traj_writer::format_options options;
+
+    std::vector<int> selected;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (std::string(argv[arg]) == "soa")
+        {
+            options.layout = traj_format::layout_soa;
+        }
+        else if (std::string(argv[arg]) == "select")
+        {
+            for (int n = 0; n < natoms; n += select_stride)
+            {
+                selected.push_back(n);
+            }
+        }
+    }
+
+    traj_writer::atom_selection<real> selection(selected, natoms);
+
+    const int nwritten = selection.all() ? natoms : static_cast<int>(selected.size());
+
+    std::vector<real> x(3 * nhome);
+    std::vector<real> v(3 * nhome);
+    std::vector<real> f(3 * nhome);
+
+    rvec box[3] = {{7, 0, 0}, {0, 7, 0}, {0, 0, 7}};
+
+    bool ok = true;
+
+    {
+        // Masses of all atoms, in global order
+        traj_writer::static_data atoms;
+
+        for (int n = 0; n < natoms; n++)
+        {
+            atoms.mass.push_back(n);
+        }
+
+        traj_writer::mpiio_writer out(MPI_COMM_WORLD, "mpiio", "out", frames_per_file, selection.all() ? atoms : selection.selected_static(atoms), options);
+
+        for (int i = 0; i < nframes && ok; i++)
+        {
+            for (int h = 0; h < nhome; h++)
+            {
+                for (int d = 0; d < 3; d++)
+                {
+                    x[3 * h + d] = value(i, index[h], d);
+                    v[3 * h + d] = -value(i, index[h], d);
+                    f[3 * h + d] = 2 * value(i, index[h], d);
+                }
+            }
+
+            traj_writer::frame_view<real> frame;
+
+            frame.step = i;
+            frame.time = 0.002 * i;
+            frame.box = box;
+            frame.natoms = nhome;
+            frame.natoms_global = natoms;
+            frame.x = reinterpret_cast<const rvec *>(x.data());
+            frame.v = reinterpret_cast<const rvec *>(v.data());
+            frame.f = (i % force_stride == 0) ? reinterpret_cast<const rvec *>(f.data()) : nullptr;
+            frame.index = index.data();
+
+            ok = out.write(selection.all() ? frame : selection.gather(frame));
+        }
+
+        ok = out.close() && ok;
+    }
+
+    // Check the output
+    int errors = ok ? 0 : 1;
+
+    if (rank == 0 && ok)
+    {
+        for (int file = 0; file * frames_per_file < nframes; file++)
+        {
+            std::string fname = "mpiio." + traj_writer::zero_pad(file, 6) + ".out";
+
+            traj_reader::traj trj;
+
+            if (traj_reader::read(fname, trj) != nwritten)
+            {
+                errors++;
+                continue;
+            }
+
+            for (auto &fr : trj)
+            {
+                traj_reader::to_aos(fr);
+
+                // Forces only in every `force_stride`-th frame
+                errors += fr.f.size() != ((fr.step % force_stride == 0) ? static_cast<size_t>(nwritten) : 0);
+
+                for (int n = 0; n < nwritten; n++)
+                {
+                    // Global index of the atom (differs from `n` with `select`)
+                    const int g = traj_reader::global_index(fr, n);
+
+                    errors += g != (selection.all() ? n : select_stride * n);
+                    errors += fr.mass[n] != g;
+                    errors += fr.r[n].x != value(fr.step, g, 0) || fr.r[n].y != value(fr.step, g, 1) || fr.r[n].z != value(fr.step, g, 2);
+                    errors += fr.v[n].x != -value(fr.step, g, 0) || fr.v[n].y != -value(fr.step, g, 1) || fr.v[n].z != -value(fr.step, g, 2);
+
+                    if (!fr.f.empty())
+                    {
+                        errors += fr.f[n].x != 2 * value(fr.step, g, 0) || fr.f[n].z != 2 * value(fr.step, g, 2);
+                    }
+                }
+            }
+
+            std::cout << fname << ": " << trj.size() << " frames\n";
+
+            std::remove(fname.c_str());
+        }
+
+        std::remove(traj_manifest::manifest_name("mpiio").c_str());
+
+        std::cout << (errors ? "FAILED" : "OK") << " (" << size << " ranks)\n";
+    }
+
+    MPI_Bcast(&errors, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    MPI_Finalize();
+
+    return errors ? 1 : 0;
+}
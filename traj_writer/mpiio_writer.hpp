@@ -0,0 +1,359 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <mpi.h>
+
+#include "traj_writer/writer.hpp"
+
+namespace traj_writer
+{
+
+/*
+ * Writes frames into a series of out-files shared by all ranks of `comm`, using collective MPI-IO.
+ *
+ * Every rank places the records of its home atoms at their global-index offsets,
+ * so the file has exactly the same layout as the one written by `writer` from a
+ * single rank and is read by `traj_reader::read`. All calls are collective.
+ *
+ * `atoms` (e.g. masses) are written once into the static section of every out-file;
+ * `options` select the encoding of the frames. Quantized coordinates and compressed
+ * frames have a variable size and cannot be placed at fixed offsets: `options.precision`
+ * and `options.compress` are not supported; neither are `options.half` and `options.keyframe_interval`.
+ */
+class mpiio_writer
+{
+public:
+    mpiio_writer(MPI_Comm comm,
+                 const std::string &file_name,
+                 const std::string &file_name_ext,
+                 int frames_per_file,
+                 static_data atoms = {},
+                 format_options options = {})
+        : comm(comm),
+          out_file_name(file_name),
+          out_file_name_ext(file_name_ext),
+          N_out_frames_per_file(frames_per_file),
+          out_static(std::move(atoms)),
+          out_options(options)
+    {
+        MPI_Comm_rank(comm, &rank);
+    }
+
+    mpiio_writer(const mpiio_writer &) = delete;
+    mpiio_writer &operator=(const mpiio_writer &) = delete;
+
+    /*
+     * Writes the home atoms of this rank into the current frame.
+     * `fr.natoms` is the number of home atoms, `fr.natoms_global` the number of atoms
+     * in the file and `fr.index` the indices of the home atoms in the file (their global
+     * indices, or their positions in an `atom_selection`).
+     * Returns false on error.
+     */
+    template <typename Real>
+    bool write(const frame_view<Real> &fr)
+    {
+        using namespace traj_format;
+
+        // The shared file is in global order, so the global indices are not written
+        frame_view<Real> global = fr;
+        global.natoms = fr.natoms_global;
+        global.index = nullptr;
+
+        const uint32_t fields = global.fields();
+        const int nvalues = atom_values(fields);
+        const int nhome = fr.natoms;
+
+        bool ok = true;
+
+        // Should we create a new file or not
+        bool new_file = !static_cast<bool>(N_out_frame_counter % N_out_frames_per_file);
+
+        if (new_file)
+        {
+            if (!close())
+            {
+                return false;
+            }
+
+            // Full file name (without extension)
+            out_file_name_to_close = out_file_name + "." + zero_pad(N_out_frame_counter / N_out_frames_per_file, 6);
+
+            if (MPI_File_open(comm, out_file_name_to_close.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &out_file) != MPI_SUCCESS)
+            {
+                return false; // Error opening file
+            }
+
+            MPI_File_set_size(out_file, 0);
+
+            is_open = true;
+            out_index.clear();
+
+            // File header and static section: written by the first rank
+            out_header = make_file_header(fields, out_static.fields(), fr.natoms_global, sizeof(float_type), out_options.layout);
+
+            if (out_static_section.empty())
+            {
+                out_static.pack(out_static_section, fr.natoms_global);
+            }
+
+            if (rank == 0)
+            {
+                ok = MPI_File_write_at(out_file, 0, &out_header, sizeof(out_header), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS
+                     && MPI_File_write_at(out_file, sizeof(out_header), out_static_section.data(), out_static_section.size(), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS;
+            }
+
+            frame_offset = sizeof(out_header) + out_static_section.size();
+        }
+
+        out_header.fields |= fields;
+
+        // Reset the file view of the previous frame to plain bytes
+        ok = MPI_File_set_view(out_file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL) == MPI_SUCCESS && ok;
+
+        // Frame header: written by the first rank
+        if (ok && rank == 0)
+        {
+            char header[sizeof(frame_header)];
+
+            pack_frame_header(header, global, fields, frame_size(global.natoms, fields) - sizeof(frame_header));
+
+            ok = MPI_File_write_at(out_file, frame_offset, header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS;
+        }
+
+        // File views must be monotonic: sort home atoms by their global index
+        order.resize(nhome);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&fr](int a, int b) { return fr.index[a] < fr.index[b]; });
+
+        records.resize(static_cast<size_t>(nhome) * nvalues);
+
+        // Values of the home atoms in file order and their positions in the body (in floats)
+        int block_length;
+
+        if (out_options.layout == layout_soa)
+        {
+            // One block of `natoms_global` values per component
+            block_length = 1;
+            displacements.resize(static_cast<size_t>(nhome) * nvalues);
+
+            float_type *rec = records.data();
+            int *disp = displacements.data();
+            int block = 0;
+
+            if (fr.mass)
+            {
+                for (int i = 0; i < nhome; i++)
+                {
+                    *rec++ = static_cast<float_type>(fr.mass[order[i]]);
+                    *disp++ = fr.index[order[i]];
+                }
+
+                block++;
+            }
+
+            for (const Real(*field)[3] : {fr.x, fr.v, fr.f})
+            {
+                for (int d = 0; field && d < 3; d++, block++)
+                {
+                    for (int i = 0; i < nhome; i++)
+                    {
+                        *rec++ = static_cast<float_type>(field[order[i]][d]);
+                        *disp++ = block * fr.natoms_global + fr.index[order[i]];
+                    }
+                }
+            }
+        }
+        else
+        {
+            // One record of `nvalues` values per atom
+            block_length = nvalues;
+            displacements.resize(nhome);
+
+            for (int i = 0; i < nhome; i++)
+            {
+                int n = order[i];
+
+                float_type *rec = records.data() + static_cast<size_t>(nvalues) * i;
+
+                if (fr.mass)
+                {
+                    *rec++ = static_cast<float_type>(fr.mass[n]);
+                }
+
+                for (int d = 0; d < 3; d++)
+                {
+                    if (fr.x)
+                    {
+                        *rec++ = static_cast<float_type>(fr.x[n][d]);
+                    }
+                    if (fr.v)
+                    {
+                        *rec++ = static_cast<float_type>(fr.v[n][d]);
+                    }
+                    if (fr.f)
+                    {
+                        *rec++ = static_cast<float_type>(fr.f[n][d]);
+                    }
+                }
+
+                displacements[i] = fr.index[n] * nvalues;
+            }
+        }
+
+        // Scatter the values to their global positions in a single collective write
+        MPI_Datatype file_type;
+        MPI_Type_create_indexed_block(displacements.size(), block_length, displacements.data(), MPI_FLOAT, &file_type);
+        MPI_Type_commit(&file_type);
+
+        ok = MPI_File_set_view(out_file, frame_offset + sizeof(frame_header), MPI_FLOAT, file_type, "native", MPI_INFO_NULL) == MPI_SUCCESS && ok;
+
+        ok = MPI_File_write_all(out_file, records.data(), records.size(), MPI_FLOAT, MPI_STATUS_IGNORE) == MPI_SUCCESS && ok;
+
+        MPI_Type_free(&file_type);
+
+        if (!ok)
+        {
+            return false; // Error writing the frame
+        }
+
+        out_index.push_back({static_cast<uint64_t>(frame_offset), fr.step, fr.time});
+
+        frame_offset += frame_size(global.natoms, fields);
+
+        if (rank == 0)
+        {
+            written_bytes += frame_size(global.natoms, fields);
+        }
+
+        N_out_frame_counter++;
+
+        return true;
+    }
+
+    /*
+     * Returns the number of frames written into the shared files
+     */
+    uint64_t frames() const
+    {
+        return static_cast<uint64_t>(N_out_frame_counter);
+    }
+
+    /*
+     * Returns the number of bytes of the frames written into the shared files (on the first rank; 0 on the others)
+     */
+    uint64_t bytes() const
+    {
+        return written_bytes;
+    }
+
+    /*
+     * Appends the frame index, closes the current out-file, renames it adding the extension
+     * and lists it in the manifest (see traj_manifest). Returns false on error.
+     */
+    bool close()
+    {
+        using namespace traj_format;
+
+        if (!is_open)
+        {
+            return true;
+        }
+
+        is_open = false;
+
+        int status = MPI_File_set_view(out_file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL) == MPI_SUCCESS ? 0 : 1;
+
+        // Frame index: written by the first rank
+        if (rank == 0 && status == 0)
+        {
+            index_trailer trailer{};
+            trailer.nframes = out_index.size();
+            trailer.offset = frame_offset;
+            std::memcpy(trailer.magic, index_magic, sizeof(trailer.magic));
+
+            int index_bytes = out_index.size() * sizeof(index_entry);
+
+            // The file header records all fields written into the file
+            if (MPI_File_write_at(out_file, frame_offset, out_index.data(), index_bytes, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS
+                || MPI_File_write_at(out_file, frame_offset + index_bytes, &trailer, sizeof(trailer), MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS
+                || MPI_File_write_at(out_file, 0, &out_header, sizeof(out_header), MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+            {
+                status = 1;
+            }
+        }
+
+        if (MPI_File_close(&out_file) != MPI_SUCCESS)
+        {
+            status = 1; // Error flushing the file
+        }
+
+        if (rank == 0 && status == 0)
+        {
+            // Full file name with extension
+            std::string new_file_name = out_file_name_to_close + "." + out_file_name_ext;
+
+            status = std::rename(out_file_name_to_close.c_str(), new_file_name.c_str());
+
+            // The file is ready for the consumer
+            if (status == 0 && !out_index.empty())
+            {
+                const uint64_t file_bytes = frame_offset + out_index.size() * sizeof(index_entry) + sizeof(index_trailer);
+
+                const traj_manifest::entry ready{new_file_name, out_index.front().step, out_index.back().step, out_index.size(), file_bytes};
+
+                status = traj_manifest::append_entry(traj_manifest::manifest_name(out_file_name), ready) ? 0 : 1;
+            }
+        }
+
+        // All ranks report the same result
+        MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+
+        return status == 0;
+    }
+
+private:
+    MPI_Comm comm; // Communicator of the PP ranks
+
+    int rank{0}; // Rank in `comm`
+
+    const std::string out_file_name;     // Output file name without file extension
+    const std::string out_file_name_ext; // Output file extension
+
+    const int N_out_frames_per_file; // Number of frames to write into each out-file
+
+    const static_data out_static; // Static per-atom data
+
+    const format_options out_options; // Encoding of the frames
+
+    std::vector<char> out_static_section; // Packed static section
+
+    int N_out_frame_counter{0}; // Counts written frames
+
+    MPI_File out_file; // Output file
+
+    bool is_open{false}; // Output file is open
+
+    MPI_Offset frame_offset{0}; // Offset of the next frame in the file
+
+    uint64_t written_bytes{0}; // Size of the frames written (first rank)
+
+    traj_format::file_header out_header{}; // Header of the output file, rewritten on close
+
+    std::vector<traj_format::index_entry> out_index; // Frame index of the output file (first rank)
+
+    std::string out_file_name_to_close; // Current output file name (used to add extension)
+
+    std::vector<int> order;          // Home atoms sorted by global index
+    std::vector<int> displacements;  // Positions of `records` in the frame body (floats)
+    std::vector<float_type> records; // Packed values of the home atoms in file order
+};
+
+} // namespace traj_writer
@@ -0,0 +1,716 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "traj_writer/uring.hpp"
+
+namespace traj_writer
+{
+
+/*
+ * Alignment of O_DIRECT writes: file offsets, sizes and buffers (bytes), a page
+ */
+constexpr size_t direct_alignment = 4096;
+
+/*
+ * Size of the writes submitted through io_uring and of each registered buffer (bytes)
+ */
+constexpr size_t uring_chunk_size = 1 << 20;
+
+/*
+ * How the out-files are written
+ */
+struct io_options
+{
+    bool direct{false}; // Preallocate the out-files and write them with O_DIRECT, bypassing the page cache
+
+    bool uring{false}; // Submit the writes through io_uring, several in flight
+
+    int uring_depth{8}; // Number of writes in flight with io_uring
+};
+
+/*
+ * Parses "buffered" or a comma-separated list of "direct" and "uring", e.g. "direct,uring".
+ * Returns false if the list contains an unknown name.
+ */
+inline bool parse_io(const std::string &list, io_options &options)
+{
+    options.direct = false;
+    options.uring = false;
+
+    if (list == "buffered")
+    {
+        return true;
+    }
+
+    size_t begin = 0;
+
+    while (begin <= list.size())
+    {
+        size_t end = list.find(',', begin);
+
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+
+        const std::string name = list.substr(begin, end - begin);
+
+        if (name == "direct")
+        {
+            options.direct = true;
+        }
+        else if (name == "uring")
+        {
+            options.uring = true;
+        }
+        else if (!name.empty())
+        {
+            return false; // Unknown name
+        }
+
+        begin = end + 1;
+    }
+
+    return true;
+}
+
+/*
+ * Writes `size` bytes to the file descriptor, retrying on partial writes.
+ * Returns false on error.
+ */
+inline bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = ::write(fd, data, size);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+/*
+ * Writes `size` bytes at `offset` of the file, retrying on partial writes.
+ * Returns false on error.
+ */
+inline bool pwrite_all(int fd, const char *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += written;
+        offset += static_cast<uint64_t>(written);
+        size -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+/*
+ * Out-file written sequentially by a single thread.
+ *
+ * By default the data is written with buffered writes. With `io_options::direct`, the file is
+ * preallocated with `fallocate` to its expected size and written with O_DIRECT, so the out-files
+ * do not fill the page cache that mdrun and the reader compete for: the data is staged in a
+ * page-aligned buffer, whole pages are written directly and the last partial page waits for the
+ * next `append`. `close` writes the remaining bytes, rewrites the file header and truncates the
+ * file to the bytes written. Where O_DIRECT is not supported (e.g. tmpfs), the file is written
+ * with buffered writes instead.
+ *
+ * With `io_options::uring`, the file is also preallocated and the data is copied into
+ * `uring_depth` registered buffers of `uring_chunk_size` bytes; every full buffer is submitted as
+ * a write at its offset through io_uring (see uring_queue), so up to `uring_depth` writes are in
+ * flight while the next buffer is filled, and `append` only waits for a completion when all
+ * buffers are in flight. With `io_options::direct` these writes use O_DIRECT. The last partial
+ * buffer is written on `close`. Where io_uring is not available, the file is written as without it.
+ *
+ * `sync` makes all bytes appended so far durable, e.g. for a checkpoint; `reopen` continues a file
+ * written before a restart after its first bytes.
+ */
+class output_file
+{
+public:
+    output_file() = default;
+
+    ~output_file()
+    {
+        // The kernel may still read the buffers of writes in flight
+        while (in_flight > 0)
+        {
+            reap();
+        }
+
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+
+        std::free(stage);
+        std::free(chunks);
+    }
+
+    output_file(const output_file &) = delete;
+    output_file &operator=(const output_file &) = delete;
+
+    /*
+     * Creates the file `name`; with `options.direct`, preallocates `expected_size` bytes and
+     * writes with O_DIRECT if supported. Returns false on error.
+     */
+    bool open(const std::string &name, uint64_t expected_size, const io_options &options)
+    {
+        direct = false;
+        preallocated = false;
+        written = 0;
+        staged = 0;
+
+        uring = options.uring && (chunks || init_uring(options.uring_depth));
+        failed = false;
+        submitted = 0;
+        current = -1;
+        fill = 0;
+
+        if (options.direct)
+        {
+            fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+            direct = fd >= 0;
+        }
+
+        opened_direct = direct;
+
+        if (fd < 0)
+        {
+            fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+
+        if (fd < 0)
+        {
+            return false; // Error opening file
+        }
+
+        // Contiguous extents; without support (EOPNOTSUPP) the file grows with the writes
+        if ((options.direct || uring) && expected_size > 0)
+        {
+            preallocated = ::fallocate(fd, 0, 0, static_cast<off_t>(expected_size)) == 0;
+        }
+
+        return true;
+    }
+
+    /*
+     * Opens the existing file `name` to append after its first `size` bytes and drops the rest
+     * (e.g. a partial frame written before a crash), with the same options as `open`.
+     * Returns false on error.
+     */
+    bool reopen(const std::string &name, uint64_t size, uint64_t expected_size, const io_options &options)
+    {
+        direct = false;
+        preallocated = false;
+        written = size;
+        staged = 0;
+
+        uring = options.uring && (chunks || init_uring(options.uring_depth));
+        failed = false;
+        current = -1;
+        fill = 0;
+
+        fd = ::open(name.c_str(), O_RDWR);
+
+        if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            return false; // Error opening or truncating file
+        }
+
+        // Writes with O_DIRECT or through io_uring start at the page holding the end of the data
+        const uint64_t tail = (options.direct || uring) ? size % direct_alignment : 0;
+
+        submitted = size - tail;
+
+        if (tail > 0)
+        {
+            if (uring ? !next_chunk() : !reserve(tail))
+            {
+                return false;
+            }
+
+            char *page = uring ? chunks + current * uring_chunk_size : stage;
+
+            if (::pread(fd, page, tail, static_cast<off_t>(submitted)) != static_cast<ssize_t>(tail))
+            {
+                return false; // Error reading the last partial page
+            }
+
+            if (uring)
+            {
+                fill = tail;
+            }
+            else
+            {
+                staged = tail;
+            }
+        }
+
+        if (::lseek(fd, static_cast<off_t>(uring ? size : submitted), SEEK_SET) < 0)
+        {
+            return false;
+        }
+
+        if (options.direct)
+        {
+            const int flags = ::fcntl(fd, F_GETFL);
+
+            direct = flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+        }
+
+        opened_direct = direct;
+
+        // The partial page is written with the next whole page, or buffered on `close`
+        if (options.direct && !direct && staged > 0)
+        {
+            staged = 0;
+
+            if (::lseek(fd, static_cast<off_t>(size), SEEK_SET) < 0)
+            {
+                return false;
+            }
+        }
+
+        if ((options.direct || uring) && expected_size > size)
+        {
+            preallocated = ::fallocate(fd, 0, 0, static_cast<off_t>(expected_size)) == 0;
+        }
+
+        return true;
+    }
+
+    /*
+     * Appends `size` bytes to the file. Returns false on error.
+     */
+    bool append(const char *data, size_t size)
+    {
+        if (uring)
+        {
+            return append_queued(data, size);
+        }
+
+        if (!direct)
+        {
+            written += size;
+            return write_all(fd, data, size);
+        }
+
+        if (!reserve(staged + size))
+        {
+            return false;
+        }
+
+        std::memcpy(stage + staged, data, size);
+
+        staged += size;
+        written += size;
+
+        // Whole pages directly, the partial page stays in the buffer
+        const size_t pages = staged / direct_alignment * direct_alignment;
+
+        if (pages == 0)
+        {
+            return true;
+        }
+
+        if (!write_all(fd, stage, pages))
+        {
+            if (errno != EINVAL || !buffered())
+            {
+                return false;
+            }
+
+            // O_DIRECT rejected by the file system: everything staged with buffered writes
+            const bool ok = write_all(fd, stage, staged);
+            staged = 0;
+
+            return ok;
+        }
+
+        std::memmove(stage, stage + pages, staged - pages);
+        staged -= pages;
+
+        return true;
+    }
+
+    /*
+     * Writes the remaining bytes, rewrites `header_size` bytes of the file header at the beginning
+     * of the file, truncates the preallocated file to the bytes written and closes it.
+     * Returns false on error.
+     */
+    bool close(const void *header, size_t header_size)
+    {
+        if (fd < 0)
+        {
+            return true;
+        }
+
+        // The last partial page cannot be written with O_DIRECT
+        bool ok = uring ? finish_queued() : (!direct || (buffered() && write_all(fd, stage, staged)));
+
+        staged = 0;
+
+        ok = ok && ::pwrite(fd, header, header_size, 0) == static_cast<ssize_t>(header_size);
+
+        if (preallocated)
+        {
+            ok = ok && ::ftruncate(fd, static_cast<off_t>(written)) == 0;
+        }
+
+        int status = ::close(fd);
+        fd = -1;
+
+        return ok && status == 0;
+    }
+
+    /*
+     * Writes all bytes appended so far into the file, including the partial page or buffer kept for
+     * the next `append`, and flushes them to the disk. Returns false on error.
+     */
+    bool sync()
+    {
+        if (fd < 0)
+        {
+            return true;
+        }
+
+        bool ok = true;
+
+        if (uring)
+        {
+            while (in_flight > 0)
+            {
+                reap();
+            }
+
+            // The buffer is submitted again once it is full
+            ok = !failed && (current < 0 || pwrite_buffered(chunks + current * uring_chunk_size, fill, submitted));
+        }
+        else if (direct)
+        {
+            // The staged page is written again with O_DIRECT once it is full
+            ok = pwrite_buffered(stage, staged, written - staged);
+        }
+
+        return ok && ::fdatasync(fd) == 0;
+    }
+
+    /*
+     * Returns true if the file is written with O_DIRECT
+     */
+    bool is_direct() const
+    {
+        return direct;
+    }
+
+    /*
+     * Returns true if the file is written through io_uring
+     */
+    bool is_uring() const
+    {
+        return uring;
+    }
+
+    /*
+     * Returns true if the io_uring writes use registered buffers
+     */
+    bool fixed_buffers() const
+    {
+        return uring && queue.fixed_buffers();
+    }
+
+    /*
+     * Returns the number of bytes appended to the file
+     */
+    uint64_t size() const
+    {
+        return written;
+    }
+
+private:
+    int fd{-1}; // File descriptor
+
+    bool direct{false};        // Written with O_DIRECT
+    bool opened_direct{false}; // Opened with O_DIRECT (writes in flight may still use it)
+    bool preallocated{false};  // Preallocated with fallocate, truncated on close
+
+    uint64_t written{0}; // Bytes appended
+
+    char *stage{nullptr}; // Page-aligned staging buffer (O_DIRECT)
+    size_t staged{0};     // Bytes in the staging buffer, not yet written
+    size_t capacity{0};   // Size of the staging buffer
+
+    bool uring{false}; // Written through io_uring
+
+    uring_queue queue; // Submission and completion queue (io_uring)
+
+    char *chunks{nullptr}; // Registered buffers of uring_chunk_size bytes each, page-aligned
+
+    std::vector<int> free_chunks;       // Buffers not in flight
+    std::vector<uint64_t> chunk_offset; // File offset of the write of each buffer in flight
+
+    int current{-1}; // Buffer being filled, -1 if none
+    size_t fill{0};  // Bytes in the current buffer
+
+    int in_flight{0}; // Number of writes in flight
+
+    uint64_t submitted{0}; // Bytes submitted (offset of the current buffer)
+
+    bool failed{false}; // A write in flight failed
+
+    /*
+     * Grows the staging buffer to at least `size` bytes, preserving its content
+     */
+    bool reserve(size_t size)
+    {
+        if (size <= capacity)
+        {
+            return true;
+        }
+
+        const size_t new_capacity = (size + direct_alignment - 1) / direct_alignment * direct_alignment;
+
+        char *new_stage = static_cast<char *>(std::aligned_alloc(direct_alignment, new_capacity));
+
+        if (new_stage == nullptr)
+        {
+            return false;
+        }
+
+        if (staged > 0)
+        {
+            std::memcpy(new_stage, stage, staged);
+        }
+
+        std::free(stage);
+
+        stage = new_stage;
+        capacity = new_capacity;
+
+        return true;
+    }
+
+    /*
+     * Creates the io_uring queue and registers `depth` buffers. Returns false if io_uring is not available.
+     */
+    bool init_uring(int depth)
+    {
+        depth = depth > 0 ? depth : 1;
+
+        if (!queue.init(depth))
+        {
+            return false;
+        }
+
+        chunks = static_cast<char *>(std::aligned_alloc(direct_alignment, depth * uring_chunk_size));
+
+        if (chunks == nullptr)
+        {
+            return false;
+        }
+
+        std::vector<iovec> buffers(depth);
+
+        for (int c = 0; c < depth; c++)
+        {
+            buffers[c].iov_base = chunks + c * uring_chunk_size;
+            buffers[c].iov_len = uring_chunk_size;
+
+            free_chunks.push_back(c);
+        }
+
+        chunk_offset.assign(depth, 0);
+
+        // Without registered buffers (e.g. RLIMIT_MEMLOCK), the same buffers are written with IORING_OP_WRITE
+        queue.register_buffers(buffers.data(), depth);
+
+        return true;
+    }
+
+    /*
+     * Copies the data into the buffers and submits every full buffer
+     */
+    bool append_queued(const char *data, size_t size)
+    {
+        written += size;
+
+        while (size > 0)
+        {
+            if (current < 0 && !next_chunk())
+            {
+                return false;
+            }
+
+            const size_t n = size < uring_chunk_size - fill ? size : uring_chunk_size - fill;
+
+            std::memcpy(chunks + current * uring_chunk_size + fill, data, n);
+
+            fill += n;
+            data += n;
+            size -= n;
+
+            if (fill == uring_chunk_size)
+            {
+                if (!queue.write(fd, chunks + current * uring_chunk_size, fill, submitted, current, current))
+                {
+                    return false;
+                }
+
+                chunk_offset[current] = submitted;
+                submitted += fill;
+                in_flight++;
+
+                current = -1;
+                fill = 0;
+            }
+        }
+
+        return !failed;
+    }
+
+    /*
+     * Takes a free buffer, waiting for a write to complete if all buffers are in flight
+     */
+    bool next_chunk()
+    {
+        if (free_chunks.empty() && !reap())
+        {
+            return false;
+        }
+
+        current = free_chunks.back();
+        free_chunks.pop_back();
+
+        return true;
+    }
+
+    /*
+     * Waits for a write to complete and frees its buffer. Short writes and writes rejected by
+     * O_DIRECT (EINVAL) are completed with buffered writes. Returns false on error.
+     */
+    bool reap()
+    {
+        uint64_t chunk = 0;
+        int result = 0;
+
+        if (!queue.wait(chunk, result))
+        {
+            in_flight = 0; // The queue is unusable
+            failed = true;
+
+            return false;
+        }
+
+        in_flight--;
+        free_chunks.push_back(static_cast<int>(chunk));
+
+        const char *data = chunks + chunk * uring_chunk_size;
+
+        if (result == -EINVAL && opened_direct && (!direct || buffered()))
+        {
+            result = 0;
+        }
+
+        if (result < 0 || (static_cast<size_t>(result) < uring_chunk_size
+                           && !pwrite_all(fd, data + result, uring_chunk_size - result, chunk_offset[chunk] + result)))
+        {
+            failed = true;
+        }
+
+        return !failed;
+    }
+
+    /*
+     * Waits for all writes in flight and writes the last partial buffer
+     */
+    bool finish_queued()
+    {
+        while (in_flight > 0)
+        {
+            reap();
+        }
+
+        bool ok = !failed;
+
+        if (current >= 0)
+        {
+            // Not a whole number of pages: without O_DIRECT
+            ok = ok && (!direct || buffered()) && pwrite_all(fd, chunks + current * uring_chunk_size, fill, submitted);
+
+            free_chunks.push_back(current);
+
+            current = -1;
+            fill = 0;
+        }
+
+        return ok;
+    }
+
+    /*
+     * Writes `size` bytes at `offset` of the file without O_DIRECT, which the file keeps for the next writes
+     */
+    bool pwrite_buffered(const char *data, size_t size, uint64_t offset)
+    {
+        const int flags = ::fcntl(fd, F_GETFL);
+
+        if (flags < 0 || ((flags & O_DIRECT) && ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0))
+        {
+            return false;
+        }
+
+        const bool ok = pwrite_all(fd, data, size, offset);
+
+        return ((flags & O_DIRECT) == 0 || ::fcntl(fd, F_SETFL, flags) == 0) && ok;
+    }
+
+    /*
+     * Switches the file to buffered writes
+     */
+    bool buffered()
+    {
+        direct = false;
+
+        const int flags = ::fcntl(fd, F_GETFL);
+
+        return flags >= 0 && ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+    }
+};
+
+} // namespace traj_writer
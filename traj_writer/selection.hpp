@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "traj_writer/writer.hpp"
+
+namespace traj_writer
+{
+
+/*
+ * Reads the atoms of `group` from a GROMACS index file (.ndx) as 0-based global indices,
+ * or of the first group if `group` is empty.
+ * Returns false if the file cannot be read or has no such group.
+ */
+inline bool read_ndx_group(const std::string &file_name, const std::string &group, std::vector<int> &atoms)
+{
+    std::ifstream in(file_name);
+
+    if (!in)
+    {
+        return false;
+    }
+
+    atoms.clear();
+
+    bool found = false;
+    bool in_group = false;
+
+    std::string line;
+
+    while (std::getline(in, line))
+    {
+        const size_t open = line.find('[');
+
+        // Group header: "[ name ]"
+        if (open != std::string::npos)
+        {
+            const size_t close = line.find(']', open);
+
+            std::istringstream name(line.substr(open + 1, close == std::string::npos ? std::string::npos : close - open - 1));
+            std::string word;
+            name >> word;
+
+            if (found)
+            {
+                break; // End of the group
+            }
+
+            in_group = group.empty() || word == group;
+            found = in_group;
+
+            continue;
+        }
+
+        if (!in_group)
+        {
+            continue;
+        }
+
+        std::istringstream numbers(line);
+        int atom;
+
+        while (numbers >> atom)
+        {
+            atoms.push_back(atom - 1); // 1-based in the file
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Selection of atoms by residue and atom names, e.g. "TRP,ASN,@CA" or "!SOL,!NA,!CL".
+ *
+ * Comma-separated names: "NAME" matches a residue name, "@NAME" an atom name;
+ * a leading "!" excludes the matching atoms. An atom is selected if it matches
+ * any name without "!" (or there are none) and no name with "!".
+ */
+struct name_selection
+{
+    std::vector<std::string> residues;          // Selected residue names
+    std::vector<std::string> atoms;             // Selected atom names
+    std::vector<std::string> excluded_residues; // Excluded residue names
+    std::vector<std::string> excluded_atoms;    // Excluded atom names
+
+    /*
+     * Parses the selection. Returns false if it is empty or contains an empty name.
+     */
+    bool parse(const std::string &list)
+    {
+        *this = {};
+
+        size_t begin = 0;
+
+        while (begin <= list.size())
+        {
+            size_t end = list.find(',', begin);
+
+            if (end == std::string::npos)
+            {
+                end = list.size();
+            }
+
+            std::string name = list.substr(begin, end - begin);
+
+            const bool exclude = !name.empty() && name[0] == '!';
+            const bool atom = name.size() > (exclude ? 1u : 0u) && name[exclude ? 1 : 0] == '@';
+
+            name.erase(0, (exclude ? 1 : 0) + (atom ? 1 : 0));
+
+            if (name.empty())
+            {
+                return false; // Empty name
+            }
+
+            (exclude ? (atom ? excluded_atoms : excluded_residues) : (atom ? atoms : residues)).push_back(name);
+
+            begin = end + 1;
+        }
+
+        return true;
+    }
+
+    /*
+     * Returns true if the atom `atom_name` of residue `residue_name` is selected
+     */
+    bool matches(const std::string &residue_name, const std::string &atom_name) const
+    {
+        auto contains = [](const std::vector<std::string> &names, const std::string &name) {
+            return std::find(names.begin(), names.end(), name) != names.end();
+        };
+
+        if (contains(excluded_residues, residue_name) || contains(excluded_atoms, atom_name))
+        {
+            return false;
+        }
+
+        return (residues.empty() && atoms.empty()) || contains(residues, residue_name) || contains(atoms, atom_name);
+    }
+};
+
+/*
+ * Subset of atoms written into the out-files (e.g. an index group), resolved once at startup.
+ *
+ * `gather` copies the selected atoms of a frame into contiguous arrays in selection
+ * order. The out-files then contain only these atoms; their global indices are written
+ * once into the static section (`static_data::index`, see `selected_static`). With domain
+ * decomposition, the home atoms of a shard are gathered with their positions in the
+ * selection as per-frame indices, so the shards merge into frames of the selection.
+ */
+template <typename Real>
+class atom_selection
+{
+public:
+    /*
+     * Selects all atoms
+     */
+    atom_selection() = default;
+
+    /*
+     * Selects `atoms` (global indices in [0, natoms)) of a system of `natoms` atoms
+     */
+    atom_selection(std::vector<int> atoms, int natoms)
+        : group(std::move(atoms)), position(natoms, -1)
+    {
+        std::sort(group.begin(), group.end());
+        group.erase(std::unique(group.begin(), group.end()), group.end());
+
+        for (size_t i = 0; i < group.size(); i++)
+        {
+            position[group[i]] = static_cast<int>(i);
+        }
+    }
+
+    /*
+     * Returns true if all atoms are selected
+     */
+    bool all() const
+    {
+        return group.empty();
+    }
+
+    /*
+     * Returns the global indices of the selected atoms in ascending order
+     */
+    const std::vector<int> &atoms() const
+    {
+        return group;
+    }
+
+    /*
+     * Returns the static data of the selected atoms and their global indices,
+     * given the static data of all atoms
+     */
+    static_data selected_static(const static_data &system) const
+    {
+        static_data out;
+
+        for (int g : group)
+        {
+            if (!system.mass.empty())
+            {
+                out.mass.push_back(system.mass[g]);
+            }
+            if (!system.charge.empty())
+            {
+                out.charge.push_back(system.charge[g]);
+            }
+            if (!system.type.empty())
+            {
+                out.type.push_back(system.type[g]);
+            }
+        }
+
+        out.index.assign(group.begin(), group.end());
+
+        return out;
+    }
+
+    /*
+     * Returns a view of the selected atoms of `fr`, copied into the buffers of the selection
+     * (valid until the next call). `fr.index`, if set, are the global indices of the atoms of `fr`.
+     */
+    frame_view<Real> gather(const frame_view<Real> &fr)
+    {
+        // Atoms of `fr` to copy
+        rows.clear();
+        index.clear();
+
+        if (fr.index)
+        {
+            for (int n = 0; n < fr.natoms; n++)
+            {
+                const int p = position[fr.index[n]];
+
+                if (p >= 0)
+                {
+                    rows.push_back(n);
+                    index.push_back(p);
+                }
+            }
+        }
+        else
+        {
+            rows.assign(group.begin(), group.end());
+        }
+
+        const size_t count = rows.size();
+
+        frame_view<Real> out = fr;
+
+        out.natoms = static_cast<int>(count);
+        out.natoms_global = static_cast<int>(group.size());
+        out.index = fr.index ? index.data() : nullptr;
+
+        if (fr.mass)
+        {
+            mass.resize(count);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                mass[i] = fr.mass[rows[i]];
+            }
+
+            out.mass = mass.data();
+        }
+
+        auto copy = [this, count](const Real(*in)[3], std::vector<Real> &buf) -> const Real(*)[3] {
+            if (!in)
+            {
+                return nullptr;
+            }
+
+            buf.resize(3 * count);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                buf[3 * i + 0] = in[rows[i]][0];
+                buf[3 * i + 1] = in[rows[i]][1];
+                buf[3 * i + 2] = in[rows[i]][2];
+            }
+
+            return reinterpret_cast<const Real(*)[3]>(buf.data());
+        };
+
+        out.x = copy(fr.x, x);
+        out.v = copy(fr.v, v);
+        out.f = copy(fr.f, f);
+
+        return out;
+    }
+
+private:
+    std::vector<int> group;    // Global indices of the selected atoms, sorted
+    std::vector<int> position; // Position of each atom of the system in `group`, or -1
+
+    std::vector<int> rows;  // Atoms of the current frame that are copied
+    std::vector<int> index; // Positions of the copied atoms in `group` (domain decomposition)
+
+    std::vector<Real> mass;    // Masses of the selected atoms
+    std::vector<Real> x, v, f; // Coordinates, velocities and forces of the selected atoms
+};
+
+} // namespace traj_writer
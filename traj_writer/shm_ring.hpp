@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "traj_writer/format.hpp"
+
+/*
+ * Ring of frames in POSIX shared memory between a single producer (mdrun) and up to
+ * `max_consumers` consumers on the same node, shared by the writer and the reader.
+ *
+ * Segment: ring_header, static image, slots
+ * Static:  file_header and static section, as at the beginning of an out-file
+ * Slot:    slot_header, frame (frame_header and body, as in an out-file), padded to `slot_size`
+ *
+ * Frame n (counted from 0) is stored in slot n % nslots. The producer writes the frame into
+ * the slot, stores n + 1 into `slot_header::sequence` and then `published` = n + 1 (release).
+ * A consumer reads frame n in place once `published` > n and releases it by storing n + 1 into
+ * its `consumer_header::position`. The producer overwrites a slot only after every consumer has
+ * released the frame in it (back-pressure): it waits or, with `drop_frames`, skips the frame.
+ * Consumers that exit without releasing their entry are detected by their process id.
+ *
+ * A consumer attaches with the oldest frame in the ring, which the producer may be about to
+ * overwrite. The producer therefore sets the `sequence` of the slot to 0 before it checks the
+ * positions and restores it if it cannot overwrite the slot; the consumer stores its position
+ * before it checks the `sequence`, so either side sees the other (sequentially consistent).
+ *
+ * Both sides wait on futexes (`frames_futex`, `space_futex`), which are incremented on every
+ * change, so a waiting consumer is woken as soon as a frame is published. The counters are
+ * lock-free atomics, which work across processes.
+ */
+namespace traj_shm
+{
+
+constexpr char ring_magic[8] = {'M', 'D', 'F', 'H', 'S', 'H', 'M', '\0'};
+
+constexpr uint32_t version = 1;
+
+/*
+ * Maximum number of consumers attached at the same time
+ */
+constexpr int max_consumers = 16;
+
+/*
+ * Alignment of the counters and slots (bytes), a cache line
+ */
+constexpr size_t alignment = 64;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "Shared-memory counters must be lock-free");
+
+/*
+ * Entry of an attached consumer
+ */
+struct alignas(alignment) consumer_header
+{
+    std::atomic<int32_t> pid;       // Process id of the consumer, 0 if the entry is free
+    std::atomic<uint64_t> position; // Next frame to read; all earlier frames are released
+};
+
+/*
+ * Header of the segment, at its beginning
+ */
+struct ring_header
+{
+    char magic[8];         // `ring_magic`
+    uint32_t version;      // Version of the ring layout
+    uint32_t nslots;       // Number of slots
+    uint64_t slot_size;    // Size of a slot including its slot_header (bytes)
+    uint64_t static_size;  // Size of the static image (bytes)
+    uint64_t slots_offset; // Offset of the first slot from the beginning of the segment
+    int32_t producer_pid;  // Process id of the producer
+    uint32_t drop_frames;  // Frames are skipped instead of waiting for slow consumers
+
+    alignas(alignment) std::atomic<uint64_t> published; // Number of published frames
+    std::atomic<uint64_t> dropped;                      // Number of frames skipped (drop_frames)
+    std::atomic<uint32_t> ready;                        // Set once the static image is written
+    std::atomic<uint32_t> closed;                       // Set after the last frame
+
+    alignas(alignment) std::atomic<uint32_t> frames_futex; // Incremented on every published frame and on close
+    std::atomic<uint32_t> frames_waiters;                  // Number of consumers waiting for a frame
+
+    alignas(alignment) std::atomic<uint32_t> space_futex; // Incremented on every released frame
+    std::atomic<uint32_t> space_waiters;                  // Producer waiting for a free slot
+
+    consumer_header consumers[max_consumers];
+};
+
+/*
+ * Header of a slot
+ */
+struct alignas(alignment) slot_header
+{
+    std::atomic<uint64_t> sequence; // Number of the frame in the slot + 1, 0 if empty
+    uint64_t size;                  // Size of the frame (bytes)
+};
+
+/*
+ * Returns `size` rounded up to the alignment
+ */
+inline uint64_t aligned_size(uint64_t size)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Returns the POSIX shared-memory name of the ring `name` (e.g. "traj" -> "/traj")
+ */
+inline std::string segment_name(const std::string &name)
+{
+    return (!name.empty() && name[0] == '/') ? name : "/" + name;
+}
+
+/*
+ * Waits until `word` is no longer `value`, for at most `timeout_ms` milliseconds.
+ * May return early (e.g. on a signal); callers check their condition again.
+ */
+inline void futex_wait(std::atomic<uint32_t> &word, uint32_t value, int timeout_ms)
+{
+    timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+/*
+ * Wakes all processes waiting on `word`
+ */
+inline void futex_wake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/*
+ * Increments `word` and wakes the processes waiting on it, if any
+ */
+inline void notify(std::atomic<uint32_t> &word, const std::atomic<uint32_t> &waiters)
+{
+    word.fetch_add(1, std::memory_order_seq_cst);
+
+    if (waiters.load(std::memory_order_seq_cst) > 0)
+    {
+        futex_wake(word);
+    }
+}
+
+/*
+ * Returns false if the process `pid` has exited (including zombies not yet reaped by their parent)
+ */
+inline bool process_alive(int32_t pid)
+{
+    if (::kill(pid, 0) != 0 && errno != EPERM)
+    {
+        return false;
+    }
+
+    // State of the process: the field after the command name in parentheses
+    char state = 0;
+
+    if (FILE *stat = std::fopen(("/proc/" + std::to_string(pid) + "/stat").c_str(), "r"))
+    {
+        if (std::fscanf(stat, "%*d (%*[^)]) %c", &state) != 1)
+        {
+            state = 0;
+        }
+
+        std::fclose(stat);
+    }
+
+    return state != 'Z' && state != 'X';
+}
+
+} // namespace traj_shm
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "traj_writer/shm_ring.hpp"
+#include "traj_writer/writer.hpp"
+
+namespace traj_writer
+{
+
+/*
+ * Publishes frames into a ring in POSIX shared memory (see traj_shm), read by
+ * `traj_reader::shm_reader` in other processes on the same node without any file.
+ *
+ * The segment is created on the first frame, with `nslots` slots large enough for frames of
+ * `fields` (all fields that may be written) of all atoms; frames are packed directly into the
+ * slots by `write`, on the calling thread. If all slots hold frames that a consumer has not read
+ * yet, `write` waits for it or, with `drop_frames`, skips the frame. `close` marks the end of
+ * the frames and removes the name of the segment; attached consumers can still read the frames
+ * left in the ring.
+ *
+ * `atoms` (e.g. masses) are published once in the static image of the segment; `options` select
+ * the encoding of the frames. Compressed and delta frames depend on the writer thread and on
+ * previous frames: `options.compress` and `options.keyframe_interval` are not supported.
+ */
+class shm_writer
+{
+public:
+    shm_writer(const std::string &name, int nslots, uint32_t fields, static_data atoms = {}, format_options options = {}, bool drop_frames = false)
+        : shm_name(traj_shm::segment_name(name)),
+          N_slots(nslots > 1 ? nslots : 2),
+          max_fields(fields),
+          out_static(std::move(atoms)),
+          out_options(options),
+          drop(drop_frames)
+    {
+    }
+
+    ~shm_writer()
+    {
+        close();
+    }
+
+    shm_writer(const shm_writer &) = delete;
+    shm_writer &operator=(const shm_writer &) = delete;
+
+    /*
+     * Packs the frame into the next slot and publishes it.
+     * Returns false if the segment cannot be created or the frame does not fit into a slot.
+     */
+    template <typename Real>
+    bool write(const frame_view<Real> &fr)
+    {
+        using namespace traj_shm;
+
+        if (!ring && !create(fr.natoms_global))
+        {
+            return false;
+        }
+
+        const size_t size = max_frame_size(fr.natoms, fr.fields(), out_options);
+
+        if (sizeof(slot_header) + size > ring->slot_size)
+        {
+            return false; // Fields or atoms not covered by the slot size
+        }
+
+        const uint64_t sequence = published;
+
+        if (!wait_for_slot(sequence))
+        {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        slot_header *slot = slot_at(sequence);
+
+        slot->size = pack_frame(reinterpret_cast<char *>(slot) + sizeof(slot_header), fr, out_options);
+        published_bytes += slot->size;
+        slot->sequence.store(sequence + 1, std::memory_order_release);
+
+        published = sequence + 1;
+        ring->published.store(published, std::memory_order_release);
+
+        notify(ring->frames_futex, ring->frames_waiters);
+
+        return true;
+    }
+
+    /*
+     * Returns the number of frames skipped because a consumer was too slow (`drop_frames`)
+     */
+    uint64_t dropped() const
+    {
+        return ring ? ring->dropped.load(std::memory_order_relaxed) : 0;
+    }
+
+    /*
+     * Returns the time `write` waited for slow consumers (seconds)
+     */
+    double blocked() const
+    {
+        return blocked_seconds;
+    }
+
+    /*
+     * Returns the number of published frames
+     */
+    uint64_t frames() const
+    {
+        return published;
+    }
+
+    /*
+     * Returns the number of bytes of the published frames
+     */
+    uint64_t bytes() const
+    {
+        return published_bytes;
+    }
+
+    /*
+     * Marks the end of the frames, wakes the consumers and removes the name of the segment.
+     * Returns false on error.
+     */
+    bool close()
+    {
+        if (!ring)
+        {
+            return true;
+        }
+
+        ring->closed.store(1, std::memory_order_release);
+
+        traj_shm::notify(ring->frames_futex, ring->frames_waiters);
+
+        const bool ok = ::shm_unlink(shm_name.c_str()) == 0;
+
+        ::munmap(ring, segment_size);
+        ring = nullptr;
+
+        return ok;
+    }
+
+private:
+    const std::string shm_name; // POSIX name of the segment
+
+    const int N_slots; // Number of slots
+
+    const uint32_t max_fields; // Fields that may be written, for the slot size
+
+    const static_data out_static; // Static per-atom data
+
+    const format_options out_options; // Encoding of the frames
+
+    const bool drop; // Skip frames instead of waiting for slow consumers
+
+    traj_shm::ring_header *ring{nullptr}; // Mapped segment
+
+    size_t segment_size{0}; // Size of the mapped segment (bytes)
+
+    uint64_t published{0}; // Number of published frames
+
+    uint64_t published_bytes{0}; // Size of the published frames (bytes)
+
+    double blocked_seconds{0.0}; // Time waited for slow consumers (seconds)
+
+    /*
+     * Returns the slot of frame `sequence`
+     */
+    traj_shm::slot_header *slot_at(uint64_t sequence) const
+    {
+        char *base = reinterpret_cast<char *>(ring) + ring->slots_offset;
+
+        return reinterpret_cast<traj_shm::slot_header *>(base + (sequence % ring->nslots) * ring->slot_size);
+    }
+
+    /*
+     * Waits until every consumer has released the frame in the slot of frame `sequence`.
+     * Returns false if the frame should be skipped instead (`drop_frames`).
+     */
+    bool wait_for_slot(uint64_t sequence)
+    {
+        using namespace traj_shm;
+
+        if (sequence < ring->nslots)
+        {
+            return true;
+        }
+
+        const uint64_t oldest = sequence - ring->nslots; // Frame in the slot
+
+        slot_header *slot = slot_at(sequence);
+
+        while (true)
+        {
+            const uint32_t ticket = ring->space_futex.load(std::memory_order_seq_cst);
+
+            // Invalidated before the positions are checked: a consumer attaching meanwhile
+            // either finds the slot invalid or has its position checked below
+            slot->sequence.store(0, std::memory_order_seq_cst);
+
+            bool full = false;
+
+            for (consumer_header &c : ring->consumers)
+            {
+                const int32_t pid = c.pid.load(std::memory_order_seq_cst);
+
+                if (pid == 0 || c.position.load(std::memory_order_seq_cst) > oldest)
+                {
+                    continue;
+                }
+
+                // Consumers that exited without detaching free their entry
+                if (!process_alive(pid))
+                {
+                    int32_t expected = pid;
+                    c.pid.compare_exchange_strong(expected, 0);
+                    continue;
+                }
+
+                full = true;
+            }
+
+            if (!full)
+            {
+                return true;
+            }
+
+            // The frame in the slot is still read
+            slot->sequence.store(oldest + 1, std::memory_order_seq_cst);
+
+            if (drop)
+            {
+                return false;
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+
+            ring->space_waiters.fetch_add(1, std::memory_order_seq_cst);
+            futex_wait(ring->space_futex, ticket, 100);
+            ring->space_waiters.fetch_sub(1, std::memory_order_seq_cst);
+
+            blocked_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    /*
+     * Creates the segment for frames of `natoms` atoms and publishes the static image
+     */
+    bool create(int natoms)
+    {
+        using namespace traj_shm;
+
+        std::vector<char> static_section;
+        out_static.pack(static_section, natoms);
+
+        const traj_format::file_header header = traj_format::make_file_header(max_fields, out_static.fields(), natoms, sizeof(float_type), out_options.layout);
+
+        const uint64_t static_size = sizeof(header) + static_section.size();
+        const uint64_t slots_offset = aligned_size(sizeof(ring_header) + static_size);
+        const uint64_t slot_size = aligned_size(sizeof(slot_header) + max_frame_size(natoms, max_fields, out_options));
+
+        segment_size = slots_offset + N_slots * slot_size;
+
+        // A segment left by an earlier run is replaced; its consumers keep their mapping
+        ::shm_unlink(shm_name.c_str());
+
+        const int fd = ::shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+        if (fd < 0)
+        {
+            return false; // Error creating the segment
+        }
+
+        void *addr = MAP_FAILED;
+
+        if (::ftruncate(fd, segment_size) == 0)
+        {
+            addr = ::mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        ::close(fd);
+
+        if (addr == MAP_FAILED)
+        {
+            ::shm_unlink(shm_name.c_str());
+            return false; // Error sizing or mapping the segment
+        }
+
+        // The memory is zero-filled: all slots are empty and no consumer is attached
+        ring = new (addr) ring_header();
+
+        std::memcpy(ring->magic, ring_magic, sizeof(ring->magic));
+        ring->version = traj_shm::version;
+        ring->nslots = N_slots;
+        ring->slot_size = slot_size;
+        ring->static_size = static_size;
+        ring->slots_offset = slots_offset;
+        ring->producer_pid = ::getpid();
+        ring->drop_frames = drop ? 1 : 0;
+
+        char *image = reinterpret_cast<char *>(ring) + sizeof(ring_header);
+
+        std::memcpy(image, &header, sizeof(header));
+        std::memcpy(image + sizeof(header), static_section.data(), static_section.size());
+
+        // Consumers attach once the segment is ready
+        ring->ready.store(1, std::memory_order_release);
+
+        return true;
+    }
+};
+
+} // namespace traj_writer
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(SYS_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define TRAJ_WRITER_HAVE_URING 1
+#else
+#define TRAJ_WRITER_HAVE_URING 0
+#endif
+
+namespace traj_writer
+{
+
+/*
+ * Minimal io_uring submission and completion queue for file writes, using the raw system calls
+ * (no liburing). Used by a single thread: `write` queues and submits a write, `wait` reaps a
+ * completion, blocking until one is available.
+ *
+ * Buffers registered with `register_buffers` are written with IORING_OP_WRITE_FIXED (the kernel
+ * maps them once instead of on every write); other buffers with IORING_OP_WRITE.
+ * `init` returns false where io_uring is not available (old kernels, disabled by
+ * /proc/sys/kernel/io_uring_disabled or a seccomp filter, e.g. in containers).
+ */
+class uring_queue
+{
+public:
+    uring_queue() = default;
+
+    ~uring_queue()
+    {
+        close();
+    }
+
+    uring_queue(const uring_queue &) = delete;
+    uring_queue &operator=(const uring_queue &) = delete;
+
+    /*
+     * Creates the queue with room for `entries` writes in flight. Returns false on error.
+     */
+    bool init(unsigned entries)
+    {
+#if TRAJ_WRITER_HAVE_URING
+        close();
+
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        ring_fd = static_cast<int>(::syscall(SYS_io_uring_setup, entries, &params));
+
+        if (ring_fd < 0)
+        {
+            return false;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        // Both rings in a single mapping (Linux 5.4+)
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (single_mmap)
+        {
+            sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+        }
+
+        sq_ring = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring
+                              : ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(
+                ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+
+        char *sq = static_cast<char *>(sq_ring);
+        char *cq = static_cast<char *>(cq_ring);
+
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        return true;
+#else
+        (void)entries;
+        return false;
+#endif
+    }
+
+    /*
+     * Registers `n` buffers for IORING_OP_WRITE_FIXED. Returns false on error (e.g. RLIMIT_MEMLOCK
+     * on kernels before 5.12); the buffers are then written with IORING_OP_WRITE.
+     */
+    bool register_buffers(const iovec *buffers, unsigned n)
+    {
+#if TRAJ_WRITER_HAVE_URING
+        registered = ring_fd >= 0 && ::syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers, n) == 0;
+#else
+        (void)buffers;
+        (void)n;
+#endif
+        return registered;
+    }
+
+    /*
+     * Submits a write of `size` bytes at `offset` of the file `fd` from `data`, which is part of
+     * registered buffer `buffer` (or any memory without registered buffers). The completion is
+     * returned by `wait` with `user_data`. Returns false on error.
+     */
+    bool write(int fd, const char *data, unsigned size, uint64_t offset, unsigned buffer, uint64_t user_data)
+    {
+#if TRAJ_WRITER_HAVE_URING
+        // Single submitter: the tail is only written by this thread
+        const unsigned tail = *sq_tail;
+        const unsigned index = tail & sq_mask;
+
+        io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+
+        sqe->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = size;
+        sqe->buf_index = registered ? buffer : 0;
+        sqe->user_data = user_data;
+
+        sq_array[index] = index;
+
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        while (true)
+        {
+            const long submitted = ::syscall(SYS_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+
+            if (submitted >= 0 || errno != EINTR)
+            {
+                return submitted == 1;
+            }
+        }
+#else
+        (void)fd;
+        (void)data;
+        (void)size;
+        (void)offset;
+        (void)buffer;
+        (void)user_data;
+        return false;
+#endif
+    }
+
+    /*
+     * Waits for the next completion and returns its `user_data` and result (bytes written, or
+     * -errno). Returns false on error.
+     */
+    bool wait(uint64_t &user_data, int &result)
+    {
+#if TRAJ_WRITER_HAVE_URING
+        while (true)
+        {
+            const unsigned head = *cq_head;
+
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                const io_uring_cqe &cqe = cqes[head & cq_mask];
+
+                user_data = cqe.user_data;
+                result = cqe.res;
+
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+                return true;
+            }
+
+            if (::syscall(SYS_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+            {
+                return false;
+            }
+        }
+#else
+        (void)user_data;
+        (void)result;
+        return false;
+#endif
+    }
+
+    /*
+     * Returns true if the buffers are registered
+     */
+    bool fixed_buffers() const
+    {
+        return registered;
+    }
+
+private:
+    int ring_fd{-1}; // io_uring instance
+
+    bool registered{false}; // Buffers registered
+
+    void *sq_ring{MAP_FAILED}; // Submission queue ring
+    void *cq_ring{MAP_FAILED}; // Completion queue ring (same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP)
+
+    size_t sq_size{0};   // Size of the mapping of the submission queue ring
+    size_t cq_size{0};   // Size of the mapping of the completion queue ring
+    size_t sqes_size{0}; // Size of the mapping of the submission queue entries
+
+#if TRAJ_WRITER_HAVE_URING
+    io_uring_sqe *sqes{static_cast<io_uring_sqe *>(MAP_FAILED)}; // Submission queue entries
+    io_uring_cqe *cqes{nullptr};                                 // Completion queue entries
+#endif
+
+    unsigned *sq_tail{nullptr};  // Tail of the submission queue (written by this thread)
+    unsigned *sq_array{nullptr}; // Indices of the submitted entries
+    unsigned sq_mask{0};         // Index mask of the submission queue
+
+    unsigned *cq_head{nullptr}; // Head of the completion queue (written by this thread)
+    unsigned *cq_tail{nullptr}; // Tail of the completion queue (written by the kernel)
+    unsigned cq_mask{0};        // Index mask of the completion queue
+
+    /*
+     * Unmaps the rings and closes the instance (completions still in flight are discarded)
+     */
+    void close()
+    {
+#if TRAJ_WRITER_HAVE_URING
+        if (sqes != MAP_FAILED)
+        {
+            ::munmap(sqes, sqes_size);
+            sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+        }
+#endif
+
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        {
+            ::munmap(cq_ring, cq_size);
+        }
+
+        if (sq_ring != MAP_FAILED)
+        {
+            ::munmap(sq_ring, sq_size);
+        }
+
+        sq_ring = cq_ring = MAP_FAILED;
+
+        if (ring_fd >= 0)
+        {
+            ::close(ring_fd);
+            ring_fd = -1;
+        }
+
+        registered = false;
+    }
+};
+
+} // namespace traj_writer
@@ -0,0 +1,1972 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "traj_writer/codec.hpp"
+#include "traj_writer/format.hpp"
+#include "traj_writer/half.hpp"
+#include "traj_writer/manifest.hpp"
+#include "traj_writer/output_file.hpp"
+
+namespace traj_writer
+{
+
+/*
+ * Base type - single precision
+ */
+typedef float float_type;
+
+/*
+ * Alignment of frame buffers (bytes)
+ */
+constexpr size_t buffer_alignment = 64;
+
+/*
+ * Pointers to the data of a single frame in the MD engine.
+ * Fields with a null pointer are not written.
+ */
+template <typename Real>
+struct frame_view
+{
+    int64_t step{0}; // Current time step
+
+    double time{0.0}; // Current time
+
+    const Real (*box)[3]{nullptr}; // Box vectors
+
+    int natoms{0};        // Number of atoms in the frame
+    int natoms_global{0}; // Number of atoms in the out-file: the system, or the atom selection
+
+    const Real *mass{nullptr};     // Atom masses
+    const Real (*x)[3]{nullptr};   // Coordinates
+    const Real (*v)[3]{nullptr};   // Velocities
+    const Real (*f)[3]{nullptr};   // Forces
+    const Real (*vv)[6]{nullptr};  // Averages of v⊗v: xx yy zz xy xz yz (averaged frames only)
+    const int *index{nullptr};     // Atom indices in the out-file (shard writers only)
+
+    bool average{false}; // Coordinates and velocities are averages (see `block_average`)
+
+    /*
+     * Returns the bitmask of fields to write
+     */
+    uint32_t fields() const
+    {
+        return (mass ? traj_format::field_mass : 0u) | (x ? traj_format::field_x : 0u) | (v ? traj_format::field_v : 0u)
+               | (f ? traj_format::field_f : 0u) | (vv ? traj_format::field_vv : 0u) | (index ? traj_format::field_index : 0u)
+               | (average ? traj_format::field_average : 0u);
+    }
+};
+
+/*
+ * Per-atom data that does not change during the run, in the atom order of the out-files.
+ * Written once into the static section of each out-file; empty fields are not written.
+ */
+struct static_data
+{
+    std::vector<float_type> mass;   // Atom masses
+    std::vector<float_type> charge; // Atom charges
+    std::vector<int32_t> type;      // Atom types
+    std::vector<int32_t> index;     // Global atom indices (atom selections only)
+
+    /*
+     * Returns the bitmask of fields to write
+     */
+    uint32_t fields() const
+    {
+        return (mass.empty() ? 0u : traj_format::field_mass) | (charge.empty() ? 0u : traj_format::field_charge)
+               | (type.empty() ? 0u : traj_format::field_type) | (index.empty() ? 0u : traj_format::field_index);
+    }
+
+    /*
+     * Packs the static section into `out` for `natoms` atoms
+     */
+    void pack(std::vector<char> &out, int natoms) const
+    {
+        out.resize(traj_format::static_size(fields(), natoms, sizeof(float_type)));
+
+        char *p = out.data();
+
+        if (!mass.empty())
+        {
+            std::memcpy(p, mass.data(), natoms * sizeof(float_type));
+            p += natoms * sizeof(float_type);
+        }
+        if (!charge.empty())
+        {
+            std::memcpy(p, charge.data(), natoms * sizeof(float_type));
+            p += natoms * sizeof(float_type);
+        }
+        if (!type.empty())
+        {
+            std::memcpy(p, type.data(), natoms * sizeof(int32_t));
+            p += natoms * sizeof(int32_t);
+        }
+        if (!index.empty())
+        {
+            std::memcpy(p, index.data(), natoms * sizeof(int32_t));
+        }
+    }
+};
+
+/*
+ * Encoding of the out-files
+ */
+struct format_options
+{
+    traj_format::layout layout{traj_format::layout_aos}; // Layout of the frame body
+
+    double precision{0.0}; // Precision of quantized coordinates (nm), 0 for full precision
+
+    uint32_t half{0}; // field_half_fp16 or field_half_bf16 to store velocities and forces as 16-bit values, 0 for float
+
+    bool compress{false}; // Compress the frame bodies losslessly (on the writer thread)
+
+    int keyframe_interval{0}; // Store every n-th frame in full and XOR deltas in between (compressed); 0 or 1 for none
+
+    uint32_t chunk_size{traj_codec::default_chunk_size}; // Size of independently compressed chunks (bytes)
+
+    int threads{1}; // OpenMP threads packing a frame (e.g. those of mdrun); the packed frame is the same for any number
+};
+
+/*
+ * Parses a comma-separated list of field names ("mass", "x", "v", "f", "vv"), e.g. "x,v,f",
+ * or "none" for no fields. Returns false if the list contains an unknown name.
+ */
+inline bool parse_fields(const std::string &list, uint32_t &fields)
+{
+    fields = 0;
+
+    if (list == "none")
+    {
+        return true;
+    }
+
+    size_t begin = 0;
+
+    while (begin <= list.size())
+    {
+        size_t end = list.find(',', begin);
+
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+
+        const std::string name = list.substr(begin, end - begin);
+
+        if (name == "mass")
+        {
+            fields |= traj_format::field_mass;
+        }
+        else if (name == "x")
+        {
+            fields |= traj_format::field_x;
+        }
+        else if (name == "v")
+        {
+            fields |= traj_format::field_v;
+        }
+        else if (name == "f")
+        {
+            fields |= traj_format::field_f;
+        }
+        else if (name == "vv")
+        {
+            fields |= traj_format::field_vv;
+        }
+        else if (!name.empty())
+        {
+            return false; // Unknown field
+        }
+
+        begin = end + 1;
+    }
+
+    return true;
+}
+
+/*
+ * Returns the size of a packed frame (bytes)
+ */
+inline size_t frame_size(int natoms, uint32_t fields)
+{
+    return sizeof(traj_format::frame_header) + static_cast<size_t>(natoms) * traj_format::atom_size(fields, sizeof(float_type));
+}
+
+/*
+ * Returns the largest size of a frame packed with `options` (bytes)
+ */
+inline size_t max_frame_size(int natoms, uint32_t fields, const format_options &options)
+{
+    if (options.precision > 0.0 && (fields & traj_format::field_x))
+    {
+        return frame_size(natoms, fields | traj_format::field_x_quantized) + traj_codec::max_quantized_size(natoms);
+    }
+
+    return frame_size(natoms, fields);
+}
+
+/*
+ * Returns `num` as a string with leading zeros
+ */
+inline std::string zero_pad(int num, int width)
+{
+    std::string num_str = std::to_string(num);
+
+    if (static_cast<int>(num_str.length()) < width)
+    {
+        num_str = std::string(width - num_str.length(), '0') + num_str;
+    }
+
+    return num_str;
+}
+
+/*
+ * Growable byte buffer with aligned storage, reused between frames
+ */
+class aligned_buffer
+{
+public:
+    aligned_buffer() = default;
+
+    ~aligned_buffer()
+    {
+        std::free(ptr);
+    }
+
+    aligned_buffer(aligned_buffer &&other) noexcept
+        : ptr(other.ptr), len(other.len), cap(other.cap)
+    {
+        other.ptr = nullptr;
+        other.len = other.cap = 0;
+    }
+
+    aligned_buffer(const aligned_buffer &) = delete;
+    aligned_buffer &operator=(const aligned_buffer &) = delete;
+
+    /*
+     * Sets the size of the buffer; the content is not preserved if the buffer grows
+     */
+    void resize(size_t size)
+    {
+        if (size > cap)
+        {
+            size_t new_cap = (size + buffer_alignment - 1) / buffer_alignment * buffer_alignment;
+
+            std::free(ptr);
+            ptr = static_cast<char *>(std::aligned_alloc(buffer_alignment, new_cap));
+
+            if (ptr == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+
+            cap = new_cap;
+        }
+
+        len = size;
+    }
+
+    char *data() noexcept
+    {
+        return ptr;
+    }
+
+    const char *data() const noexcept
+    {
+        return ptr;
+    }
+
+    size_t size() const noexcept
+    {
+        return len;
+    }
+
+    void swap(aligned_buffer &other) noexcept
+    {
+        std::swap(ptr, other.ptr);
+        std::swap(len, other.len);
+        std::swap(cap, other.cap);
+    }
+
+private:
+    char *ptr{nullptr};
+    size_t len{0};
+    size_t cap{0};
+};
+
+/*
+ * Packs the frame header into `out`, which must hold `sizeof(traj_format::frame_header)` bytes
+ */
+template <typename Real>
+void pack_frame_header(char *out, const frame_view<Real> &fr, uint32_t fields, uint64_t body_size)
+{
+    traj_format::frame_header h{};
+
+    h.step = fr.step;
+    h.time = fr.time;
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            h.box[i][d] = fr.box[i][d];
+        }
+    }
+
+    h.natoms = fr.natoms;
+    h.fields = fields;
+    h.size = body_size;
+
+    std::memcpy(out, &h, sizeof(h));
+}
+
+/*
+ * Packs the atoms [begin, end) of the body of the frame in the structure-of-arrays layout:
+ * each component of all atoms is a contiguous block
+ */
+template <typename Real>
+void pack_body_soa(char *body, const frame_view<Real> &fr, size_t begin, size_t end)
+{
+    const size_t natoms = fr.natoms;
+
+    if (fr.index)
+    {
+        std::memcpy(body + begin * sizeof(int32_t), fr.index + begin, (end - begin) * sizeof(int32_t));
+        body += natoms * sizeof(int32_t);
+    }
+
+    float_type *__restrict dst = reinterpret_cast<float_type *>(body);
+
+    if (fr.mass)
+    {
+        for (size_t n = begin; n < end; n++)
+        {
+            dst[n] = static_cast<float_type>(fr.mass[n]);
+        }
+
+        dst += natoms;
+    }
+
+    for (const Real(*field)[3] : {fr.x, fr.v, fr.f})
+    {
+        if (field == nullptr)
+        {
+            continue;
+        }
+
+        const Real *__restrict src = field[0];
+
+        for (int d = 0; d < 3; d++)
+        {
+            for (size_t n = begin; n < end; n++)
+            {
+                dst[n] = static_cast<float_type>(src[3 * n + d]);
+            }
+
+            dst += natoms;
+        }
+    }
+}
+
+/*
+ * Packs the atoms [begin, end) of the body of the frame in the array-of-structures layout:
+ * all values of an atom together
+ */
+template <typename Real>
+void pack_body_aos(char *body, const frame_view<Real> &fr, size_t begin, size_t end)
+{
+    using namespace traj_format;
+
+    const uint32_t fields = fr.fields();
+
+    // Only one of x, v, f (e.g. velocities next to quantized coordinates)
+    const Real(*single)[3] = (fields == field_x) ? fr.x : (fields == field_v) ? fr.v : (fields == field_f) ? fr.f : nullptr;
+
+    if (single)
+    {
+        float_type *__restrict dst = reinterpret_cast<float_type *>(body);
+        const Real *__restrict src = single[0];
+
+        for (size_t i = 3 * begin; i < 3 * end; i++)
+        {
+            dst[i] = static_cast<float_type>(src[i]);
+        }
+    }
+    else if (fields == (field_x | field_v))
+    {
+        // Default frame: a single pass over contiguous inputs, which the compiler vectorizes
+        float_type *__restrict dst = reinterpret_cast<float_type *>(body);
+        const Real *__restrict xs = fr.x[0];
+        const Real *__restrict vs = fr.v[0];
+
+        for (size_t n = begin; n < end; n++)
+        {
+            float_type *__restrict rec = dst + 6 * n;
+
+            rec[0] = static_cast<float_type>(xs[3 * n + 0]);
+            rec[1] = static_cast<float_type>(vs[3 * n + 0]);
+            rec[2] = static_cast<float_type>(xs[3 * n + 1]);
+            rec[3] = static_cast<float_type>(vs[3 * n + 1]);
+            rec[4] = static_cast<float_type>(xs[3 * n + 2]);
+            rec[5] = static_cast<float_type>(vs[3 * n + 2]);
+        }
+    }
+    else
+    {
+        // Any other combination of fields
+        const int nvalues = atom_values(fields);
+
+        char *rec = body + begin * ((fr.index ? sizeof(int32_t) : 0) + nvalues * sizeof(float_type));
+
+        for (size_t n = begin; n < end; n++)
+        {
+            if (fr.index)
+            {
+                std::memcpy(rec, &fr.index[n], sizeof(int32_t));
+                rec += sizeof(int32_t);
+            }
+
+            float_type values[10];
+            int k = 0;
+
+            if (fr.mass)
+            {
+                values[k++] = static_cast<float_type>(fr.mass[n]);
+            }
+
+            for (int d = 0; d < 3; d++)
+            {
+                if (fr.x)
+                {
+                    values[k++] = static_cast<float_type>(fr.x[n][d]);
+                }
+                if (fr.v)
+                {
+                    values[k++] = static_cast<float_type>(fr.v[n][d]);
+                }
+                if (fr.f)
+                {
+                    values[k++] = static_cast<float_type>(fr.f[n][d]);
+                }
+            }
+
+            std::memcpy(rec, values, nvalues * sizeof(float_type));
+            rec += nvalues * sizeof(float_type);
+        }
+    }
+}
+
+/*
+ * Converts `n` values of `in`, `stride` values apart, to 16-bit values at `out`
+ */
+template <typename Real>
+void pack_half_values(char *out, const Real *in, size_t stride, size_t n, traj_codec::half_format format)
+{
+    if (std::is_same<Real, float>::value && stride == 1)
+    {
+        traj_codec::float_to_half(reinterpret_cast<const float *>(in), out, n, format);
+        return;
+    }
+
+    // Gathered through a small buffer, converted with SIMD
+    constexpr size_t block = 256;
+    float values[block];
+
+    for (size_t i = 0; i < n; i += block)
+    {
+        const size_t count = (n - i < block) ? n - i : block;
+
+        for (size_t j = 0; j < count; j++)
+        {
+            values[j] = static_cast<float>(in[(i + j) * stride]);
+        }
+
+        traj_codec::float_to_half(values, out + 2 * i, count, format);
+    }
+}
+
+/*
+ * Packs the velocities and forces of the atoms [begin, end) of the frame as 16-bit values into `out`
+ * (see traj_format) and returns the position after the values of all atoms
+ */
+template <typename Real>
+char *pack_half(char *out, const frame_view<Real> &fr, uint32_t half, traj_format::layout layout, size_t begin, size_t end)
+{
+    const traj_codec::half_format format = (half == traj_format::field_half_bf16) ? traj_codec::half_bf16 : traj_codec::half_fp16;
+    const size_t natoms = fr.natoms;
+
+    for (const Real(*field)[3] : {fr.v, fr.f})
+    {
+        if (!field)
+        {
+            continue;
+        }
+
+        if (layout == traj_format::layout_soa)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                pack_half_values(out + begin * sizeof(uint16_t), &field[begin][d], 3, end - begin, format);
+                out += natoms * sizeof(uint16_t);
+            }
+        }
+        else
+        {
+            pack_half_values(out + 3 * begin * sizeof(uint16_t), &field[begin][0], 1, 3 * (end - begin), format);
+            out += 3 * natoms * sizeof(uint16_t);
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Packs the averages of v⊗v of the atoms [begin, end) of the frame into `out` (see traj_format)
+ */
+template <typename Real>
+void pack_vv(char *out, const frame_view<Real> &fr, size_t begin, size_t end)
+{
+    float_type *__restrict dst = reinterpret_cast<float_type *>(out);
+    const Real *__restrict src = fr.vv[0];
+
+    for (size_t i = 6 * begin; i < 6 * end; i++)
+    {
+        dst[i] = static_cast<float_type>(src[i]);
+    }
+}
+
+/*
+ * Coordinates copied by `pack_frame` and quantized later into the packed frame
+ * (e.g. on the writer thread, to keep the encoding out of the MD step)
+ */
+struct deferred_positions
+{
+    traj_codec::quantized_header q{}; // Range and number of bits
+
+    std::vector<float_type> x; // Copy of the coordinates
+
+    size_t offset{0}; // Offset of the quantized block in the packed frame
+
+    bool pending{false}; // Set by `pack_frame`, cleared by `encode`
+
+    /*
+     * Writes the quantized block into the packed frame `out`
+     */
+    void encode(char *out)
+    {
+        traj_codec::quantize_positions(out + offset, reinterpret_cast<const float_type(*)[3]>(x.data()), static_cast<int>(x.size() / 3), q);
+        pending = false;
+    }
+};
+
+/*
+ * Packs the entire frame into `out`, which must hold `max_frame_size(fr.natoms, fr.fields(), options)` bytes.
+ * If `deferred` is given, quantized coordinates are only copied into it and the space for them is
+ * left in `out` until `deferred->encode(out)` is called.
+ * Large frames are packed by up to `options.threads` OpenMP threads, each converting a range of
+ * atoms into its place in the frame, so the frame is the same as with one thread.
+ * Returns the number of bytes written.
+ */
+template <typename Real>
+size_t pack_frame(char *out, const frame_view<Real> &fr, const format_options &options = {}, deferred_positions *deferred = nullptr)
+{
+    using namespace traj_format;
+
+    uint32_t fields = fr.fields();
+    const int natoms = fr.natoms;
+
+    const int nthreads = traj_codec::atom_threads(natoms, options.threads);
+
+    // Coordinates are quantized unless they do not fit the precision; then they are written in full
+    frame_view<Real> values = fr;
+    traj_codec::quantized_header q;
+
+    bool quantize = false;
+
+    if (fr.x && options.precision > 0.0 && deferred)
+    {
+        // The range is taken from the copy that is encoded later
+        deferred->x.resize(3 * static_cast<size_t>(natoms));
+
+#pragma omp parallel num_threads(nthreads) if (nthreads > 1)
+        {
+            size_t from;
+            size_t to;
+
+            traj_codec::atom_range(natoms, from, to);
+
+            std::copy(fr.x[0] + 3 * from, fr.x[0] + 3 * to, deferred->x.begin() + 3 * from);
+        }
+
+        quantize = traj_codec::quantize_range(reinterpret_cast<const float_type(*)[3]>(deferred->x.data()), natoms, options.precision, q, nthreads);
+    }
+    else if (fr.x && options.precision > 0.0)
+    {
+        quantize = traj_codec::quantize_range(fr.x, natoms, options.precision, q, nthreads);
+    }
+
+    if (quantize)
+    {
+        fields |= field_x_quantized;
+        values.x = nullptr;
+    }
+
+    // Velocities and forces as 16-bit values after the other values
+    const uint32_t half = (fr.v || fr.f) ? options.half : 0;
+
+    if (half)
+    {
+        fields |= half;
+        values.v = nullptr;
+        values.f = nullptr;
+    }
+
+    // v⊗v after the other values; the body packers only see the per-atom vectors
+    values.vv = nullptr;
+    values.average = false;
+
+    char *body = out + sizeof(frame_header);
+    char *end = body + static_cast<size_t>(natoms) * atom_size(fields, sizeof(float_type));
+
+    char *half_values = end - static_cast<size_t>(natoms) * atom_half_values(fields) * sizeof(uint16_t);
+
+#pragma omp parallel num_threads(nthreads) if (nthreads > 1)
+    {
+        // Atoms [from, to) of this thread
+        size_t from;
+        size_t to;
+
+        traj_codec::atom_range(natoms, from, to);
+
+        if (options.layout == layout_soa)
+        {
+            pack_body_soa(body, values, from, to);
+        }
+        else
+        {
+            pack_body_aos(body, values, from, to);
+        }
+
+        if (fr.vv)
+        {
+            pack_vv(half_values - 6 * static_cast<size_t>(natoms) * sizeof(float_type), fr, from, to);
+        }
+
+        if (half)
+        {
+            pack_half(half_values, fr, half, options.layout, from, to);
+        }
+    }
+
+    if (quantize && deferred)
+    {
+        deferred->q = q;
+        deferred->offset = end - out;
+        deferred->pending = true;
+
+        end += traj_codec::quantized_size(natoms, q.bits);
+    }
+    else if (quantize)
+    {
+        end += traj_codec::quantize_positions(end, fr.x, natoms, q, nthreads);
+    }
+
+    // Header
+    pack_frame_header(out, fr, fields, end - body);
+
+    return end - out;
+}
+
+/*
+ * Compresses the body of the packed frame `in` into `out` (see traj_codec::compress)
+ * and marks it with `field_compressed` in the frame header.
+ * `scratch` is resized as needed and can be reused between calls.
+ */
+inline void compress_frame(const aligned_buffer &in, aligned_buffer &out, std::vector<char> &scratch, uint32_t chunk_size)
+{
+    using namespace traj_format;
+
+    const size_t body_size = in.size() - sizeof(frame_header);
+
+    out.resize(sizeof(frame_header) + traj_codec::max_compressed_size(body_size, chunk_size));
+
+    const size_t size = traj_codec::compress(in.data() + sizeof(frame_header), body_size, out.data() + sizeof(frame_header), scratch, chunk_size);
+
+    frame_header h;
+    std::memcpy(&h, in.data(), sizeof(h));
+
+    h.fields |= field_compressed;
+    h.size = size;
+
+    std::memcpy(out.data(), &h, sizeof(h));
+    out.resize(sizeof(h) + size);
+}
+
+/*
+ * Turns the packed frame `data` into a delta frame: XORs its body with the body of `reference`,
+ * the previous frame with the same fields and size, and replaces `reference` with the frame
+ */
+inline void delta_encode(aligned_buffer &data, aligned_buffer &reference)
+{
+    using namespace traj_format;
+
+    char *__restrict body = data.data() + sizeof(frame_header);
+    char *__restrict previous = reference.data() + sizeof(frame_header);
+
+    const size_t body_size = data.size() - sizeof(frame_header);
+
+    std::memcpy(reference.data(), data.data(), sizeof(frame_header));
+
+    for (size_t i = 0; i < body_size; i++)
+    {
+        const char value = body[i];
+
+        body[i] = static_cast<char>(value ^ previous[i]);
+        previous[i] = value;
+    }
+
+    frame_header h;
+    std::memcpy(&h, data.data(), sizeof(h));
+
+    h.fields |= field_delta;
+
+    std::memcpy(data.data(), &h, sizeof(h));
+}
+
+/*
+ * Limits on the out-files written but not yet processed by their consumer (e.g. `water_pure/driver.sh`).
+ *
+ * The consumer acknowledges the out-files it has processed by writing their number into `ack_file`,
+ * e.g. "3" once `traj.000000.out` to `traj.000002.out` are processed (and deleted); the file should be
+ * replaced atomically (written under another name and renamed).
+ */
+struct budget_options
+{
+    int max_files{0}; // Maximum number of unprocessed out-files, including the one being written; 0 for no limit
+
+    uint64_t max_bytes{0}; // Maximum size of the unprocessed out-files (bytes); 0 for no limit
+
+    int reduced_stride{0}; // Write only every n-th frame while more than half of the budget is used; 0 for all frames
+
+    std::string ack_file; // Number of processed out-files, written by the consumer (default: `<file_name>.ack`)
+};
+
+/*
+ * When the writer starts a new out-file besides `frames_per_file`, whichever limit is reached first.
+ *
+ * The size counts the frames as the consumer holds them in memory: all atoms of the out-file
+ * (`natoms_global`, all shards together) before compression, so the shards of an out-file hold the
+ * same frames. An out-file holds at least one frame.
+ */
+struct rotation_options
+{
+    uint64_t max_bytes{0}; // Maximum size of the frames of an out-file (bytes); 0 for no limit
+
+    double max_seconds{0.0}; // Maximum wall time between the first and the last frame of an out-file (seconds); 0 for no limit
+};
+
+/*
+ * Directories the out-files are spread over, e.g. on different drives, so their bandwidth adds up.
+ *
+ * Out-file n goes into directory n % ndirectories (with shards, (n + shard) % ndirectories, so the
+ * shards of an out-file are spread as well) or, with `free_space`, into the directory with the most
+ * free space when the file is started. The manifest records where each out-file is; the budget
+ * acknowledgement, the restart state and the manifest stay next to `file_name`.
+ */
+struct stripe_options
+{
+    std::vector<std::string> directories; // Output directories; empty for the directory of `file_name`
+
+    bool free_space{false}; // Choose the directory with the most free space instead of round-robin
+};
+
+constexpr char restart_magic[8] = {'M', 'D', 'F', 'H', 'R', 'S', 'T', '\0'};
+
+/*
+ * State of the out-file sequence at a checkpoint, stored by `writer::checkpoint` in a state file next
+ * to the out-files. Record: restart_record, sizes of the closed out-files (`nfiles` x uint64_t) and
+ * frame index of the open out-file (`nindex` x index_entry); the file holds the records of the last
+ * two checkpoints, or of the last checkpoint and the end of the run.
+ */
+struct restart_record
+{
+    char magic[8];                   // `restart_magic`
+    int64_t step;                    // Step of the checkpoint; the frames of all earlier steps are written
+    uint64_t frames;                 // Number of frames written
+    uint64_t offset;                 // Size of the open out-file up to its last frame (bytes)
+    traj_format::file_header header; // Header of the open out-file
+    uint32_t nfiles;                 // Number of closed out-files
+    uint32_t nindex;                 // Number of frames in the open out-file
+    uint32_t closed;                 // Stored by `writer::close`: the last out-file is closed, `step` follows the last frame
+    uint32_t directory;              // Stripe directory of the open out-file
+};
+
+/*
+ * State of the out-file sequence at a checkpoint
+ */
+struct restart_state
+{
+    restart_record record{};
+    std::vector<uint64_t> file_sizes;            // Sizes of the closed out-files
+    std::vector<traj_format::index_entry> index; // Frame index of the open out-file
+};
+
+/*
+ * Reads the states stored in the file `name`; returns none if it is missing or invalid
+ */
+inline std::vector<restart_state> read_restart_states(const std::string &name)
+{
+    std::vector<restart_state> states;
+
+    std::ifstream in(name, std::ios::binary);
+
+    restart_state state;
+
+    while (in.read(reinterpret_cast<char *>(&state.record), sizeof(state.record)))
+    {
+        if (std::memcmp(state.record.magic, restart_magic, sizeof(restart_magic)) != 0)
+        {
+            return {};
+        }
+
+        state.file_sizes.resize(state.record.nfiles);
+        state.index.resize(state.record.nindex);
+
+        if (!in.read(reinterpret_cast<char *>(state.file_sizes.data()), state.file_sizes.size() * sizeof(uint64_t))
+            || !in.read(reinterpret_cast<char *>(state.index.data()), state.index.size() * sizeof(traj_format::index_entry)))
+        {
+            return {}; // Truncated
+        }
+
+        states.push_back(state);
+    }
+
+    return states;
+}
+
+/*
+ * Stores the states in the file `name`, replacing it atomically once the new file is on the disk.
+ * Returns false on error.
+ */
+inline bool write_restart_states(const std::string &name, const std::vector<restart_state> &states)
+{
+    std::vector<char> data;
+
+    for (const restart_state &state : states)
+    {
+        const char *record = reinterpret_cast<const char *>(&state.record);
+        const char *sizes = reinterpret_cast<const char *>(state.file_sizes.data());
+        const char *index = reinterpret_cast<const char *>(state.index.data());
+
+        data.insert(data.end(), record, record + sizeof(state.record));
+        data.insert(data.end(), sizes, sizes + state.file_sizes.size() * sizeof(uint64_t));
+        data.insert(data.end(), index, index + state.index.size() * sizeof(traj_format::index_entry));
+    }
+
+    const std::string tmp_name = name + ".tmp";
+
+    const int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = write_all(fd, data.data(), data.size()) && ::fsync(fd) == 0;
+
+    ok = ::close(fd) == 0 && ok;
+
+    return ok && std::rename(tmp_name.c_str(), name.c_str()) == 0;
+}
+
+/*
+ * Packed frame waiting to be written
+ */
+struct frame_buffer
+{
+    aligned_buffer data; // Packed frame
+
+    deferred_positions positions; // Coordinates quantized by the writer thread
+
+    aligned_buffer compressed; // Compressed frame (writer thread), swapped with `data`
+
+    int64_t step{0};  // Time step (for the index)
+    double time{0.0}; // Time (for the index)
+
+    uint32_t fields{0};   // Fields written into the frame
+    int natoms_global{0}; // Number of atoms in the out-file: the system, or the atom selection
+
+    bool starts_file{false}; // First frame of a new out-file
+};
+
+/*
+ * Writes frames into a series of out-files on a background thread.
+ *
+ * `push` packs the frame into a pre-allocated ring of frame buffers and
+ * returns immediately; it blocks only when all `queue_depth` buffers are
+ * waiting to be written. `close` drains the queue and joins the thread.
+ *
+ * With domain decomposition every PP rank owns a writer with `shard` set to
+ * its rank; it writes its home atoms and their global indices into shard
+ * files `<file_name>.NNNNNN.rankRRRR.<ext>`, without any communication.
+ *
+ * Every closed and renamed out-file is listed in the manifest `<file_name>.manifest` (see
+ * traj_manifest), shared by all shards.
+ *
+ * `atoms` (e.g. masses) are written once into the static section of every out-file;
+ * `options` select the encoding of the frames. With `options.keyframe_interval`, the first
+ * frame of every out-file and every n-th frame are keyframes, and the frames in between are
+ * delta frames (see traj_format); all frames are then compressed. `io` selects how the
+ * out-files are written (see output_file).
+ *
+ * With a `budget`, the writer thread does not start a new out-file while the out-files not yet
+ * acknowledged by the consumer would exceed it: it waits for the consumer, and `push` blocks once
+ * the queue is full (back-pressure), so the disk never fills up. With `budget.reduced_stride`,
+ * `push` instead keeps only every n-th frame while more than half of the budget is used, so the
+ * consumer can catch up while the simulation runs at full speed; the files still never exceed the
+ * budget. The budget is checked whenever a new out-file is started. `throttle` overrides the
+ * decision of the writer thread, so shards can follow the one of shard 0.
+ *
+ * A new out-file is started every `frames_per_file` frames (0 for no limit) or earlier, once the
+ * frames reach `rotation.max_bytes` or span `rotation.max_seconds` of wall time; `rotate` starts one
+ * with the next frame. The decision is taken in `push`, so it does not depend on the speed of the
+ * writer thread. With `stripe`, the out-files are spread over several directories.
+ *
+ * `checkpoint` stores the state of the out-file sequence along with a checkpoint of the simulation,
+ * and `resume` continues the sequence from it after a restart instead of starting again.
+ */
+class writer
+{
+public:
+    writer(const std::string &file_name,
+           const std::string &file_name_ext,
+           int frames_per_file,
+           int queue_depth,
+           static_data atoms = {},
+           int shard = -1,
+           format_options options = {},
+           io_options io = {},
+           budget_options budget = {},
+           rotation_options rotation = {},
+           stripe_options stripe = {})
+        : out_file_name(file_name),
+          out_file_name_ext(file_name_ext),
+          N_out_frames_per_file(frames_per_file),
+          out_rotation(rotation),
+          out_stripe(std::move(stripe)),
+          out_shard(shard),
+          out_static(std::move(atoms)),
+          out_options(options),
+          out_io(io),
+          out_budget(std::move(budget)),
+          ring(queue_depth > 0 ? queue_depth : 1)
+    {
+        if (out_budget.ack_file.empty())
+        {
+            out_budget.ack_file = out_file_name + ".ack";
+        }
+    }
+
+    ~writer()
+    {
+        close();
+    }
+
+    writer(const writer &) = delete;
+    writer &operator=(const writer &) = delete;
+
+    /*
+     * Packs the frame into a free buffer and queues it for writing.
+     * Returns false if the background thread failed to write an earlier frame.
+     */
+    template <typename Real>
+    bool push(const frame_view<Real> &fr)
+    {
+        // Frames of out-files kept from before a restart
+        if (fr.step < skip_before_step)
+        {
+            return true;
+        }
+
+        // Reduced output stride while the consumer falls behind
+        const bool reduced = throttle_decision >= 0 ? throttle_decision > 0 : throttled.load(std::memory_order_relaxed);
+
+        if (!reduced)
+        {
+            throttled_frames = 0;
+        }
+        else if (throttled_frames++ % out_budget.reduced_stride != 0)
+        {
+            dropped_frames++;
+            return true;
+        }
+
+        last_step = fr.step;
+
+        // Size of the frame as held by the consumer, the same for all shards
+        const uint64_t frame_bytes = max_frame_size(fr.natoms_global, fr.fields(), out_options);
+
+        const bool starts_file = rotation_due(frame_bytes);
+
+        if (starts_file)
+        {
+            file_frames = 0;
+            file_bytes = 0;
+            file_start = std::chrono::steady_clock::now();
+            rotate_requested = false;
+        }
+
+        file_frames++;
+        file_bytes += frame_bytes;
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (error)
+        {
+            return false;
+        }
+
+        // Start the writer thread on the first frame
+        if (!thread.joinable())
+        {
+            stop = false;
+            thread = std::thread(&writer::run, this);
+        }
+
+        // Wait for a free buffer
+        if (queued == ring.size())
+        {
+            const auto start = std::chrono::steady_clock::now();
+
+            not_full.wait(lock, [this] { return queued < ring.size() || error; });
+
+            blocked_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        if (error)
+        {
+            return false;
+        }
+
+        frame_buffer &buf = ring[(head + queued) % ring.size()];
+
+        // The buffer is not visible to the writer thread until `queued` is incremented
+        lock.unlock();
+
+        buf.data.resize(max_frame_size(fr.natoms, fr.fields(), out_options));
+        buf.data.resize(pack_frame(buf.data.data(), fr, out_options, &buf.positions));
+
+        // Fields as encoded in the frame header
+        traj_format::frame_header h;
+        std::memcpy(&h, buf.data.data(), sizeof(h));
+
+        buf.step = fr.step;
+        buf.time = fr.time;
+        buf.fields = h.fields;
+        buf.natoms_global = fr.natoms_global;
+        buf.starts_file = starts_file;
+
+        lock.lock();
+        queued++;
+        lock.unlock();
+
+        queued_frames++;
+
+        not_empty.notify_one();
+
+        return true;
+    }
+
+    /*
+     * Starts a new out-file with the next pushed frame
+     */
+    void rotate()
+    {
+        rotate_requested = true;
+    }
+
+    /*
+     * Returns true if more than half of the budget is used, so the writer thread reduces the output stride
+     */
+    bool throttling() const
+    {
+        return throttled.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Reduces the output stride of the next pushed frames, or not, instead of the writer thread
+     * (e.g. as decided by another shard, so all shards keep the same frames)
+     */
+    void throttle(bool reduce)
+    {
+        throttle_decision = reduce ? 1 : 0;
+    }
+
+    /*
+     * Returns the wall time since the first frame of the current out-file was pushed (seconds)
+     */
+    double file_seconds() const
+    {
+        return file_frames > 0 ? std::chrono::duration<double>(std::chrono::steady_clock::now() - file_start).count() : 0.0;
+    }
+
+    /*
+     * Writes all queued frames, stops the writer thread and renames the last out-file.
+     * Returns false if any frame could not be written.
+     */
+    bool close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+
+        not_empty.notify_one();
+
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+
+        if (!out_file_close())
+        {
+            error = true;
+        }
+
+        // The end of the run, for a restart from its last checkpoint
+        if (!restart_file.empty() && !error)
+        {
+            if (!store_state(current_state(last_step + 1, true)))
+            {
+                error = true;
+            }
+
+            restart_file.clear();
+        }
+
+        return !error;
+    }
+
+    /*
+     * Waits until all queued frames are written, flushes them to the disk and stores the state of the
+     * out-file sequence in `state_file`, for a checkpoint of the simulation at `step` taken before the
+     * frame of this step is pushed. The state of the previous checkpoint is kept as well, in case the
+     * simulation stops before its own checkpoint is complete. Returns false on error.
+     */
+    bool checkpoint(const std::string &state_file, int64_t step)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        not_full.wait(lock, [this] { return queued == 0 || error; });
+
+        // The writer thread waits for the next frame: the file and its state are used here
+        if (error || (is_open && !out_file.sync()))
+        {
+            return false;
+        }
+
+        restart_state state = current_state(step, false);
+
+        lock.unlock();
+
+        restart_file = state_file;
+
+        return store_state(state);
+    }
+
+    /*
+     * Continues the out-file sequence from the state stored by `checkpoint` in `state_file` for
+     * `step`, or the newest earlier one, after the simulation restarted from its checkpoint at `step`.
+     * The out-file open at the checkpoint is truncated after its last complete frame of an earlier
+     * step and appended to. If it has been closed (by the run that stopped) or processed by the
+     * consumer since, it is kept and the next out-file that is neither is written instead; the frames
+     * up to the last step of the kept out-files (from the manifest, or the index of the file) are
+     * skipped. Sets `resumed_step` to the step of the state used, -1 if there is none (the sequence
+     * starts again). Call before the first `push`. Returns false on error.
+     */
+    bool resume(const std::string &state_file, int64_t step, int64_t &resumed_step)
+    {
+        resumed_step = -1;
+
+        restart_file = state_file;
+
+        const std::vector<restart_state> states = read_restart_states(state_file);
+
+        const restart_state *state = nullptr; // Newest state up to `step`
+        const restart_state *end = nullptr;   // End of the run after it
+
+        for (const restart_state &s : states)
+        {
+            if (s.record.step <= step && (!state || s.record.step > state->record.step))
+            {
+                state = &s;
+            }
+        }
+
+        if (!state)
+        {
+            return true;
+        }
+
+        for (const restart_state &s : states)
+        {
+            if (s.record.closed && s.record.step > state->record.step)
+            {
+                end = &s;
+            }
+        }
+
+        resumed_step = state->record.step;
+
+        N_out_frame_counter = static_cast<int>(state->record.frames);
+        out_file_sizes = state->file_sizes;
+
+        // The run ended after the checkpoint: its frames are skipped and the next out-file is written
+        if (state->record.closed || end)
+        {
+            const restart_record &last = end ? end->record : state->record;
+
+            skip_before_step = last.step;
+            N_out_frame_counter = static_cast<int>(last.frames);
+            out_file_sizes = end ? end->file_sizes : state->file_sizes;
+            resumed_bytes = closed_bytes();
+
+            return true;
+        }
+
+        // Out-file open at the checkpoint, if any
+        const int file = static_cast<int>(state->record.nfiles);
+
+        const long processed = acknowledged_files();
+
+        const int directory = out_stripe.directories.size() > state->record.directory ? static_cast<int>(state->record.directory) : 0;
+
+        if (state->record.nindex > 0 && file >= processed && closed_file_directory(file) < 0 && file_exists(file_name(file, directory)))
+        {
+            out_header = state->record.header;
+            out_index = state->index;
+            out_offset = state->record.offset;
+            out_directory = directory;
+            out_file_name_to_close = file_name(file, directory);
+
+            if (out_static_section.empty())
+            {
+                out_static.pack(out_static_section, out_header.natoms);
+            }
+
+            // For preallocation: the remaining frames of the mean size of the written ones
+            const uint64_t frame_size = (out_offset - out_index[0].offset) / out_index.size();
+            const uint64_t frames = std::max<uint64_t>(expected_frames(), out_index.size());
+            const uint64_t expected_size = out_offset + (frames - out_index.size()) * frame_size + frames * sizeof(traj_format::index_entry)
+                                           + sizeof(traj_format::index_trailer);
+
+            if (!out_file.reopen(out_file_name_to_close, out_offset, expected_size, out_io))
+            {
+                return false; // Error opening the out-file
+            }
+
+            is_open = true;
+
+            // The rotation continues with the frames in the out-file, counted as `push` does: the
+            // largest size of their fields before encoding, not their size in the out-file
+            const uint32_t fields = out_header.fields
+                                    & (traj_format::field_mass | traj_format::field_x | traj_format::field_v | traj_format::field_f
+                                       | traj_format::field_vv | traj_format::field_index | traj_format::field_average);
+
+            file_frames = out_index.size();
+            file_bytes = out_index.size() * max_frame_size(out_header.natoms, fields, out_options);
+            file_start = std::chrono::steady_clock::now();
+
+            resumed_bytes = closed_bytes() + out_offset;
+
+            return true;
+        }
+
+        // Closed or processed since: the next out-file that is neither, after the out-files of the stopped run
+        int next = state->record.nindex > 0 ? file + 1 : file;
+
+        while (next < processed || closed_file_directory(next) >= 0)
+        {
+            next++;
+        }
+
+        N_out_frame_counter -= state->record.nindex;
+
+        for (int f = file; f < next; f++)
+        {
+            traj_manifest::entry kept{};
+
+            if (!closed_file_entry(f, kept))
+            {
+                return false; // Neither in the manifest nor on the disk: its frames are unknown
+            }
+
+            // The frames the kept out-files hold are not written again
+            skip_before_step = kept.last_step + 1;
+            N_out_frame_counter += static_cast<int>(kept.frames);
+
+            if (f >= static_cast<int>(out_file_sizes.size()))
+            {
+                out_file_sizes.push_back(kept.bytes);
+            }
+        }
+
+        resumed_bytes = closed_bytes();
+
+        return true;
+    }
+
+    /*
+     * Returns the number of frames skipped with the reduced output stride of the budget
+     */
+    uint64_t dropped() const
+    {
+        return dropped_frames;
+    }
+
+    /*
+     * Returns the time `push` waited for a free buffer because the queue was full (seconds)
+     */
+    double blocked() const
+    {
+        return blocked_seconds;
+    }
+
+    /*
+     * Returns the number of frames queued by `push`, without the skipped and dropped ones
+     */
+    uint64_t frames() const
+    {
+        return queued_frames;
+    }
+
+    /*
+     * Returns the number of bytes written into the out-files by this process, after `close`
+     */
+    uint64_t bytes() const
+    {
+        return closed_bytes() - resumed_bytes;
+    }
+
+private:
+    const std::string out_file_name;     // Output file name without file extension
+    const std::string out_file_name_ext; // Output file extension
+
+    const int N_out_frames_per_file; // Maximum number of frames in each out-file, 0 for no limit
+
+    const rotation_options out_rotation; // Other limits of each out-file
+
+    const stripe_options out_stripe; // Directories of the out-files
+
+    const int out_shard; // Rank of the shard writer, or -1 for a single file
+
+    const static_data out_static; // Static per-atom data
+
+    const format_options out_options; // Encoding of the frames
+
+    const io_options out_io; // How the out-files are written
+
+    budget_options out_budget; // Limits on the unprocessed out-files
+
+    std::vector<uint64_t> out_file_sizes; // Size of every closed out-file (writer thread)
+
+    std::atomic<bool> throttled{false}; // More than half of the budget is used (set by the writer thread)
+
+    int throttle_decision{-1};    // Reduced output stride set by `throttle`, -1 to follow `throttled`
+    uint64_t throttled_frames{0}; // Frames pushed since the output stride was reduced
+    uint64_t dropped_frames{0};   // Frames skipped with the reduced output stride
+
+    uint64_t queued_frames{0}; // Frames queued by `push`
+    uint64_t resumed_bytes{0}; // Size of the out-files written before a restart, or of their written part when reopened
+
+    int64_t skip_before_step{INT64_MIN}; // Frames of earlier steps are in out-files kept from before a restart
+
+    uint64_t file_frames{0}; // Frames pushed into the current out-file
+    uint64_t file_bytes{0};  // Size of these frames as held by the consumer (bytes)
+
+    std::chrono::steady_clock::time_point file_start; // Time the first frame of the current out-file was pushed
+
+    bool rotate_requested{false}; // Set by `rotate`
+
+    uint64_t last_file_frames{0}; // Number of frames in the last closed out-file (writer thread)
+
+    std::string restart_file; // State file of `checkpoint` and `resume`, updated by `close`
+
+    int64_t last_step{-1}; // Step of the last pushed frame
+
+    double blocked_seconds{0.0}; // Time `push` waited for a free buffer (seconds)
+
+    std::vector<char> out_static_section; // Packed static section
+
+    int N_out_frame_counter{0}; // Counts written frames
+
+    output_file out_file; // Current out-file
+
+    bool is_open{false}; // Output file is open
+
+    uint64_t out_offset{0}; // Offset of the next frame in the output file
+
+    traj_format::file_header out_header{}; // Header of the output file, rewritten on close
+
+    std::vector<traj_format::index_entry> out_index; // Frame index of the output file
+
+    std::string out_file_name_to_close; // Current output file name (used to add extension)
+
+    int out_directory{0}; // Stripe directory of the current output file
+
+    std::vector<frame_buffer> ring; // Ring of frame buffers
+
+    std::vector<char> compress_scratch; // Scratch of the compressor (writer thread)
+
+    aligned_buffer delta_reference; // Previous frame before the XOR, for delta frames (writer thread)
+
+    int delta_frames{0}; // Number of frames since the last keyframe (writer thread)
+
+    size_t head{0};   // Index of the oldest queued frame
+    size_t queued{0}; // Number of queued frames
+
+    bool stop{false};  // Set by `close`
+    bool error{false}; // Set by the writer thread
+
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    std::thread thread;
+
+    /*
+     * Writer thread: writes queued frames in order until stopped and the queue is empty
+     */
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            not_empty.wait(lock, [this] { return queued > 0 || stop; });
+
+            if (queued == 0)
+            {
+                break; // Stopped and drained
+            }
+
+            frame_buffer &buf = ring[head];
+
+            lock.unlock();
+
+            // Quantize the coordinates here rather than in the MD step
+            if (buf.positions.pending)
+            {
+                buf.positions.encode(buf.data.data());
+            }
+
+            if (out_options.keyframe_interval > 1)
+            {
+                delta_frame(buf);
+            }
+
+            if (out_options.compress || out_options.keyframe_interval > 1)
+            {
+                compress_frame(buf.data, buf.compressed, compress_scratch, out_options.chunk_size);
+                buf.data.swap(buf.compressed);
+                buf.fields |= traj_format::field_compressed;
+            }
+
+            bool ok = write_frame(buf);
+            lock.lock();
+
+            head = (head + 1) % ring.size();
+            queued--;
+
+            if (!ok)
+            {
+                error = true;
+            }
+
+            not_full.notify_one();
+        }
+    }
+
+    /*
+     * Stores the frame as a delta frame, or keeps it as a keyframe at the start of an out-file,
+     * every `keyframe_interval` frames and whenever its fields or size change
+     */
+    void delta_frame(frame_buffer &buf)
+    {
+        bool keyframe = buf.starts_file || delta_frames >= out_options.keyframe_interval
+                        || delta_reference.size() != buf.data.size();
+
+        if (!keyframe)
+        {
+            traj_format::frame_header h;
+            traj_format::frame_header previous;
+
+            std::memcpy(&h, buf.data.data(), sizeof(h));
+            std::memcpy(&previous, delta_reference.data(), sizeof(previous));
+
+            keyframe = h.fields != previous.fields;
+        }
+
+        if (keyframe)
+        {
+            // Keyframe
+            delta_reference.resize(buf.data.size());
+            std::memcpy(delta_reference.data(), buf.data.data(), buf.data.size());
+
+            delta_frames = 1;
+
+            return;
+        }
+
+        delta_encode(buf.data, delta_reference);
+        buf.fields |= traj_format::field_delta;
+
+        delta_frames++;
+    }
+
+    /*
+     * Appends the frame index, correctly closes the output file and renames it adding the extension
+     */
+    bool out_file_close()
+    {
+        if (is_open)
+        {
+            is_open = false;
+
+            traj_format::index_trailer trailer{};
+            trailer.nframes = out_index.size();
+            trailer.offset = out_offset;
+            std::memcpy(trailer.magic, traj_format::index_magic, sizeof(trailer.magic));
+
+            // The file header records all fields written into the file
+            bool ok = out_file.append(reinterpret_cast<const char *>(out_index.data()), out_index.size() * sizeof(traj_format::index_entry))
+                      && out_file.append(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+
+            ok = out_file.close(&out_header, sizeof(out_header)) && ok;
+
+            if (!ok)
+            {
+                return false; // Error writing the index or flushing the file
+            }
+
+            // Full file name with extension
+            std::string new_file_name = out_file_name_to_close + "." + out_file_name_ext;
+
+            // Add file extension
+            if (std::rename(out_file_name_to_close.c_str(), new_file_name.c_str()) != 0)
+            {
+                return false; // Error renaming file
+            }
+
+            // The file is ready for the consumer
+            const traj_manifest::entry ready{new_file_name, out_index.front().step, out_index.back().step, out_index.size(), out_file.size()};
+
+            if (!traj_manifest::append_entry(traj_manifest::manifest_name(out_file_name), ready))
+            {
+                return false; // Error appending to the manifest
+            }
+
+            out_file_sizes.push_back(out_file.size());
+            last_file_frames = out_index.size();
+        }
+
+        return true;
+    }
+
+    /*
+     * Returns true if the next frame, of `frame_bytes` bytes as held by the consumer, starts a new out-file
+     */
+    bool rotation_due(uint64_t frame_bytes) const
+    {
+        if (file_frames == 0 || rotate_requested)
+        {
+            return true;
+        }
+
+        if (N_out_frames_per_file > 0 && file_frames >= static_cast<uint64_t>(N_out_frames_per_file))
+        {
+            return true;
+        }
+
+        if (out_rotation.max_bytes > 0 && file_bytes + frame_bytes > out_rotation.max_bytes)
+        {
+            return true;
+        }
+
+        return out_rotation.max_seconds > 0.0 && file_seconds() >= out_rotation.max_seconds;
+    }
+
+    /*
+     * Returns the total size of the closed out-files (bytes)
+     */
+    uint64_t closed_bytes() const
+    {
+        uint64_t total = 0;
+
+        for (uint64_t size : out_file_sizes)
+        {
+            total += size;
+        }
+
+        return total;
+    }
+
+    /*
+     * Returns the expected number of frames in an out-file, for preallocation and the budget: the
+     * frames of the last out-file if its size or duration is limited, otherwise `frames_per_file`
+     */
+    uint64_t expected_frames() const
+    {
+        const bool limited = out_rotation.max_bytes > 0 || out_rotation.max_seconds > 0.0;
+
+        if ((limited || N_out_frames_per_file <= 0) && last_file_frames > 0)
+        {
+            return last_file_frames;
+        }
+
+        return N_out_frames_per_file > 0 ? N_out_frames_per_file : 1;
+    }
+
+    /*
+     * Returns the manifest entry of closed out-file `index` or, if it is not in the manifest,
+     * the last step and number of frames from the index of the file. Returns false if neither exists.
+     */
+    bool closed_file_entry(int index, traj_manifest::entry &e) const
+    {
+        if (traj_manifest::find_entry(traj_manifest::manifest_name(out_file_name), closed_file_name(index, 0), e))
+        {
+            return true;
+        }
+
+        const int directory = closed_file_directory(index);
+
+        e.file = closed_file_name(index, directory >= 0 ? directory : 0);
+
+        std::ifstream in(e.file, std::ios::binary | std::ios::ate);
+
+        traj_format::index_trailer trailer{};
+        traj_format::index_entry first{};
+        traj_format::index_entry last{};
+
+        const std::streamoff size = in ? static_cast<std::streamoff>(in.tellg()) : 0;
+
+        if (size < static_cast<std::streamoff>(sizeof(trailer))
+            || !in.seekg(size - sizeof(trailer)).read(reinterpret_cast<char *>(&trailer), sizeof(trailer))
+            || std::memcmp(trailer.magic, traj_format::index_magic, sizeof(trailer.magic)) != 0 || trailer.nframes == 0
+            || !in.seekg(trailer.offset).read(reinterpret_cast<char *>(&first), sizeof(first))
+            || !in.seekg(trailer.offset + (trailer.nframes - 1) * sizeof(last)).read(reinterpret_cast<char *>(&last), sizeof(last)))
+        {
+            return false; // Not closed, or written by a version without index
+        }
+
+        e.first_step = first.step;
+        e.last_step = last.step;
+        e.frames = trailer.nframes;
+        e.bytes = size;
+
+        return true;
+    }
+
+    /*
+     * Returns the state of the out-file sequence before the frame of `step`; `closed` after `close`
+     */
+    restart_state current_state(int64_t step, bool closed) const
+    {
+        restart_state state;
+
+        std::memcpy(state.record.magic, restart_magic, sizeof(restart_magic));
+        state.record.step = step;
+        state.record.frames = N_out_frame_counter;
+        state.record.offset = is_open ? out_offset : 0;
+        state.record.header = out_header;
+        state.record.nfiles = out_file_sizes.size();
+        state.record.nindex = is_open ? out_index.size() : 0;
+        state.record.closed = closed ? 1 : 0;
+        state.record.directory = is_open ? out_directory : 0;
+
+        state.file_sizes = out_file_sizes;
+
+        if (is_open)
+        {
+            state.index = out_index;
+        }
+
+        return state;
+    }
+
+    /*
+     * Stores the state in `restart_file` together with the newest earlier one. Returns false on error.
+     */
+    bool store_state(restart_state state) const
+    {
+        std::vector<restart_state> states;
+
+        for (restart_state &s : read_restart_states(restart_file))
+        {
+            if (s.record.step < state.record.step && (states.empty() || s.record.step > states[0].record.step))
+            {
+                states.assign(1, std::move(s));
+            }
+        }
+
+        states.push_back(std::move(state));
+
+        return write_restart_states(restart_file, states);
+    }
+
+    /*
+     * Returns the number of out-files the consumer has acknowledged, 0 if none
+     */
+    long acknowledged_files() const
+    {
+        std::ifstream ack(out_budget.ack_file);
+
+        long files = 0;
+
+        if (!(ack >> files) || files < 0)
+        {
+            return 0;
+        }
+
+        return files;
+    }
+
+    /*
+     * Returns the name of out-file `index` in stripe directory `directory` without the extension, while it is written
+     */
+    std::string file_name(int index, int directory) const
+    {
+        std::string fname = out_stripe.directories.empty() ? out_file_name
+                                                            : out_stripe.directories[directory] + "/" + traj_manifest::base_name(out_file_name);
+
+        fname += "." + zero_pad(index, 6);
+
+        if (out_shard >= 0)
+        {
+            fname += ".rank" + zero_pad(out_shard, 4);
+        }
+
+        return fname;
+    }
+
+    /*
+     * Returns the name of out-file `index` in stripe directory `directory` once it is closed
+     */
+    std::string closed_file_name(int index, int directory) const
+    {
+        return file_name(index, directory) + "." + out_file_name_ext;
+    }
+
+    /*
+     * Returns the stripe directory of closed out-file `index`, or -1 if it does not exist
+     */
+    int closed_file_directory(int index) const
+    {
+        const int ndirectories = out_stripe.directories.empty() ? 1 : static_cast<int>(out_stripe.directories.size());
+
+        for (int d = 0; d < ndirectories; d++)
+        {
+            if (file_exists(closed_file_name(index, d)))
+            {
+                return d;
+            }
+        }
+
+        return -1;
+    }
+
+    /*
+     * Returns the stripe directory for the new out-file `index`
+     */
+    int choose_directory(int index) const
+    {
+        const int ndirectories = static_cast<int>(out_stripe.directories.size());
+
+        if (ndirectories <= 1)
+        {
+            return 0;
+        }
+
+        if (!out_stripe.free_space)
+        {
+            return (index + (out_shard > 0 ? out_shard : 0)) % ndirectories;
+        }
+
+        int best = 0;
+        uint64_t best_space = 0;
+
+        for (int d = 0; d < ndirectories; d++)
+        {
+            struct statvfs st;
+
+            if (::statvfs(out_stripe.directories[d].c_str(), &st) == 0 && static_cast<uint64_t>(st.f_bavail) * st.f_frsize > best_space)
+            {
+                best = d;
+                best_space = static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+            }
+        }
+
+        return best;
+    }
+
+    /*
+     * Returns true if the file `name` exists
+     */
+    static bool file_exists(const std::string &name)
+    {
+        struct stat st;
+
+        return ::stat(name.c_str(), &st) == 0;
+    }
+
+    /*
+     * Returns true if the unprocessed out-files fit into `fraction` of the budget together
+     * with the next out-file of `expected_size` bytes, if the consumer has processed `processed` files
+     */
+    bool within_budget(int processed, uint64_t expected_size, double fraction) const
+    {
+        const int files = static_cast<int>(out_file_sizes.size()) - processed + 1;
+
+        uint64_t bytes = expected_size;
+
+        for (size_t i = processed; i < out_file_sizes.size(); i++)
+        {
+            bytes += out_file_sizes[i];
+        }
+
+        return (out_budget.max_files <= 0 || files <= fraction * out_budget.max_files)
+               && (out_budget.max_bytes == 0 || bytes <= fraction * out_budget.max_bytes);
+    }
+
+    /*
+     * Waits until the next out-file of `expected_size` bytes fits into the budget and sets the
+     * reduced output stride if more than half of the budget is used
+     */
+    void wait_for_budget(uint64_t expected_size)
+    {
+        if (out_budget.max_files <= 0 && out_budget.max_bytes == 0)
+        {
+            return;
+        }
+
+        // An acknowledgement left by an earlier run does not apply to this one
+        if (out_file_sizes.empty())
+        {
+            std::remove(out_budget.ack_file.c_str());
+        }
+
+        while (true)
+        {
+            const long acknowledged = acknowledged_files();
+            const int processed = acknowledged < static_cast<long>(out_file_sizes.size()) ? static_cast<int>(acknowledged) : static_cast<int>(out_file_sizes.size());
+
+            throttled.store(out_budget.reduced_stride > 1 && !within_budget(processed, expected_size, 0.5), std::memory_order_relaxed);
+
+            // A single out-file larger than the budget is still written
+            if (within_budget(processed, expected_size, 1.0) || static_cast<int>(out_file_sizes.size()) == processed)
+            {
+                return;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    /*
+     * Writes entire packed frame to the out-file, opening a new file if needed
+     */
+    bool write_frame(const frame_buffer &buf)
+    {
+        // Should we create a new file or not (decided by `push`)
+        bool new_file = buf.starts_file || !is_open;
+
+        if (new_file)
+        {
+            // Close and rename the output file if needed
+            if (!out_file_close())
+            {
+                return false;
+            }
+
+            // Full file name (without extension): the files are numbered in the order they are closed
+            const int index = static_cast<int>(out_file_sizes.size());
+
+            out_directory = choose_directory(index);
+
+            std::string fname = file_name(index, out_directory);
+
+            // Save the file name for renaming purposes later
+            out_file_name_to_close = fname;
+
+            // File header and static section
+            out_header = traj_format::make_file_header(buf.fields, out_static.fields(), buf.natoms_global, sizeof(float_type), out_options.layout);
+
+            if (out_static_section.empty())
+            {
+                out_static.pack(out_static_section, buf.natoms_global);
+            }
+
+            // Expected size of the file, for preallocation and the budget: all frames of the size of the first one
+            const uint64_t expected_size = sizeof(out_header) + out_static_section.size()
+                                           + expected_frames() * (buf.data.size() + sizeof(traj_format::index_entry))
+                                           + sizeof(traj_format::index_trailer);
+
+            // Wait for the consumer if the unprocessed out-files use up the budget
+            wait_for_budget(expected_size);
+
+            // Open binary file for writing
+            if (!out_file.open(fname, expected_size, out_io))
+            {
+                return false; // Error opening file
+            }
+
+            is_open = true;
+
+            if (!out_file.append(reinterpret_cast<const char *>(&out_header), sizeof(out_header))
+                || !out_file.append(out_static_section.data(), out_static_section.size()))
+            {
+                return false;
+            }
+
+            out_offset = sizeof(out_header) + out_static_section.size();
+            out_index.clear();
+        }
+
+        out_header.fields |= buf.fields;
+        out_index.push_back({out_offset, buf.step, buf.time});
+
+        // The whole frame in a single write
+        if (!out_file.append(buf.data.data(), buf.data.size()))
+        {
+            return false; // Error writing the frame
+        }
+
+        out_offset += buf.data.size();
+
+        N_out_frame_counter++;
+
+        return true;
+    }
+};
+
+} // namespace traj_writer
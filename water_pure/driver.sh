@@ -6,6 +6,9 @@ set -e
 # Number of output files to wait (excluding the initial traj.000000.out file):
 FILES=5
 
+# Number of PP ranks writing shard files under domain decomposition (third argument, 0 = single out-file)
+RANKS=${3:-0}
+
 # Path where the output files should be moved
 EXTRENAL_PATH="test_output"
 
@@ -27,15 +30,27 @@ for ((i=0; i<=$FILES; i++)); do
     # Convert the number to a string with leading zeros to make it 6 digits
     i_prefixed=$(printf "%06d" "$i")
 
-    # File to wait for
-    file_to_read="traj.${i_prefixed}.out"
+    if [ "$RANKS" -gt 0 ]; then
 
-    echo -e "${RED}Waiting for ${file_to_read} to be created...\n${RESET}"
+        # Shard prefix to wait for (one traj.NNNNNN.rankRRRR.out file per rank)
+        file_to_read="traj.${i_prefixed}"
 
-    # Wait until the file is created
-    while [ ! -f "${file_to_read}" ]; do
-        sleep 1  # Wait for 1 second before checking again
-    done
+        echo -e "${RED}Waiting for ${RANKS} shards of ${file_to_read} to be created...\n${RESET}"
+
+        # Wait until mdrun has closed all shards (listed in traj.manifest, which also gives their paths)
+        files_to_remove=$(./read_traj.exe wait:traj.manifest ${file_to_read} ${RANKS})
+
+    else
+
+        # File to wait for
+        file_to_read="traj.${i_prefixed}.out"
+
+        echo -e "${RED}Waiting for ${file_to_read} to be created...\n${RESET}"
+
+        # Wait until mdrun has closed the file (listed in traj.manifest, which also gives its path)
+        files_to_remove=$(./read_traj.exe wait:traj.manifest ${file_to_read})
+
+    fi
 
     # Call the reader
     echo -e "${RED}-- reading $file_to_read...${RESET}"
@@ -52,9 +67,14 @@ for ((i=0; i<=$FILES; i++)); do
         mv -v "$file" "${path_to_move}/$new_file"
     done
 
-    # Clean up
+    # Clean up (the files may be in other directories with GMX_OUT_DIRS)
     echo -e "${RED}-- cleaning up...${RESET}"
-    rm -v ${file_to_read}
+    rm -v ${files_to_remove}
+
+    # Acknowledge the processed files, which frees their space in the budget of mdrun
+    # (GMX_OUT_MAX_FILES / GMX_OUT_MAX_BYTES); written under another name first so mdrun never reads a partial file
+    echo $((i + 1)) > traj.ack.tmp
+    mv traj.ack.tmp traj.ack
 
     # Done
     echo
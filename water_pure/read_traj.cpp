@@ -1,141 +1,165 @@
 #include <array>
 #include <fstream>
+#include <set>
 
 #include "traj_reader/reader.hpp"
+#include "traj_writer/binning.hpp"
 
-/*
- * Returns x^3
- */
-template <typename T>
-T cube(const T x) noexcept
-{
-    return x * x * x;
-}
-
-// Number of grids for post-processing
-constexpr auto N_grids{3};
+using traj_binning::cube;
+using traj_binning::N_grids;
 
 // Grids for post-processing
 std::array<int, N_grids> grids = {0, 0, 0};
 
 /*
- * Output data structure
+ * Bins a single frame and appends its records to the output files.
+ * Frames without coordinates or velocities are skipped. Returns 0 on success.
  */
-struct Data
+int bin_frame(traj_reader::frame &fr, int natoms, traj_binning::grid_binning &data, traj_binning::grid_output &output)
 {
-    std::array<std::vector<double>, N_grids> dens;
+    // Reset statistics
+    data.reset();
 
-    std::array<std::vector<double>, N_grids> mom_x;
-    std::array<std::vector<double>, N_grids> mom_y;
-    std::array<std::vector<double>, N_grids> mom_z;
+    // Frame header (frame number, current time step, number of atoms, current time, box size)
+    int64_t step = fr.step;
+    int atoms = fr.natoms;
+    float time = fr.time; // [ps]
+    float L = fr.box.x;   // [nm]
 
-    std::array<std::vector<double>, N_grids> ekin_xx;
-    std::array<std::vector<double>, N_grids> ekin_yy;
-    std::array<std::vector<double>, N_grids> ekin_zz;
-    std::array<std::vector<double>, N_grids> ekin_xy;
-    std::array<std::vector<double>, N_grids> ekin_xz;
-    std::array<std::vector<double>, N_grids> ekin_yz;
+    // Contiguous x, y, z arrays (no-op for files written with GMX_OUT_LAYOUT=soa)
+    traj_reader::to_soa(fr);
 
-    std::array<double, N_grids> cell_volume;
+    const traj_reader::float_soa &rs = fr.r_soa; // Coordinates
+    const traj_reader::float_soa &vs = fr.v_soa; // Velocities
 
-    double time{0.0};
+    // fr.f_soa - Force vectors - NOT USED
 
-    int step{0};
+    // Frames written only for other fields (e.g. forces every `nstfout` steps) are skipped
+    if (rs.empty() || vs.empty())
+    {
+        return 0;
+    }
 
-    /*
-     * Resets statistics
-     */
-    void reset()
+    if ((atoms != natoms) || (natoms != static_cast<int>(rs.size())))
     {
-        for (int i = 0; i < N_grids; ++i)
-        {
-            dens[i].clear();
-            mom_x[i].clear();
-            mom_y[i].clear();
-            mom_z[i].clear();
-            ekin_xx[i].clear();
-            ekin_yy[i].clear();
-            ekin_zz[i].clear();
-            ekin_xy[i].clear();
-            ekin_xz[i].clear();
-            ekin_yz[i].clear();
-
-            dens[i].resize(cube(grids[i]), 0.0);
-            mom_x[i].resize(cube(grids[i]), 0.0);
-            mom_y[i].resize(cube(grids[i]), 0.0);
-            mom_z[i].resize(cube(grids[i]), 0.0);
-            ekin_xx[i].resize(cube(grids[i]), 0.0);
-            ekin_yy[i].resize(cube(grids[i]), 0.0);
-            ekin_zz[i].resize(cube(grids[i]), 0.0);
-            ekin_xy[i].resize(cube(grids[i]), 0.0);
-            ekin_xz[i].resize(cube(grids[i]), 0.0);
-            ekin_yz[i].resize(cube(grids[i]), 0.0);
-
-            cell_volume[i] = 0.0;
-        }
+        std::cerr << "\nERROR: Inconsistent number of atoms.\n";
+        return 1;
+    }
 
-        time = 0.0;
-        step = 0;
+    // Bin the atoms into all grids (wrapped into the box)
+    if (!data.add(natoms, rs.x.data(), rs.y.data(), rs.z.data(), vs.x.data(), vs.y.data(), vs.z.data(), 1, fr.mass.data(), L))
+    {
+        std::cerr << "\nERROR: Incorrect Control Volume index.\n";
+        return 1;
     }
 
-    Data()
+    // Update averaged values
+    data.finish(time, step, L);
+
+    // Add frame to the output files
+    if (!output.write(data))
     {
-        reset();
+        std::cerr << "\nERROR: Could not save data.\n";
+        return 1;
     }
-};
+
+    return 0;
+}
 
 /*
- * Writes a single float value in binary format
+ * Bins the frames that mdrun publishes into the shared-memory ring `name` (GMX_OUT_SHM)
+ * until the run ends, writing files of `frames_per_file` records: output_<N>.NNNNNN.dat
  */
-inline void write_float(std::ofstream &f, float val)
+int read_shm(const std::string &name, int frames_per_file)
 {
-    f.write(reinterpret_cast<char *>(&val), sizeof(float));
+    traj_reader::shm_reader ring;
+
+    std::cout << "\nREADER: Waiting for the shared-memory ring " << name << "..." << std::endl;
+
+    if (!ring.open(name))
+    {
+        std::cerr << "\nERROR: Could not attach to the shared-memory ring.\n";
+        return 1;
+    }
+
+    const int natoms = ring.file_header().natoms;
+
+    std::cout << "\nREADER: Processing frames of " << natoms << " atoms..." << std::endl;
+
+    traj_binning::grid_binning data(grids);
+    traj_binning::grid_output output(grids, frames_per_file);
+
+    traj_reader::frame fr;
+
+    while (ring.read(fr))
+    {
+        if (bin_frame(fr, natoms, data, output))
+        {
+            return 1;
+        }
+    }
+
+    if (!ring.finished() || !output.close())
+    {
+        std::cerr << "\nERROR: Could not read all frames or save data.\n";
+        return 1;
+    }
+
+    std::cout << "\n...done: " << ring.sequence() << " frame(s), " << ring.dropped() << " skipped by mdrun.\n";
+
+    return 0;
 }
 
 /*
- * Saves data to data files in binary format
+ * Waits until mdrun has closed the out-file `filename` or, for a shard prefix (e.g. "traj.000003"),
+ * `nshards` shards of it, as listed in the manifest `manifest` (e.g. "traj.manifest"), and prints
+ * their paths, one per line (in another directory if the out-files are striped, GMX_OUT_DIRS).
+ * Returns 0 once they are ready.
  */
-int save_data_bin(const std::vector<Data> &collection)
+int wait_manifest(const std::string &manifest, const std::string &filename, int nshards)
 {
-    for (int ng = 0; ng < N_grids; ++ng)
+    traj_reader::manifest_watcher watcher;
+
+    if (!watcher.open(manifest))
     {
-        std::ofstream outfile;
+        std::cerr << "\nERROR: Could not watch the manifest " << manifest << ".\n";
+        return 1;
+    }
 
-        std::string fname = "output_" + std::to_string(grids[ng]) + ".dat";
+    const std::string shard_prefix = filename + ".rank";
 
-        outfile.open(fname, std::ios::binary);
+    std::set<std::string> shards; // Paths of the closed shards of the prefix
 
-        if (outfile && outfile.is_open())
+    traj_manifest::entry e;
+
+    while (watcher.next(e))
+    {
+        const std::string name = traj_manifest::base_name(e.file);
+
+        if (nshards <= 0 && name == filename)
         {
-            for (const auto &data : collection)
-            {
-                write_float(outfile, data.time);
-                write_float(outfile, data.cell_volume[ng]);
+            std::cout << e.file << std::endl;
+            return 0;
+        }
+
+        if (nshards > 0 && name.compare(0, shard_prefix.size(), shard_prefix) == 0)
+        {
+            shards.insert(e.file);
 
-                for (int ind = 0; ind < data.dens[ng].size(); ++ind)
+            if (static_cast<int>(shards.size()) >= nshards)
+            {
+                for (const std::string &shard : shards)
                 {
-                    write_float(outfile, data.dens[ng][ind]);
-                    write_float(outfile, data.mom_x[ng][ind]);
-                    write_float(outfile, data.mom_y[ng][ind]);
-                    write_float(outfile, data.mom_z[ng][ind]);
-                    write_float(outfile, data.ekin_xx[ng][ind]);
-                    write_float(outfile, data.ekin_yy[ng][ind]);
-                    write_float(outfile, data.ekin_zz[ng][ind]);
-                    write_float(outfile, data.ekin_xy[ng][ind]);
-                    write_float(outfile, data.ekin_xz[ng][ind]);
-                    write_float(outfile, data.ekin_yz[ng][ind]);
+                    std::cout << shard << "\n";
                 }
-            }
 
-            outfile.close();
-        }
-        else
-        {
-            return -1; // Error opening file
+                return 0;
+            }
         }
     }
 
-    return 0;
+    std::cerr << "\nERROR: Could not read the manifest " << manifest << ".\n";
+    return 1;
 }
 
 /*
@@ -146,7 +170,7 @@ int main(int argc, char *argv[])
     // Check if filename and box size arguments are provided
     if (argc < 3)
     {
-        std::cerr << "ERROR: No file name and/or box size provided.\n";
+        std::cerr << "ERROR: No file name (or shard prefix, shm:<name> or wait:<manifest>) and/or box size provided.\n";
         return 1;
     }
 
@@ -154,32 +178,36 @@ int main(int argc, char *argv[])
     std::string filename = argv[1];
     std::string boxsize = argv[2];
 
-    // Set grids for averaging
-    if (boxsize == "7")
+    // Waits for an out-file (or its shards) listed in the manifest of mdrun, e.g.
+    // "wait:traj.manifest traj.000003.out" or "wait:traj.manifest traj.000003 4"
+    if (filename.compare(0, 5, "wait:") == 0)
     {
-        grids = {2, 5, 10};
+        return wait_manifest(filename.substr(5), argv[2], argc > 3 ? std::stoi(argv[3]) : 0);
     }
-    else if (boxsize == "10")
-    {
-        grids = {3, 7, 15};
-    }
-    else if (boxsize == "15")
-    {
-        grids = {5, 10, 22};
-    }
-    else
+
+    // Set grids for averaging
+    if (!traj_binning::grids_for_box(boxsize, grids))
     {
         std::cerr << "ERROR: Box size (second argument) should be 7, 10 or 15.\n";
         return 1;
     }
 
+    // Frames published into shared memory by mdrun (GMX_OUT_SHM), e.g. "shm:traj"
+    if (filename.compare(0, 4, "shm:") == 0)
+    {
+        return read_shm(filename.substr(4), 1000);
+    }
+
     std::cout << "\nREADER: Reading " << filename << " (L = " << boxsize << " nm)..." << std::endl;
 
     // Array of frames
     traj_reader::traj trj;
 
-    // Reads trajectory
-    int natoms = traj_reader::read(filename, trj);
+    // Reads trajectory: a single out-file, or all shards of an out-file
+    // written under domain decomposition if the name has no ".out" extension (e.g. "traj.000003")
+    bool is_shard_prefix = filename.size() < 4 || filename.compare(filename.size() - 4, 4, ".out") != 0;
+
+    int natoms = is_shard_prefix ? traj_reader::read_shards(filename, trj) : traj_reader::read(filename, trj);
 
     // Number of frames
     int nframes = trj.size();
@@ -207,156 +235,23 @@ int main(int argc, char *argv[])
 
     std::cout << "\nREADER: Processing..." << std::endl;
 
-    // Output data
-    Data data;
-    std::vector<Data> collection;
+    // Output data: statistics of a frame, written into output_<N>.dat
+    traj_binning::grid_binning data(grids);
+    traj_binning::grid_output output(grids);
 
     // Loop over frames
     for (int i = 0; i < nframes; ++i)
     {
-        // Reset statistics
-        data.reset();
-
-        // Frame header (frame number, current time step, number of atoms, current time, box size)
-        int step = trj[i].step;
-        int atoms = trj[i].natoms;
-        float time = trj[i].time; // [ps]
-        float L = trj[i].box.x;   // [nm]
-
-        if ((atoms != natoms) || (natoms != trj[i].r.size()))
+        if (bin_frame(trj[i], natoms, data, output))
         {
-            std::cerr << "\nERROR: Inconsistent number of atoms.\n";
             return 1;
         }
-
-        // Loop over atoms
-        for (int n = 0; n < natoms; ++n)
-        {
-            float mass = trj[i].mass[n]; // Atom's mass
-
-            traj_reader::float_vec r = trj[i].r[n]; // Coordinate vector
-            traj_reader::float_vec v = trj[i].v[n]; // Velocity vector
-
-            // traj_reader::float_vec f = trj[i].f[n]; // Force vector - NOT USED
-
-            // PBC
-            while (r.x < 0.0)
-            {
-                r.x += L;
-            }
-            while (r.y < 0.0)
-            {
-                r.y += L;
-            }
-            while (r.z < 0.0)
-            {
-                r.z += L;
-            }
-            while (r.x >= L)
-            {
-                r.x -= L;
-            }
-            while (r.y >= L)
-            {
-                r.y -= L;
-            }
-            while (r.z >= L)
-            {
-                r.z -= L;
-            }
-
-            // Loop over grids
-            for (int ng = 0; ng < N_grids; ++ng) // for (const auto &N : grids)
-            {
-                // Control volumes: N x N x N
-                int N = grids[ng];
-
-                // Local indexes
-                int i = (r.x / L) * N;
-                int j = (r.y / L) * N;
-                int k = (r.z / L) * N;
-
-                // Should never happen
-                if (i < 0 || i >= N || j < 0 || j >= N || k < 0 || k >= N)
-                {
-                    std::cerr << "\nERROR: Incorrect Control Volume index.\n";
-                    return 1;
-                }
-
-                // Global index (0..N^3-1)
-                int ind = i + N * j + N * N * k;
-
-                // Density
-                data.dens[ng][ind] += mass;
-
-                // Momentum
-                data.mom_x[ng][ind] += mass * v.x;
-                data.mom_y[ng][ind] += mass * v.y;
-                data.mom_z[ng][ind] += mass * v.z;
-
-                // Velocity tensor
-                data.ekin_xx[ng][ind] += mass * v.x * v.x;
-                data.ekin_yy[ng][ind] += mass * v.y * v.y;
-                data.ekin_zz[ng][ind] += mass * v.z * v.z;
-                data.ekin_xy[ng][ind] += mass * v.x * v.y;
-                data.ekin_xz[ng][ind] += mass * v.x * v.z;
-                data.ekin_yz[ng][ind] += mass * v.y * v.z;
-
-                // Time and step
-                data.time = time;
-                data.step = step;
-
-            } // Grids
-
-        } // Atoms
-
-        // Update averaged values.
-        // Loop over grids.
-        for (int ng = 0; ng < N_grids; ++ng)
-        {
-            // Control volumes: N x N x N
-            int N = grids[ng];
-            int N3 = cube<int>(N);
-
-            // CV volume [nm]
-            const double V_cell = cube<double>(L / N);
-
-            data.cell_volume[ng] = V_cell;
-
-            // Loop over cells in the grid
-            for (int ind = 0; ind < N3; ++ind)
-            {
-                data.dens[ng][ind] /= V_cell;
-
-                data.mom_x[ng][ind] /= V_cell;
-                data.mom_y[ng][ind] /= V_cell;
-                data.mom_z[ng][ind] /= V_cell;
-
-                data.ekin_xx[ng][ind] /= (data.dens[ng][ind] * V_cell);
-                data.ekin_yy[ng][ind] /= (data.dens[ng][ind] * V_cell);
-                data.ekin_zz[ng][ind] /= (data.dens[ng][ind] * V_cell);
-                data.ekin_xy[ng][ind] /= (data.dens[ng][ind] * V_cell);
-                data.ekin_xz[ng][ind] /= (data.dens[ng][ind] * V_cell);
-                data.ekin_yz[ng][ind] /= (data.dens[ng][ind] * V_cell);
-            }
-        }
-
-        // Add frame to collection of frames
-        try
-        {
-            collection.emplace_back(data);
-        }
-        catch (const std::exception &e)
-        {
-            std::cerr << "\nERROR: " << e.what() << "\nOut of memory?\n";
-        }
-
-    } // Frames
+    }
 
     std::cout << "\n...done.\n";
     std::cout << "\nREADER: Writing..." << std::endl;
 
-    if (save_data_bin(collection))
+    if (!output.close())
     {
         std::cerr << "\nERROR: Could not save data.\n";
         return 1;
@@ -72,6 +72,9 @@ for model in "${models[@]}"; do
         # Prints box size and the model type
         echo -e "${YELLOW}\n======== Model: ${model^^} :: box size = $L x $L x $L nm ========${RESET}"
 
+        # Remove the manifest of the previous run, so the driver only sees the out-files of the next one
+        rm -f traj.manifest
+
         # Start driver
         echo -e "${YELLOW}\nStarting driver...${RESET}"
         ./driver.sh ${model^^} $L &